@@ -0,0 +1,114 @@
+// Loopback echo: `connections` clients each send a message and wait for it to come back, as fast as they can.
+// Server and clients run on the same scheduler, all io goes through the reactor polled by its idle workers.
+//
+// usage: echo-bench [connections=64] [seconds=3] [tcp|unix] [message bytes=64]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "io/socket.hpp"
+#include "schedule/task.hpp"
+
+using namespace co;
+
+deferred_token<> Serve( socket_stream stream )
+{
+   std::byte buffer[4096];
+   while(true) {
+      int64_t received = co_await stream.read( buffer );
+      if(received <= 0) break;
+      int64_t sent = co_await stream.write( std::span<const std::byte>( buffer, size_t( received ) ) );
+      if(sent < 0) break;
+   }
+}
+
+task<int> AcceptAll( socket_listener& listener, uint count )
+{
+   for(uint i = 0; i < count; ++i) {
+      socket_stream stream = co_await listener.accept();
+      if(!stream.IsOpen()) {
+         printf( "accept failed: %s\n", strerror( stream.Error() ) );
+         co_return -1;
+      }
+      Serve( std::move( stream ) ).Launch();
+   }
+   co_return 0;
+}
+
+task<uint64_t> Client( bool useTcp, uint16_t port, const char* path, size_t messageSize, const std::atomic<bool>& stop )
+{
+   socket_stream stream;
+   if(useTcp) {
+      stream = co_await connect_tcp( "127.0.0.1", port );
+   } else {
+      stream = co_await connect_unix( path );
+   }
+   if(!stream.IsOpen()) {
+      printf( "connect failed: %s\n", strerror( stream.Error() ) );
+      co_return 0;
+   }
+
+   std::vector<std::byte> message( messageSize, std::byte( 'x' ) );
+   std::vector<std::byte> reply( messageSize );
+   uint64_t requests = 0;
+   while(!stop.load( std::memory_order_relaxed )) {
+      if(co_await stream.write( message ) < 0) break;
+      size_t received = 0;
+      while(received < messageSize) {
+         int64_t count = co_await stream.read( std::span<std::byte>( reply ).subspan( received ) );
+         if(count <= 0) co_return requests;
+         received += size_t( count );
+      }
+      requests++;
+   }
+   co_return requests;
+}
+
+int main( int argc, char** argv )
+{
+   uint connections = argc > 1 ? uint( atoi( argv[1] ) ) : 64;
+   double seconds = argc > 2 ? atof( argv[2] ) : 3.0;
+   bool useTcp = argc > 3 ? strcmp( argv[3], "unix" ) != 0 : true;
+   size_t messageSize = argc > 4 ? size_t( atoi( argv[4] ) ) : 64;
+
+   Scheduler& scheduler = Scheduler::Get();
+
+   std::string path = "/tmp/co-echo-bench." + std::to_string( getpid() );
+   socket_listener listener = useTcp ? listen_tcp( "127.0.0.1", 0, int( connections ) ) : listen_unix( path.c_str(), int( connections ) );
+   if(!listener.IsOpen()) {
+      printf( "listen failed: %s\n", strerror( listener.Error() ) );
+      return 1;
+   }
+
+   auto accepting = AcceptAll( listener, connections );
+
+   std::atomic<bool> stop = false;
+   std::vector<task<uint64_t>> clients;
+   for(uint i = 0; i < connections; ++i) {
+      clients.push_back( Client( useTcp, listener.Port(), path.c_str(), messageSize, stop ) );
+   }
+   if(accepting.Result() != 0) return 1;
+
+   auto start = std::chrono::steady_clock::now();
+   std::this_thread::sleep_for( std::chrono::duration<double>( seconds ) );
+   stop = true;
+
+   uint64_t requests = 0;
+   for(auto& client: clients) {
+      requests += client.Result();
+   }
+   double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+   if(!useTcp) unlink( path.c_str() );
+   printf( "%s echo, %u workers, %u connections, %zu byte messages: %llu requests in %.2fs, %.0f requests/s\n",
+           useTcp ? "tcp" : "unix", scheduler.GetWorkerCount(), connections, messageSize,
+           (unsigned long long)requests, elapsed, double( requests ) / elapsed );
+   return 0;
+}
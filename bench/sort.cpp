@@ -0,0 +1,101 @@
+// `parallel_sort` and `parallel_radix_sort` against `std::sort`, on schedulers of 1, 4, 16 and all cores.
+// Every run sorts a fresh copy of the same random keys.
+//
+// usage: sort-bench [keys=20000000] [u32|u64|f32|f64]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "schedule/sort.hpp"
+#include "schedule/task.hpp"
+
+using namespace co;
+
+template<typename Sort>
+deferred_task<int> RunSort( Sort& sort )
+{
+   co_await sort();
+   co_return 0;
+}
+
+template<typename Sort>
+double TimeOn( Scheduler& scheduler, Sort&& sort )
+{
+   auto start = std::chrono::steady_clock::now();
+   auto job = RunSort( sort );
+   job.Launch( scheduler );
+   job.Result();
+   return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+template<typename T>
+bool Run( size_t keyCount )
+{
+   std::mt19937_64 random( 42 );
+   std::vector<T> keys( keyCount );
+   for(T& key: keys) {
+      if constexpr( std::is_floating_point_v<T> ) {
+         key = T( std::normal_distribution<double>( 0.0, 1e6 )( random ) );
+      } else {
+         key = T( random() );
+      }
+   }
+
+   std::vector<T> expected = keys;
+   auto start = std::chrono::steady_clock::now();
+   std::sort( expected.begin(), expected.end() );
+   double stdMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+   printf( "%zu keys, std::sort %.1fms\n", keyCount, stdMs );
+   printf( "%8s %14s %8s %14s %8s\n", "workers", "parallel_sort", "speedup", "radix_sort", "speedup" );
+
+   uint allCores = std::thread::hardware_concurrency();
+   for(uint workerCount: { 1u, 4u, 16u, allCores }) {
+      SchedulerConfig config;
+      config.workerCount = workerCount;
+      config.name = L"sort bench";
+      Scheduler scheduler( config );
+
+      std::vector<T> data = keys;
+      double mergeMs = TimeOn( scheduler, [&] { return parallel_sort( std::span<T>( data ) ); } );
+      if(data != expected) {
+         printf( "parallel_sort: wrong order\n" );
+         return false;
+      }
+
+      data = keys;
+      double radixMs = TimeOn( scheduler, [&] { return parallel_radix_sort( std::span<T>( data ) ); } );
+      if(data != expected) {
+         printf( "parallel_radix_sort: wrong order\n" );
+         return false;
+      }
+
+      printf( "%8u %12.1fms %7.2fx %12.1fms %7.2fx%s\n", scheduler.GetWorkerCount(), mergeMs, stdMs / mergeMs,
+              radixMs, stdMs / radixMs, workerCount > allCores ? " (more workers than cores)" : "" );
+   }
+   return true;
+}
+
+int main( int argc, char** argv )
+{
+   size_t keyCount = argc > 1 ? size_t( atoll( argv[1] ) ) : 20'000'000;
+   const char* type = argc > 2 ? argv[2] : "u32";
+
+   bool sorted;
+   if(strcmp( type, "u64" ) == 0) {
+      sorted = Run<uint64_t>( keyCount );
+   } else if(strcmp( type, "f32" ) == 0) {
+      sorted = Run<float>( keyCount );
+   } else if(strcmp( type, "f64" ) == 0) {
+      sorted = Run<double>( keyCount );
+   } else {
+      sorted = Run<uint32_t>( keyCount );
+   }
+   return sorted ? 0 : 1;
+}
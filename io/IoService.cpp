@@ -0,0 +1,225 @@
+#include "IoService.hpp"
+
+#include <thread>
+#include <vector>
+
+#include "IoUring.hpp"
+#include "Reactor.hpp"
+#include "../schedule/LockQueue.hpp"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+using namespace co;
+
+// epoll cannot wait on regular files (they are always "ready"), so without io_uring the calls simply block,
+// on threads of their own instead of the workers
+class co::BlockingIoPool
+{
+public:
+   static constexpr uint kThreadCount = 4;
+
+   BlockingIoPool()
+   {
+      for(uint i = 0; i < kThreadCount; ++i) {
+         mThreads.emplace_back( [this] { ThreadEntry(); } );
+         SetThreadName( mThreads.back(), L"Blocking IO" );
+      }
+   }
+
+   ~BlockingIoPool()
+   {
+      mIsRunning.store( false, std::memory_order_release );
+      mHasRequest.Trigger();
+      for(std::thread& thread: mThreads) {
+         thread.join();
+      }
+   }
+
+   void Submit( std::span<io_op* const> ops )
+   {
+      for(io_op* op: ops) {
+         mRequests.Enqueue( op );
+      }
+      mHasRequest.Trigger();
+   }
+
+protected:
+   static int64_t Execute( const io_request& request )
+   {
+#if defined(_WIN32)
+      DWORD bytes = 0;
+      OVERLAPPED overlapped = {};
+      overlapped.Offset = DWORD( request.offset );
+      overlapped.OffsetHigh = DWORD( request.offset >> 32 );
+      BOOL ok = FALSE;
+      switch(request.op) {
+      case eIoOp::Read:
+      case eIoOp::ReadFixed:
+         ok = ReadFile( request.file, request.buffer, request.size, &bytes, &overlapped );
+         // reading at the end of file is not an error, it reads nothing
+         if(!ok && GetLastError() == ERROR_HANDLE_EOF) return 0;
+         break;
+      case eIoOp::Write:
+      case eIoOp::WriteFixed:
+         ok = WriteFile( request.file, request.buffer, request.size, &bytes, &overlapped );
+         break;
+      case eIoOp::Fsync:
+         ok = FlushFileBuffers( request.file );
+         break;
+      }
+      return ok ? int64_t( bytes ) : -int64_t( GetLastError() );
+#else
+      ssize_t result = 0;
+      do {
+         switch(request.op) {
+         case eIoOp::Read:
+         case eIoOp::ReadFixed:
+            result = pread( request.file, request.buffer, request.size, off_t( request.offset ) );
+            break;
+         case eIoOp::Write:
+         case eIoOp::WriteFixed:
+            result = pwrite( request.file, request.buffer, request.size, off_t( request.offset ) );
+            break;
+         case eIoOp::Fsync:
+            result = fsync( request.file );
+            break;
+         }
+      } while(result < 0 && errno == EINTR);
+      return result < 0 ? -int64_t( errno ) : int64_t( result );
+#endif
+   }
+
+   void ThreadEntry()
+   {
+      while(true) {
+         io_op* op;
+         if(mRequests.Dequeue( op )) {
+            // more than one thread's worth of requests, pass the signal on
+            if(mRequests.Count() > 0) mHasRequest.Trigger();
+            op->result.Set( Execute( op->request ) );
+            continue;
+         }
+         if(!mIsRunning.load( std::memory_order_acquire )) break;
+         mHasRequest.Wait();
+      }
+      // wake up the next one so it sees the shutdown too
+      mHasRequest.Trigger();
+   }
+
+   LockQueue<io_op*> mRequests;
+   SysEvent mHasRequest;
+   std::atomic<bool> mIsRunning = true;
+   std::vector<std::thread> mThreads;
+};
+
+#if defined(__linux__)
+// the ring's fd reads ready while there are completions to reap
+class IoService::RingSource final: public ReactorSource
+{
+public:
+   explicit RingSource( IoService& service ): mService( service ) {}
+   void OnReady( uint32_t ) override { mService.Reap(); }
+protected:
+   IoService& mService;
+};
+#else
+class IoService::RingSource {};
+#endif
+
+static eIoBackend gDefaultBackend = eIoBackend::Auto;
+
+IoService& IoService::Get()
+{
+   // never destroyed, there can be requests in flight during static destruction
+   static IoService* service = new IoService( gDefaultBackend );
+   return *service;
+}
+
+void IoService::SetDefaultBackend( eIoBackend backend )
+{
+   gDefaultBackend = backend;
+}
+
+IoService::IoService( eIoBackend backend )
+{
+   if(backend != eIoBackend::ThreadPool) {
+      mRing = IoUring::Create( 256 );
+      ASSERT_DIE( mRing != nullptr || backend == eIoBackend::Auto );
+   }
+#if defined(__linux__)
+   if(mRing != nullptr) {
+      mRingSource = std::make_unique<RingSource>( *this );
+      bool added = Reactor::Get().AddLevelTriggered( mRing->Fd(), *mRingSource );
+      ASSERT_DIE( added );
+   }
+#endif
+   if(mRing == nullptr) {
+      mPool = std::make_unique<BlockingIoPool>();
+   }
+}
+
+IoService::~IoService()
+{
+#if defined(__linux__)
+   if(mRing != nullptr) {
+      Reactor::Get().Remove( mRing->Fd(), std::move( mRingSource ) );
+   }
+#endif
+}
+
+eIoBackend IoService::Backend() const
+{
+   return mRing ? eIoBackend::IoUring : eIoBackend::ThreadPool;
+}
+
+void IoService::Submit( std::span<io_op* const> ops, Scheduler& scheduler )
+{
+   if(ops.empty()) return;
+#if defined(__linux__)
+   if(mRing) {
+      Reactor::Get().Expect( scheduler, int64_t( ops.size() ) );
+      // a submitter that fills up the completion ring reaps it itself
+      mRing->Submit( ops, []( void* service ) { static_cast<IoService*>( service )->Reap(); }, this );
+      return;
+   }
+#endif
+   (void)scheduler;
+   mPool->Submit( ops );
+}
+
+void IoService::Cancel( const io_op& op )
+{
+#if defined(__linux__)
+   if(mRing) mRing->Cancel( op, []( void* service ) { static_cast<IoService*>( service )->Reap(); }, this );
+#else
+   (void)op;
+#endif
+}
+
+#if !defined(_WIN32)
+bool IoService::RegisterBuffers( std::span<const iovec> buffers )
+{
+   return mRing ? mRing->RegisterBuffers( buffers ) : true;
+}
+#endif
+
+void IoService::Reap()
+{
+#if defined(__linux__)
+   int64_t reaped = 0;
+   mRing->Reap( [&reaped]( uint64_t userData, int32_t result ) {
+      // a cancel request, the op it's about completes on its own
+      if(userData == IoUring::kCancelUserData) return;
+      reaped++;
+      io_op* op = reinterpret_cast<io_op*>( uintptr_t( userData ) );
+      op->result.Set( int64_t( result ) );
+   } );
+   if(reaped > 0) Reactor::Get().Done( reaped );
+#endif
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include "../schedule/future.hpp"
+#include "../schedule/scheduler.hpp"
+
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
+
+namespace co
+{
+#if defined(_WIN32)
+using native_file_t = void*;
+#else
+using native_file_t = int;
+#endif
+
+enum class eIoOp: uint8_t
+{
+   Read,
+   Write,
+   Fsync,
+   ReadFixed,  // into a buffer registered with `IoService::RegisterBuffers`
+   WriteFixed,
+};
+
+struct io_request
+{
+   eIoOp op = eIoOp::Read;
+   native_file_t file = {};
+   uint64_t offset = 0;
+   void* buffer = nullptr;
+   uint32_t size = 0;
+   uint16_t bufferIndex = 0;
+};
+
+/**
+ * \brief One io operation in flight. The result is the byte count (0 for fsync) or `-errno`, and can be awaited,
+ *        or blocked on with `result.Get()`. It has to stay put until it completes.
+ */
+struct io_op
+{
+   io_request request;
+   future<int64_t> result;
+
+   auto operator co_await() & noexcept { return result.operator co_await(); }
+};
+
+class IoUring;
+class BlockingIoPool;
+
+enum class eIoBackend: uint8_t
+{
+   Auto,       // io_uring when the kernel lets us, the thread pool otherwise
+   IoUring,
+   ThreadPool, // blocking calls on a few dedicated threads
+};
+
+/**
+ * \brief Runs file io for coroutines without taking workers out of the pool.
+ *        With io_uring, requests go to the kernel directly from the submitting thread and the ring is one more fd on
+ *        the `Reactor`: completions are reaped by the scheduler's idle workers, no thread sits in between.
+ *        Completions reschedule the waiting coroutine on the scheduler it runs on.
+ */
+class IoService final
+{
+public:
+   // the process wide service, created on first use
+   static IoService& Get();
+   // has to be called before the first `Get` to have any effect
+   static void SetDefaultBackend( eIoBackend backend );
+
+   explicit IoService( eIoBackend backend );
+   ~IoService();
+
+   eIoBackend Backend() const;
+
+   // Hand the requests to the kernel, one syscall for the lot (as long as they fit the submission ring). More than the
+   // completion ring holds are fine too, the submitter reaps the ring itself until they fit.
+   // `scheduler` polls for the completions, it's the one the waiting coroutines run on
+   void Submit( std::span<io_op* const> ops, Scheduler& scheduler );
+   void Submit( io_op& op, Scheduler& scheduler ) { io_op* ops[] = { &op }; Submit( ops, scheduler ); }
+   // Cut `op`, submitted already, short if the backend can: it completes early with `-ECANCELED`. It still completes,
+   // and nothing can go away before it does. The thread pool cannot, the op runs its course there
+   void Cancel( const io_op& op );
+
+#if !defined(_WIN32)
+   // Pin buffers for `eIoOp::ReadFixed`/`WriteFixed`, saves mapping them on every request. Once per service.
+   // The pages count against RLIMIT_MEMLOCK.
+   // Always works on the thread pool backend, where fixed requests are plain ones
+   bool RegisterBuffers( std::span<const iovec> buffers );
+#endif
+
+protected:
+   // complete whatever the kernel is done with
+   void Reap();
+
+   class RingSource;
+
+   std::unique_ptr<IoUring> mRing;
+   std::unique_ptr<RingSource> mRingSource;
+   std::unique_ptr<BlockingIoPool> mPool;
+};
+}
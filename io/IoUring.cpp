@@ -0,0 +1,188 @@
+#include "IoUring.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace co;
+
+static int IoUringSetup( uint entries, io_uring_params& params )
+{
+   return int( syscall( __NR_io_uring_setup, entries, &params ) );
+}
+
+static int IoUringEnter( int fd, uint toSubmit, uint minComplete, uint flags, const void* arg, size_t argSize )
+{
+   return int( syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize ) );
+}
+
+std::unique_ptr<IoUring> IoUring::Create( uint entries )
+{
+   io_uring_params params;
+   memset( &params, 0, sizeof(params) );
+   int fd = IoUringSetup( entries, params );
+   if(fd < 0) return nullptr;
+
+   std::unique_ptr<IoUring> ring( new IoUring() );
+   ring->mFd = fd;
+
+   ring->mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+   ring->mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+   bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+   if(singleMap) {
+      ring->mSqRingSize = ring->mCqRingSize = std::max( ring->mSqRingSize, ring->mCqRingSize );
+   }
+
+   void* sq = mmap( nullptr, ring->mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+   if(sq == MAP_FAILED) return nullptr;
+   ring->mSqRing = sq;
+
+   void* cq = sq;
+   if(!singleMap) {
+      cq = mmap( nullptr, ring->mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+      if(cq == MAP_FAILED) return nullptr;
+   }
+   ring->mCqRing = cq;
+
+   ring->mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+   void* sqes = mmap( nullptr, ring->mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+   if(sqes == MAP_FAILED) return nullptr;
+   ring->mSqes = static_cast<io_uring_sqe*>( sqes );
+
+   auto* sqBytes = static_cast<char*>( sq );
+   ring->mSqHead = reinterpret_cast<uint32_t*>( sqBytes + params.sq_off.head );
+   ring->mSqTail = reinterpret_cast<uint32_t*>( sqBytes + params.sq_off.tail );
+   ring->mSqMask = *reinterpret_cast<uint32_t*>( sqBytes + params.sq_off.ring_mask );
+   ring->mSqEntries = params.sq_entries;
+   // the indirection array is identity, the entry for tail `t` is always `sqes[t & mask]`
+   auto* array = reinterpret_cast<uint32_t*>( sqBytes + params.sq_off.array );
+   for(uint32_t i = 0; i < params.sq_entries; ++i) {
+      array[i] = i;
+   }
+
+   auto* cqBytes = static_cast<char*>( cq );
+   ring->mCqHead = reinterpret_cast<uint32_t*>( cqBytes + params.cq_off.head );
+   ring->mCqTail = reinterpret_cast<uint32_t*>( cqBytes + params.cq_off.tail );
+   ring->mCqMask = *reinterpret_cast<uint32_t*>( cqBytes + params.cq_off.ring_mask );
+   ring->mCqes = reinterpret_cast<io_uring_cqe*>( cqBytes + params.cq_off.cqes );
+   ring->mCqEntries = params.cq_entries;
+   return ring;
+}
+
+IoUring::~IoUring()
+{
+   if(mSqes != nullptr) munmap( mSqes, mSqesSize );
+   if(mCqRing != nullptr && mCqRing != mSqRing) munmap( mCqRing, mCqRingSize );
+   if(mSqRing != nullptr) munmap( mSqRing, mSqRingSize );
+   if(mFd >= 0) close( mFd );
+}
+
+static void PrepareEntry( io_uring_sqe& sqe, const io_request& request, uint64_t userData )
+{
+   memset( &sqe, 0, sizeof(sqe) );
+   sqe.fd = request.file;
+   sqe.off = request.offset;
+   sqe.addr = uint64_t( uintptr_t( request.buffer ) );
+   sqe.len = request.size;
+   sqe.user_data = userData;
+   switch(request.op) {
+   case eIoOp::Read:       sqe.opcode = IORING_OP_READ; break;
+   case eIoOp::Write:      sqe.opcode = IORING_OP_WRITE; break;
+   case eIoOp::Fsync:      sqe.opcode = IORING_OP_FSYNC; sqe.addr = 0; sqe.len = 0; break;
+   case eIoOp::ReadFixed:  sqe.opcode = IORING_OP_READ_FIXED; sqe.buf_index = request.bufferIndex; break;
+   case eIoOp::WriteFixed: sqe.opcode = IORING_OP_WRITE_FIXED; sqe.buf_index = request.bufferIndex; break;
+   }
+}
+
+void IoUring::Enter( uint toSubmit, reap_fn reap, void* context )
+{
+   while(toSubmit > 0) {
+      int submitted = IoUringEnter( mFd, toSubmit, 0, 0, nullptr, 0 );
+      if(submitted < 0) {
+         // EAGAIN/EBUSY: the completion ring is backed up. Reap it from here, the reapers may all be submitting as well
+         ASSERT_DIE( errno == EAGAIN || errno == EBUSY || errno == EINTR );
+         reap( context );
+         std::this_thread::yield();
+         continue;
+      }
+      toSubmit -= uint( submitted );
+   }
+}
+
+void IoUring::MakeRoom( reap_fn reap, void* context )
+{
+   // the completions are only reaped by idle workers otherwise, and the submitter can well be the only worker there is
+   while(true) {
+      reap( context );
+      if(mInFlight.load( std::memory_order_acquire ) < mCqEntries) return;
+      // another thread is reaping, or nothing completed yet: wait for the next completion
+      int entered = IoUringEnter( mFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 );
+      ASSERT_DIE( entered >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY );
+   }
+}
+
+io_uring_sqe& IoUring::NextEntry( uint32_t& tail, reap_fn reap, void* context )
+{
+   bool submissionFull = tail - std::atomic_ref<uint32_t>( *mSqHead ).load( std::memory_order_acquire ) == mSqEntries;
+   bool completionFull = mInFlight.load( std::memory_order_acquire ) >= mCqEntries;
+   if(submissionFull || completionFull) {
+      // push what we have to the kernel to make room
+      Flush( tail, reap, context );
+      if(completionFull) MakeRoom( reap, context );
+   }
+   io_uring_sqe& sqe = mSqes[tail & mSqMask];
+   tail++;
+   mSqPending++;
+   mInFlight.fetch_add( 1, std::memory_order_relaxed );
+   return sqe;
+}
+
+void IoUring::Flush( uint32_t tail, reap_fn reap, void* context )
+{
+   std::atomic_ref<uint32_t>( *mSqTail ).store( tail, std::memory_order_release );
+   Enter( mSqPending, reap, context );
+   mSqPending = 0;
+}
+
+void IoUring::Submit( std::span<io_op* const> ops, reap_fn reap, void* context )
+{
+   std::scoped_lock guard( mSubmitLock );
+   uint32_t tail = *mSqTail;
+   for(io_op* op: ops) {
+      PrepareEntry( NextEntry( tail, reap, context ), op->request, uint64_t( uintptr_t( op ) ) );
+   }
+   Flush( tail, reap, context );
+}
+
+void IoUring::Cancel( const io_op& op, reap_fn reap, void* context )
+{
+   std::scoped_lock guard( mSubmitLock );
+   uint32_t tail = *mSqTail;
+   io_uring_sqe& sqe = NextEntry( tail, reap, context );
+   memset( &sqe, 0, sizeof(sqe) );
+   sqe.opcode = IORING_OP_ASYNC_CANCEL;
+   sqe.addr = uint64_t( uintptr_t( &op ) );
+   sqe.user_data = kCancelUserData;
+   Flush( tail, reap, context );
+}
+
+bool IoUring::RegisterBuffers( std::span<const iovec> buffers )
+{
+   return syscall( __NR_io_uring_register, mFd, IORING_REGISTER_BUFFERS, buffers.data(), uint( buffers.size() ) ) == 0;
+}
+
+#else
+
+using namespace co;
+
+std::unique_ptr<IoUring> IoUring::Create( uint ) { return nullptr; }
+IoUring::~IoUring() {}
+void IoUring::Submit( std::span<io_op* const>, reap_fn, void* ) {}
+void IoUring::Enter( uint, reap_fn, void* ) {}
+void IoUring::MakeRoom( reap_fn, void* ) {}
+void IoUring::Cancel( const io_op&, reap_fn, void* ) {}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+
+#include "IoService.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace co
+{
+/**
+ * \brief Bare io_uring instance on raw syscalls (no liburing): the submission and completion rings mapped from the kernel.
+ *        Any thread can submit (serialized by a lock, the syscall included), one thread at a time reaps.
+ *        Linux only, `Create` fails anywhere else.
+ */
+class IoUring
+{
+public:
+   // nullptr if io_uring is not available: not linux, too old a kernel, or forbidden (seccomp, containers)
+   static std::unique_ptr<IoUring> Create( uint entries );
+   ~IoUring();
+
+   IoUring( const IoUring& ) = delete;
+   IoUring& operator=( const IoUring& ) = delete;
+
+   // pollable, reads ready while there are completions
+   int Fd() const { return mFd; }
+
+   // reaps the ring for a submitter that cannot wait for somebody else to, see `Submit`
+   using reap_fn = void (*)( void* context );
+
+   // Queue the requests with the op as user data, then enter the kernel once per submission ring full. Never more in
+   // flight than the completion ring holds: when it's full, `reap( context )` runs from here until there is room again
+   void Submit( std::span<io_op* const> ops, reap_fn reap, void* context );
+   // Ask the kernel to cut `op` short, it completes with `-ECANCELED` then, unless it's too late for that. The request
+   // completes on its own with `kCancelUserData`, nothing to do about it
+   void Cancel( const io_op& op, reap_fn reap, void* context );
+   static constexpr uint64_t kCancelUserData = 0;
+
+   // `complete( userData, result )` for every completion there is. False if another thread is reaping
+   template<typename F>
+   bool Reap( F&& complete );
+
+#if defined(__linux__)
+   bool RegisterBuffers( std::span<const iovec> buffers );
+#endif
+
+protected:
+   IoUring() = default;
+   // the submission entry at `tail`, counted in flight. Enters the kernel first when either ring is full
+   io_uring_sqe& NextEntry( uint32_t& tail, reap_fn reap, void* context );
+   // publish the entries up to `tail` and enter the kernel for them
+   void Flush( uint32_t tail, reap_fn reap, void* context );
+   void Enter( uint toSubmit, reap_fn reap, void* context );
+   // wait for, and reap, completions until the completion ring has room for one more
+   void MakeRoom( reap_fn reap, void* context );
+
+   int mFd = -1;
+
+   // submission ring
+   void* mSqRing = nullptr;
+   size_t mSqRingSize = 0;
+   uint32_t* mSqHead = nullptr; // written by the kernel
+   uint32_t* mSqTail = nullptr;
+   uint32_t mSqMask = 0;
+   uint32_t mSqEntries = 0;
+   io_uring_sqe* mSqes = nullptr;
+   size_t mSqesSize = 0;
+   uint32_t mSqPending = 0; // queued, not entered yet
+   std::mutex mSubmitLock;
+
+   // completion ring, may share the mapping with the submission ring
+   void* mCqRing = nullptr;
+   size_t mCqRingSize = 0;
+   uint32_t* mCqHead = nullptr;
+   uint32_t* mCqTail = nullptr; // written by the kernel
+   uint32_t mCqMask = 0;
+   io_uring_cqe* mCqes = nullptr;
+   uint32_t mCqEntries = 0;
+   SpinLock mReapLock;
+   // queued and not reaped yet, kept within `mCqEntries` so the kernel never has to hold completions back
+   std::atomic<uint32_t> mInFlight = 0;
+};
+}
+
+#if defined(__linux__)
+#include <atomic>
+#include <linux/io_uring.h>
+
+template<typename F>
+bool co::IoUring::Reap( F&& complete )
+{
+   if(!mReapLock.try_lock()) return false;
+   uint32_t head = *mCqHead;
+   uint32_t tail = std::atomic_ref<uint32_t>( *mCqTail ).load( std::memory_order_acquire );
+   while(head != tail) {
+      const io_uring_cqe& cqe = mCqes[head & mCqMask];
+      uint64_t userData = cqe.user_data;
+      int32_t result = cqe.res;
+      head++;
+      // give the slot back before running the completion, which can take a while (rescheduling)
+      std::atomic_ref<uint32_t>( *mCqHead ).store( head, std::memory_order_release );
+      mInFlight.fetch_sub( 1, std::memory_order_release );
+      complete( userData, result );
+   }
+   mReapLock.unlock();
+   return true;
+}
+#else
+template<typename F>
+bool co::IoUring::Reap( F&& ) { return false; }
+#endif
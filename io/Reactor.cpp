@@ -0,0 +1,153 @@
+#include "Reactor.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace co;
+
+Reactor& Reactor::Get()
+{
+   // never destroyed, like the io service that registers with it
+   static Reactor* reactor = new Reactor();
+   return *reactor;
+}
+
+Reactor::Reactor()
+{
+   mEpollFd = epoll_create1( EPOLL_CLOEXEC );
+   ASSERT_DIE( mEpollFd >= 0 );
+   mWakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   ASSERT_DIE( mWakeFd >= 0 );
+
+   // the wake up is the one entry without a source
+   epoll_event event = {};
+   event.events = EPOLLIN;
+   event.data.ptr = nullptr;
+   ASSERT_DIE( epoll_ctl( mEpollFd, EPOLL_CTL_ADD, mWakeFd, &event ) == 0 );
+}
+
+Reactor::~Reactor()
+{
+   close( mWakeFd );
+   close( mEpollFd );
+}
+
+bool Reactor::Add( int fd, ReactorSource& source )
+{
+   epoll_event event = {};
+   event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   event.data.ptr = &source;
+   return epoll_ctl( mEpollFd, EPOLL_CTL_ADD, fd, &event ) == 0;
+}
+
+bool Reactor::AddLevelTriggered( int fd, ReactorSource& source )
+{
+   epoll_event event = {};
+   event.events = EPOLLIN;
+   event.data.ptr = &source;
+   return epoll_ctl( mEpollFd, EPOLL_CTL_ADD, fd, &event ) == 0;
+}
+
+void Reactor::Remove( int fd, std::unique_ptr<ReactorSource> source )
+{
+   epoll_ctl( mEpollFd, EPOLL_CTL_DEL, fd, nullptr );
+   {
+      std::scoped_lock guard( mRetiredLock );
+      mRetired.push_back( std::move( source ) );
+   }
+   // nobody dispatching, nobody can hold on to it: free it now
+   if(mDispatchLock.try_lock()) {
+      std::vector<std::unique_ptr<ReactorSource>> retired;
+      {
+         std::scoped_lock guard( mRetiredLock );
+         retired.swap( mRetired );
+      }
+      mDispatchLock.unlock();
+   } else {
+      // the keeper can sit in `epoll_wait` for long, have it come around
+      Interrupt();
+   }
+}
+
+void Reactor::Expect( Scheduler& scheduler, int64_t count )
+{
+   bool attached = scheduler.AttachIdlePoller( *this );
+   // one poller per scheduler, the file io goes through the reactor too
+   ASSERT_DIE( attached );
+   mPending.fetch_add( count, std::memory_order_seq_cst );
+   scheduler.NotifyIdlePollerPending();
+}
+
+static int EpollWait( int epollFd, epoll_event* events, int maxEvents, std::chrono::nanoseconds timeout )
+{
+   if(timeout.count() <= 0) {
+      return epoll_wait( epollFd, events, maxEvents, timeout.count() < 0 ? -1 : 0 );
+   }
+
+#if defined(SYS_epoll_pwait2)
+   // nanosecond timeouts (5.11+), the timer wheel ticks way finer than a millisecond
+   static std::atomic<bool> hasPwait2 = true;
+   if(hasPwait2.load( std::memory_order_relaxed )) {
+      timespec ts = { time_t( timeout.count() / 1'000'000'000 ), long( timeout.count() % 1'000'000'000 ) };
+      int count = int( syscall( SYS_epoll_pwait2, epollFd, events, maxEvents, &ts, nullptr, 0 ) );
+      if(count >= 0 || errno != ENOSYS) return count;
+      hasPwait2.store( false, std::memory_order_relaxed );
+   }
+#endif
+   // round up, waking up early would only spin
+   auto ms = std::chrono::ceil<std::chrono::milliseconds>( timeout ).count();
+   return epoll_wait( epollFd, events, maxEvents, int( std::min<int64_t>( ms, INT32_MAX ) ) );
+}
+
+bool Reactor::Dispatch( std::chrono::nanoseconds timeout )
+{
+   if(!mDispatchLock.try_lock()) return false;
+
+   epoll_event events[kMaxEvents];
+   int count = EpollWait( mEpollFd, events, kMaxEvents, timeout );
+   for(int i = 0; i < count; ++i) {
+      auto* source = static_cast<ReactorSource*>( events[i].data.ptr );
+      if(source == nullptr) {
+         uint64_t value;
+         while(read( mWakeFd, &value, sizeof(value) ) > 0) {}
+         continue;
+      }
+      source->OnReady( events[i].events );
+   }
+
+   std::vector<std::unique_ptr<ReactorSource>> retired;
+   {
+      std::scoped_lock guard( mRetiredLock );
+      retired.swap( mRetired );
+   }
+   mDispatchLock.unlock();
+   return true;
+}
+
+void Reactor::Poll()
+{
+   Dispatch( std::chrono::nanoseconds( 0 ) );
+}
+
+void Reactor::Wait( std::chrono::nanoseconds timeout )
+{
+   // what comes in is dispatched right here, there is no point making the keeper poll again for it
+   if(!Dispatch( timeout )) {
+      // another worker is dispatching, it handles whatever comes in
+      std::this_thread::yield();
+   }
+}
+
+void Reactor::Interrupt()
+{
+   uint64_t one = 1;
+   ssize_t written = write( mWakeFd, &one, sizeof(one) );
+   (void)written;
+}
+
+#endif
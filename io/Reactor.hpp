@@ -0,0 +1,191 @@
+#pragma once
+#if defined(__linux__)
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../schedule/cancellation.hpp"
+#include "../schedule/scheduler.hpp"
+
+namespace co
+{
+// an fd the reactor watches
+class ReactorSource
+{
+public:
+   virtual ~ReactorSource() = default;
+   // the epoll events that came in. Runs on whichever worker is polling, never block in here
+   virtual void OnReady( uint32_t events ) = 0;
+};
+
+/**
+ * \brief epoll, polled by the idle workers of the schedulers using it (it's their `IdlePoller`), no io thread.
+ *        While anything waits on it, the parked worker watching the timers blocks in `epoll_wait` instead of sleeping,
+ *        and readiness reschedules the waiting coroutine from there directly.
+ *        Only one thread dispatches at a time, so a source never sees two `OnReady` at once.
+ */
+class Reactor final: public IdlePoller
+{
+public:
+   // the process wide reactor, created on first use
+   static Reactor& Get();
+
+   Reactor();
+   ~Reactor();
+
+   // edge triggered, read and write readiness (and hang ups). `source` has to stay alive until `Remove`
+   bool Add( int fd, ReactorSource& source );
+   // level triggered, readable only: reported for as long as there is something to read
+   bool AddLevelTriggered( int fd, ReactorSource& source );
+   // stop watching `fd`, `source` is freed once no dispatch can be looking at it anymore. Close `fd` afterward
+   void Remove( int fd, std::unique_ptr<ReactorSource> source );
+
+   // Somebody waits on a source now, keep `scheduler` polling until `Done`. Attaches the reactor to it on first use
+   void Expect( Scheduler& scheduler, int64_t count = 1 );
+   void Done( int64_t count = 1 ) { mPending.fetch_sub( count, std::memory_order_seq_cst ); }
+
+   // IdlePoller
+   void Poll() override;
+   bool HasPending() const override { return mPending.load( std::memory_order_seq_cst ) > 0; }
+   void Wait( std::chrono::nanoseconds timeout ) override;
+   void Interrupt() override;
+
+protected:
+   static constexpr int kMaxEvents = 64;
+   // wait for events and dispatch them, false if another thread is dispatching. timeout: 0 polls, negative has none
+   bool Dispatch( std::chrono::nanoseconds timeout );
+
+   int mEpollFd = -1;
+   int mWakeFd = -1; // eventfd, `Interrupt` writes it
+   SpinLock mDispatchLock;
+   std::atomic<int64_t> mPending = 0;
+
+   // removed sources, freed by the next dispatch (after anything it got from epoll is handled)
+   std::mutex mRetiredLock;
+   std::vector<std::unique_ptr<ReactorSource>> mRetired;
+};
+
+class io_readiness;
+
+// what an `io_readiness` runs when the fd is ready: a non-blocking attempt at the actual io
+struct readiness_op
+{
+   virtual ~readiness_op() = default;
+   // false if it would block. Otherwise the op is done, with `result` (`-errno` on failure)
+   virtual bool Attempt() = 0;
+
+   promise_base* waiter = nullptr;
+   int64_t result = 0;
+   io_readiness* readiness = nullptr;
+   // canceling the waiting coroutine takes the op back, see `io_readiness::Cancel`
+   detail::cancelable_wait cancel;
+};
+
+/**
+ * \brief One direction (read or write) of an edge triggered source: idle, ready (an edge came in with nobody waiting),
+ *        or the op waiting on it. The dispatching thread runs the op when the edge comes in, and only reschedules the
+ *        coroutine once it's done, so a spurious edge never wakes it up just to find out it would block again.
+ *        While it tries, the op is marked busy, so a cancellation cannot take it back from under it.
+ */
+class io_readiness
+{
+public:
+   // from `OnReady`, for the direction the events are about
+   void Signal()
+   {
+      uintptr_t state = mState.load( std::memory_order_acquire );
+      while(true) {
+         if(state == kReady) return;
+         if(state == kIdle) {
+            if(mState.compare_exchange_weak( state, kReady, std::memory_order_acq_rel, std::memory_order_acquire )) return;
+            continue;
+         }
+         // only the dispatching thread tries the op, a cancellation can take it back as long as it's not at it
+         if(!mState.compare_exchange_weak( state, kBusy, std::memory_order_acq_rel, std::memory_order_acquire )) continue;
+         readiness_op& op = *reinterpret_cast<readiness_op*>( state );
+         if(!op.Attempt()) {
+            mState.store( state, std::memory_order_release );
+            return;
+         }
+         promise_base& waiter = *op.waiter;
+         mState.store( kIdle, std::memory_order_release );
+         Reactor::Get().Done();
+         // the op lives in the waiting frame, it can be gone from here on
+         Scheduler::ScheduleOnOwner( waiter );
+         return;
+      }
+   }
+
+   // Park the coroutine until `op` went through. False if it went through right away. Call `op.Attempt()` first,
+   // this only covers readiness that came in since then
+   template<typename Promise>
+   bool Suspend( std::coroutine_handle<Promise> awaitingCoroutine, readiness_op& op )
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      op.waiter = &promise;
+      op.readiness = this;
+
+      bool parked = true;
+      // the coroutine can be resumed elsewhere as soon as the op is parked. Do not touch `op` afterward
+      op.cancel.Arm( promise, &op, &OnCancel, [&] { parked = Park( promise, op ); } );
+      if(parked) return true;
+      promise.SetState( eOpState::Suspended, eOpState::Processing );
+      return false;
+   }
+
+   // from a cancellation of the waiting coroutine: take `op` back, unless it went through already
+   void Cancel( readiness_op& op )
+   {
+      uintptr_t expected = uintptr_t( &op );
+      while(!mState.compare_exchange_weak( expected, kIdle, std::memory_order_acq_rel, std::memory_order_acquire )) {
+         // it went through, the coroutine is on its way back
+         if(expected != kBusy && expected != uintptr_t( &op )) return;
+         if(expected == kBusy) CpuRelax();
+         expected = uintptr_t( &op );
+      }
+      Reactor::Get().Done();
+      promise_base::ScheduleAbandon( *op.waiter );
+   }
+
+protected:
+   static constexpr uintptr_t kIdle = 0;
+   static constexpr uintptr_t kReady = 1;
+   // the dispatching thread is trying the op, ops are at least 8 bytes aligned
+   static constexpr uintptr_t kBusy = 2;
+
+   // false if the op went through right away
+   bool Park( promise_base& promise, readiness_op& op )
+   {
+      Scheduler* executor = promise.Executor();
+      Reactor& reactor = Reactor::Get();
+      reactor.Expect( executor ? *executor : Scheduler::CurrentOrDefault() );
+      while(true) {
+         uintptr_t expected = kIdle;
+         if(mState.compare_exchange_strong( expected, uintptr_t( &op ), std::memory_order_acq_rel, std::memory_order_acquire )) {
+            return true;
+         }
+         // one waiter per direction: the only other state is an edge that came in since the last attempt
+         EXPECTS( expected == kReady );
+         mState.store( kIdle, std::memory_order_relaxed );
+         if(op.Attempt()) break;
+      }
+      reactor.Done();
+      return false;
+   }
+
+   static void OnCancel( void* context )
+   {
+      readiness_op& op = *static_cast<readiness_op*>( context );
+      op.readiness->Cancel( op );
+   }
+
+   std::atomic<uintptr_t> mState = kIdle;
+};
+}
+#endif
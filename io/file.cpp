@@ -0,0 +1,84 @@
+#include "file.hpp"
+
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <fcntl.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace co;
+
+file file::open( const char* path, int flags, int mode )
+{
+   file f;
+#if defined(_WIN32)
+   (void)mode;
+   DWORD access = 0;
+   switch(flags & (_O_RDONLY | _O_WRONLY | _O_RDWR)) {
+   case _O_WRONLY: access = GENERIC_WRITE; break;
+   case _O_RDWR:   access = GENERIC_READ | GENERIC_WRITE; break;
+   default:        access = GENERIC_READ; break;
+   }
+   DWORD disposition = OPEN_EXISTING;
+   if(flags & _O_CREAT) disposition = (flags & _O_TRUNC) ? CREATE_ALWAYS : OPEN_ALWAYS;
+   else if(flags & _O_TRUNC) disposition = TRUNCATE_EXISTING;
+   f.mHandle = CreateFileA( path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr );
+   if(f.mHandle == INVALID_HANDLE_VALUE) f.mError = int( GetLastError() );
+#else
+   do {
+      f.mHandle = ::open( path, flags | O_CLOEXEC, mode );
+   } while(f.mHandle < 0 && errno == EINTR);
+   if(f.mHandle < 0) f.mError = errno;
+#endif
+   return f;
+}
+
+file::file( file&& other ) noexcept
+   : mHandle( std::exchange( other.mHandle, kInvalidHandle ) )
+   , mError( other.mError )
+{}
+
+file& file::operator=( file&& other ) noexcept
+{
+   if(this != &other) {
+      Close();
+      mHandle = std::exchange( other.mHandle, kInvalidHandle );
+      mError = other.mError;
+   }
+   return *this;
+}
+
+file::~file()
+{
+   Close();
+}
+
+void file::Close()
+{
+   if(!IsOpen()) return;
+#if defined(_WIN32)
+   CloseHandle( mHandle );
+#else
+   ::close( mHandle );
+#endif
+   mHandle = kInvalidHandle;
+}
+
+void io_batch::Submit( Scheduler& scheduler )
+{
+   if(mSubmitted == mOps.size()) return;
+   std::vector<io_op*> ops;
+   ops.reserve( mOps.size() - mSubmitted );
+   for(size_t i = mSubmitted; i < mOps.size(); ++i) {
+      ops.push_back( &mOps[i] );
+   }
+   mSubmitted = mOps.size();
+   IoService::Get().Submit( ops, scheduler );
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <span>
+
+#include "IoService.hpp"
+#include "../schedule/cancellation.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#endif
+
+namespace co
+{
+/**
+ * \brief Suspends the awaiting coroutine while `op` is in flight on the io service.
+ *        Resumes with the byte count (0 for fsync) or `-errno`.
+ *        Canceling the coroutine cuts the op short where the backend can (io_uring), and abandons the coroutine once the
+ *        op is back: the kernel may be using the buffer, and the op, up to then.
+ */
+struct io_awaitable
+{
+   io_op op;
+   detail::cancelable_wait cancel;
+
+   explicit io_awaitable( const io_request& request ) { op.request = request; }
+
+   bool await_ready() const noexcept { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      Scheduler* executor = promise.Executor();
+      Scheduler& scheduler = executor ? *executor : Scheduler::CurrentOrDefault();
+      // a cancellation finds it in flight, or never submitted (see `cancelable_wait::Arm`)
+      bool submitted = false;
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      cancel.Arm( promise, this, &OnCancel, [&] {
+         IoService::Get().Submit( op, scheduler );
+         submitted = true;
+      } );
+      // canceled already, it's abandoned without ever submitting
+      if(!submitted) return true;
+      bool running = promise.SetState( eOpState::Suspended, eOpState::Processing );
+      ENSURES( running );
+      // false when it already completed, then the coroutine just keeps going
+      return future<int64_t>::awaitable{ op.result }.await_suspend( awaitingCoroutine );
+   }
+
+   int64_t await_resume() noexcept { return op.result.Get(); }
+
+   static void OnCancel( void* context )
+   {
+      io_awaitable& self = *static_cast<io_awaitable*>( context );
+      self.op.result.AbandonWaiter();
+      IoService::Get().Cancel( self.op );
+   }
+};
+
+/**
+ * \brief An open file, read and written at explicit offsets by awaiting `read_at`/`write_at`/`fsync`.
+ *        There is no cursor, so any number of requests can be in flight on one file.
+ */
+class file
+{
+public:
+   // `flags` and `mode` as for `open(2)`, e.g. `O_RDWR | O_CREAT`. On win32 only the access mode and O_CREAT/O_TRUNC matter
+   static file open( const char* path, int flags, int mode = 0644 );
+
+   file() = default;
+   file( file&& other ) noexcept;
+   file& operator=( file&& other ) noexcept;
+   ~file();
+
+   file( const file& ) = delete;
+   file& operator=( const file& ) = delete;
+
+   bool IsOpen() const { return mHandle != kInvalidHandle; }
+   // errno of the failed `open`
+   int Error() const { return mError; }
+   native_file_t Handle() const { return mHandle; }
+   void Close();
+
+   io_awaitable read_at( uint64_t offset, std::span<std::byte> buffer ) const
+   {
+      return io_awaitable( { eIoOp::Read, mHandle, offset, buffer.data(), uint32_t( buffer.size() ) } );
+   }
+   io_awaitable write_at( uint64_t offset, std::span<const std::byte> buffer ) const
+   {
+      return io_awaitable( { eIoOp::Write, mHandle, offset, const_cast<std::byte*>( buffer.data() ), uint32_t( buffer.size() ) } );
+   }
+   io_awaitable fsync() const
+   {
+      return io_awaitable( { eIoOp::Fsync, mHandle } );
+   }
+   // `buffer` has to lie within the buffer registered at `bufferIndex`, see `IoService::RegisterBuffers`
+   io_awaitable read_fixed( uint64_t offset, std::span<std::byte> buffer, uint16_t bufferIndex ) const
+   {
+      return io_awaitable( { eIoOp::ReadFixed, mHandle, offset, buffer.data(), uint32_t( buffer.size() ), bufferIndex } );
+   }
+   io_awaitable write_fixed( uint64_t offset, std::span<const std::byte> buffer, uint16_t bufferIndex ) const
+   {
+      return io_awaitable( { eIoOp::WriteFixed, mHandle, offset, const_cast<std::byte*>( buffer.data() ), uint32_t( buffer.size() ), bufferIndex } );
+   }
+
+protected:
+#if defined(_WIN32)
+   static inline const native_file_t kInvalidHandle = (void*)-1; // INVALID_HANDLE_VALUE
+#else
+   static constexpr native_file_t kInvalidHandle = -1;
+#endif
+   native_file_t mHandle = kInvalidHandle;
+   int mError = 0;
+};
+
+/**
+ * \brief Requests collected first and submitted together, one kernel entry for the lot. Await each op afterwards,
+ *        the ops stay put for the lifetime of the batch.
+ */
+class io_batch
+{
+public:
+   io_op& read_at( const file& f, uint64_t offset, std::span<std::byte> buffer )
+   {
+      return Add( { eIoOp::Read, f.Handle(), offset, buffer.data(), uint32_t( buffer.size() ) } );
+   }
+   io_op& write_at( const file& f, uint64_t offset, std::span<const std::byte> buffer )
+   {
+      return Add( { eIoOp::Write, f.Handle(), offset, const_cast<std::byte*>( buffer.data() ), uint32_t( buffer.size() ) } );
+   }
+   io_op& fsync( const file& f )
+   {
+      return Add( { eIoOp::Fsync, f.Handle() } );
+   }
+
+   // submit everything added since the last submit
+   void Submit( Scheduler& scheduler = Scheduler::CurrentOrDefault() );
+
+   size_t Count() const { return mOps.size(); }
+   io_op& operator[]( size_t index ) { return mOps[index]; }
+
+protected:
+   io_op& Add( const io_request& request )
+   {
+      io_op& op = mOps.emplace_back();
+      op.request = request;
+      return op;
+   }
+
+   std::deque<io_op> mOps;
+   size_t mSubmitted = 0;
+};
+}
@@ -0,0 +1,327 @@
+#include "socket.hpp"
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace co;
+
+void socket_source::OnReady( uint32_t events )
+{
+   // errors and hang ups go to both sides, the attempts pick them up
+   if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) readable.Signal();
+   if(events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) writable.Signal();
+}
+
+bool socket_read_awaitable::Attempt()
+{
+   while(true) {
+      ssize_t count = ::read( fd, buffer.data(), buffer.size() );
+      if(count >= 0) {
+         result = count;
+         return true;
+      }
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+      result = -errno;
+      return true;
+   }
+}
+
+bool socket_write_awaitable::Attempt()
+{
+   while(written < data.size()) {
+      ssize_t count = ::send( fd, data.data() + written, data.size() - written, MSG_NOSIGNAL );
+      if(count >= 0) {
+         written += size_t( count );
+         continue;
+      }
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+      result = -errno;
+      return true;
+   }
+   result = int64_t( written );
+   return true;
+}
+
+static void SetNoDelay( int fd )
+{
+   sockaddr_storage address;
+   socklen_t size = sizeof(address);
+   if(getsockname( fd, reinterpret_cast<sockaddr*>( &address ), &size ) != 0) return;
+   if(address.ss_family != AF_INET && address.ss_family != AF_INET6) return;
+   // request/response traffic, do not let nagle hold the small writes back
+   int one = 1;
+   setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+}
+
+socket_stream::socket_stream( int fd, std::unique_ptr<socket_source> source )
+   : mFd( fd ), mSource( std::move( source ) )
+{
+   if(mSource == nullptr) {
+      mSource = std::make_unique<socket_source>();
+      bool added = Reactor::Get().Add( mFd, *mSource );
+      ASSERT_DIE( added );
+   }
+   SetNoDelay( mFd );
+}
+
+socket_stream socket_stream::Failed( int error )
+{
+   socket_stream stream;
+   stream.mError = error;
+   return stream;
+}
+
+socket_stream::socket_stream( socket_stream&& other ) noexcept
+   : mFd( std::exchange( other.mFd, -1 ) )
+   , mError( other.mError )
+   , mSource( std::move( other.mSource ) )
+{}
+
+socket_stream& socket_stream::operator=( socket_stream&& other ) noexcept
+{
+   if(this != &other) {
+      Close();
+      mFd = std::exchange( other.mFd, -1 );
+      mError = other.mError;
+      mSource = std::move( other.mSource );
+   }
+   return *this;
+}
+
+socket_stream::~socket_stream()
+{
+   Close();
+}
+
+void socket_stream::Close()
+{
+   if(mFd < 0) return;
+   Reactor::Get().Remove( mFd, std::move( mSource ) );
+   ::close( mFd );
+   mFd = -1;
+}
+
+bool socket_accept_awaitable::Attempt()
+{
+   while(true) {
+      accepted = ::accept4( fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+      if(accepted >= 0) {
+         result = 0;
+         return true;
+      }
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+      result = -errno;
+      return true;
+   }
+}
+
+socket_accept_awaitable::~socket_accept_awaitable()
+{
+   if(accepted >= 0) ::close( accepted );
+}
+
+socket_stream socket_accept_awaitable::await_resume()
+{
+   if(accepted < 0) return socket_stream::Failed( int( -result ) );
+   return socket_stream( std::exchange( accepted, -1 ) );
+}
+
+socket_connect_awaitable::socket_connect_awaitable( int domain, const void* address, uint32_t addressSize )
+{
+   fd = ::socket( domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   if(fd < 0) {
+      result = -errno;
+      return;
+   }
+   int connected;
+   do {
+      connected = ::connect( fd, static_cast<const sockaddr*>( address ), socklen_t( addressSize ) );
+   } while(connected != 0 && errno == EINTR);
+   if(connected != 0 && errno != EINPROGRESS) {
+      result = -errno;
+      return;
+   }
+   // on the reactor after connect, an unconnected socket reads as hung up
+   source = std::make_unique<socket_source>();
+   bool added = Reactor::Get().Add( fd, *source );
+   ASSERT_DIE( added );
+   readiness = &source->writable;
+}
+
+socket_connect_awaitable::~socket_connect_awaitable()
+{
+   // not handed over to a stream, it failed
+   if(fd < 0) return;
+   if(source) Reactor::Get().Remove( fd, std::move( source ) );
+   ::close( fd );
+}
+
+bool socket_connect_awaitable::Attempt()
+{
+   if(source == nullptr) return true; // failed right away
+   pollfd entry = { fd, POLLOUT, 0 };
+   if(::poll( &entry, 1, 0 ) == 0) return false;
+   int error = 0;
+   socklen_t size = sizeof(error);
+   getsockopt( fd, SOL_SOCKET, SO_ERROR, &error, &size );
+   result = -error;
+   return true;
+}
+
+socket_stream socket_connect_awaitable::await_resume()
+{
+   if(result < 0) return socket_stream::Failed( int( -result ) );
+   return socket_stream( std::exchange( fd, -1 ), std::move( source ) );
+}
+
+socket_listener socket_listener::Listen( int domain, const void* address, uint32_t addressSize, int backlog )
+{
+   socket_listener listener;
+   int fd = ::socket( domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+   if(fd < 0) {
+      listener.mError = errno;
+      return listener;
+   }
+   if(domain != AF_UNIX) {
+      int one = 1;
+      setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+   }
+   if(::bind( fd, static_cast<const sockaddr*>( address ), socklen_t( addressSize ) ) != 0 || ::listen( fd, backlog ) != 0) {
+      listener.mError = errno;
+      ::close( fd );
+      return listener;
+   }
+   listener.mFd = fd;
+   listener.mSource = std::make_unique<socket_source>();
+   bool added = Reactor::Get().Add( fd, *listener.mSource );
+   ASSERT_DIE( added );
+   return listener;
+}
+
+socket_listener::socket_listener( socket_listener&& other ) noexcept
+   : mFd( std::exchange( other.mFd, -1 ) )
+   , mError( other.mError )
+   , mSource( std::move( other.mSource ) )
+{}
+
+socket_listener& socket_listener::operator=( socket_listener&& other ) noexcept
+{
+   if(this != &other) {
+      Close();
+      mFd = std::exchange( other.mFd, -1 );
+      mError = other.mError;
+      mSource = std::move( other.mSource );
+   }
+   return *this;
+}
+
+socket_listener::~socket_listener()
+{
+   Close();
+}
+
+void socket_listener::Close()
+{
+   if(mFd < 0) return;
+   Reactor::Get().Remove( mFd, std::move( mSource ) );
+   ::close( mFd );
+   mFd = -1;
+}
+
+uint16_t socket_listener::Port() const
+{
+   sockaddr_storage address;
+   socklen_t size = sizeof(address);
+   if(getsockname( mFd, reinterpret_cast<sockaddr*>( &address ), &size ) != 0) return 0;
+   if(address.ss_family == AF_INET) return ntohs( reinterpret_cast<sockaddr_in&>( address ).sin_port );
+   if(address.ss_family == AF_INET6) return ntohs( reinterpret_cast<sockaddr_in6&>( address ).sin6_port );
+   return 0;
+}
+
+static bool MakeTcpAddress( const char* address, uint16_t port, sockaddr_storage& out, socklen_t& outSize )
+{
+   memset( &out, 0, sizeof(out) );
+   auto& v4 = reinterpret_cast<sockaddr_in&>( out );
+   if(inet_pton( AF_INET, address, &v4.sin_addr ) == 1) {
+      v4.sin_family = AF_INET;
+      v4.sin_port = htons( port );
+      outSize = sizeof(v4);
+      return true;
+   }
+   auto& v6 = reinterpret_cast<sockaddr_in6&>( out );
+   if(inet_pton( AF_INET6, address, &v6.sin6_addr ) == 1) {
+      v6.sin6_family = AF_INET6;
+      v6.sin6_port = htons( port );
+      outSize = sizeof(v6);
+      return true;
+   }
+   return false;
+}
+
+static bool MakeUnixAddress( const char* path, sockaddr_un& out )
+{
+   memset( &out, 0, sizeof(out) );
+   out.sun_family = AF_UNIX;
+   size_t length = strlen( path );
+   if(length >= sizeof(out.sun_path)) return false;
+   memcpy( out.sun_path, path, length );
+   return true;
+}
+
+socket_listener co::listen_tcp( const char* address, uint16_t port, int backlog )
+{
+   sockaddr_storage storage;
+   socklen_t size;
+   if(!MakeTcpAddress( address, port, storage, size )) {
+      socket_listener listener;
+      listener.mError = EINVAL;
+      return listener;
+   }
+   return socket_listener::Listen( storage.ss_family, &storage, size, backlog );
+}
+
+socket_listener co::listen_unix( const char* path, int backlog )
+{
+   sockaddr_un address;
+   if(!MakeUnixAddress( path, address )) {
+      socket_listener listener;
+      listener.mError = ENAMETOOLONG;
+      return listener;
+   }
+   return socket_listener::Listen( AF_UNIX, &address, sizeof(address), backlog );
+}
+
+socket_connect_awaitable co::connect_tcp( const char* address, uint16_t port )
+{
+   sockaddr_storage storage;
+   socklen_t size;
+   if(!MakeTcpAddress( address, port, storage, size )) {
+      // an unknown family fails the socket call, with the error a bad address deserves
+      return socket_connect_awaitable( AF_UNSPEC, nullptr, 0 );
+   }
+   return socket_connect_awaitable( storage.ss_family, &storage, size );
+}
+
+socket_connect_awaitable co::connect_unix( const char* path )
+{
+   sockaddr_un address;
+   if(!MakeUnixAddress( path, address )) {
+      return socket_connect_awaitable( AF_UNSPEC, nullptr, 0 );
+   }
+   return socket_connect_awaitable( AF_UNIX, &address, sizeof(address) );
+}
+
+#endif
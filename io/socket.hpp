@@ -0,0 +1,178 @@
+#pragma once
+#if defined(__linux__)
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include "Reactor.hpp"
+
+namespace co
+{
+// a socket on the reactor, one waiter per direction at most
+struct socket_source final: ReactorSource
+{
+   io_readiness readable;
+   io_readiness writable;
+
+   void OnReady( uint32_t events ) override;
+};
+
+// An op on one direction of a socket: tried right away, then again on every edge until it goes through.
+// Without a socket to wait on (not open, or a failed accept/connect) it's done right away, `result` says why
+struct socket_awaitable: readiness_op
+{
+   bool await_ready() { return readiness == nullptr || Attempt(); }
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) { return readiness->Suspend( awaitingCoroutine, *this ); }
+
+protected:
+   // `direction` of the socket, nullptr if it's not open
+   void Watch( io_readiness* direction )
+   {
+      readiness = direction;
+      if(direction == nullptr) result = -EBADF;
+   }
+};
+
+struct socket_read_awaitable final: socket_awaitable
+{
+   int fd;
+   std::span<std::byte> buffer;
+
+   socket_read_awaitable( socket_source* source, int fd, std::span<std::byte> buffer )
+      : fd( fd ), buffer( buffer ) { Watch( source ? &source->readable : nullptr ); }
+   bool Attempt() override;
+   int64_t await_resume() const { return result; }
+};
+
+struct socket_write_awaitable final: socket_awaitable
+{
+   int fd;
+   std::span<const std::byte> data;
+   size_t written = 0;
+
+   socket_write_awaitable( socket_source* source, int fd, std::span<const std::byte> data )
+      : fd( fd ), data( data ) { Watch( source ? &source->writable : nullptr ); }
+   bool Attempt() override;
+   int64_t await_resume() const { return result; }
+};
+
+struct socket_accept_awaitable;
+struct socket_connect_awaitable;
+
+/**
+ * \brief A connected stream socket, tcp or unix. `co_await read/write` suspend the coroutine, not the worker, while the
+ *        socket is not ready. One read and one write can be in flight at once. Close it only when neither is.
+ */
+class socket_stream
+{
+public:
+   socket_stream() = default;
+   socket_stream( socket_stream&& other ) noexcept;
+   socket_stream& operator=( socket_stream&& other ) noexcept;
+   ~socket_stream();
+
+   socket_stream( const socket_stream& ) = delete;
+   socket_stream& operator=( const socket_stream& ) = delete;
+
+   bool IsOpen() const { return mFd >= 0; }
+   // errno of the failed connect or accept
+   int Error() const { return mError; }
+   int Handle() const { return mFd; }
+   void Close();
+
+   // whatever is there, up to the size of `buffer`. 0 once the peer closed its side, `-errno` on failure (`-EBADF` if
+   // the stream is not open)
+   socket_read_awaitable read( std::span<std::byte> buffer ) { return { mSource.get(), mFd, buffer }; }
+   // all of `data`, or `-errno`
+   socket_write_awaitable write( std::span<const std::byte> data ) { return { mSource.get(), mFd, data }; }
+
+protected:
+   friend struct socket_accept_awaitable;
+   friend struct socket_connect_awaitable;
+   // takes a connected non-blocking socket, on the reactor already if `source` is given
+   explicit socket_stream( int fd, std::unique_ptr<socket_source> source = nullptr );
+   static socket_stream Failed( int error );
+
+   int mFd = -1;
+   int mError = 0;
+   std::unique_ptr<socket_source> mSource;
+};
+
+struct socket_accept_awaitable final: socket_awaitable
+{
+   int fd;
+   int accepted = -1;
+
+   socket_accept_awaitable( socket_source* source, int fd ): fd( fd ) { Watch( source ? &source->readable : nullptr ); }
+   // closes a connection accepted but never taken
+   ~socket_accept_awaitable();
+   bool Attempt() override;
+   socket_stream await_resume();
+};
+
+struct socket_connect_awaitable final: socket_awaitable
+{
+   int fd = -1;
+   std::unique_ptr<socket_source> source;
+
+   // starts connecting right away
+   socket_connect_awaitable( int domain, const void* address, uint32_t addressSize );
+   ~socket_connect_awaitable();
+   bool Attempt() override;
+   socket_stream await_resume();
+};
+
+/**
+ * \brief A listening socket, `co_await accept()` for the next connection.
+ */
+class socket_listener
+{
+public:
+   socket_listener() = default;
+   socket_listener( socket_listener&& other ) noexcept;
+   socket_listener& operator=( socket_listener&& other ) noexcept;
+   ~socket_listener();
+
+   socket_listener( const socket_listener& ) = delete;
+   socket_listener& operator=( const socket_listener& ) = delete;
+
+   bool IsOpen() const { return mFd >= 0; }
+   // errno of the failed socket/bind/listen
+   int Error() const { return mError; }
+   int Handle() const { return mFd; }
+   // the port it's bound to, for tcp listeners bound to port 0
+   uint16_t Port() const;
+   void Close();
+
+   // one accept in flight at a time. The stream has `Error` set if it failed (`EBADF` if the listener is not open)
+   socket_accept_awaitable accept() { return { mSource.get(), mFd }; }
+
+protected:
+   friend socket_listener listen_tcp( const char* address, uint16_t port, int backlog );
+   friend socket_listener listen_unix( const char* path, int backlog );
+   static socket_listener Listen( int domain, const void* address, uint32_t addressSize, int backlog );
+
+   int mFd = -1;
+   int mError = 0;
+   std::unique_ptr<socket_source> mSource;
+};
+
+// Numeric addresses only (ipv4 or ipv6), resolving a name could block the worker.
+// Port 0 picks a free one, see `socket_listener::Port`
+socket_listener listen_tcp( const char* address, uint16_t port, int backlog = 128 );
+// the socket file is not removed when the listener closes
+socket_listener listen_unix( const char* path, int backlog = 128 );
+
+// `co_await` them for the `socket_stream`, with `Error` set if it did not connect. Numeric addresses only
+socket_connect_awaitable connect_tcp( const char* address, uint16_t port );
+socket_connect_awaitable connect_unix( const char* path );
+
+using tcp_stream = socket_stream;
+using tcp_listener = socket_listener;
+using unix_stream = socket_stream;
+using unix_listener = socket_listener;
+}
+#endif
@@ -4,8 +4,10 @@
 #include <iostream>
 #include "utils.hpp"
 #include "schedule/algorithms.hpp"
+#include "schedule/channel.hpp"
 #include "schedule/scheduler.hpp"
 #include "schedule/task.hpp"
+#include "schedule/timer.hpp"
 
 using namespace std;
 
@@ -20,8 +22,8 @@ deferred_token<> LabDevelopVaccine(uint index, float chance, single_consumer_cou
 
 	do
 	{
-		std::this_thread::sleep_for( 1s );
-		float v = random::Between01();
+		co_await co::sleep_for( 1s );
+		float v = rng::Between01();
 		if( v > chance )
 		{
 			printf( "lab %u did not find a vaccine.... Retry....\n", index );
@@ -38,13 +40,14 @@ deferred_token<> LabDevelopVaccine(uint index, float chance, single_consumer_cou
 }
 
 
-deferred_token<> Factory(std::atomic<uint>& stock, bool& terminationSignal)
+deferred_token<> Factory(channel<uint>& shipments)
 {
-	while(!terminationSignal)
+	while(true)
 	{
-		std::this_thread::sleep_for( 1s );
-		uint vaccine = random::Between( 50, 100 );
-		stock += vaccine;
+		co_await co::sleep_for( 1s );
+		uint vaccine = rng::Between( 50, 100 );
+		// the clinic closes the channel once it's done
+		if( !co_await shipments.send( vaccine ) ) break;
 		// printf( "A factory produced %u vaccine\n", vaccine );
 	}
 	co_return;
@@ -59,7 +62,7 @@ deferred_token<> TryMakeVaccine()
 
 	for(uint i = 0; i < kLabCount; i++)
 	{
-		float chance = random::Between( 0.01f, 0.2f );
+		float chance = rng::Between( 0.01f, 0.2f );
 		LabDevelopVaccine(i, chance, counter).Launch();
 	}
 	
@@ -68,25 +71,32 @@ deferred_token<> TryMakeVaccine()
 	// printf( "Found a vaccine!\n");
 }
 
-deferred_token<> ProduceVaccine(std::atomic<uint>& vaccineStock, bool& vaccineProductionTermniationSignal)
+deferred_token<> ProduceVaccine(channel<uint>& shipments)
 {
 	std::vector<deferred_token<>> factories;
 	for(uint i = 0; i < kFactoryCount; i++)
 	{
-		factories.push_back(Factory( vaccineStock, vaccineProductionTermniationSignal ));
+		factories.push_back(Factory( shipments ));
 	}
 	co_await parallel_for(std::move(factories));
 }
 
-deferred_token<> ClinicApplyVaccine(uint& peopleNeedVaccine, std::atomic<uint>& stock, bool& vaccineProductionTermniationSignal)
+deferred_token<> ClinicApplyVaccine(uint& peopleNeedVaccine, std::atomic<uint>& stock, channel<uint>& shipments, bool& vaccineProductionTermniationSignal)
 {
 	while(peopleNeedVaccine > 0)
 	{
-		if( stock == 0 ) continue;
-		peopleNeedVaccine--;
-		stock--;
+		// the clinic sleeps until a shipment comes in, it does not hold on to a worker
+		std::optional<uint> shipment = co_await shipments.receive();
+		if( !shipment ) break;
+		stock += *shipment;
+		while(peopleNeedVaccine > 0 && stock > 0)
+		{
+			peopleNeedVaccine--;
+			stock--;
+		}
 	}
 
+	shipments.Close();
 	vaccineProductionTermniationSignal = true;
 	co_return;
 }
@@ -108,11 +118,13 @@ task<> ApplyImmunization(uint healthPeople)
 	std::atomic<uint> vaccineStock = 0;
 	bool vaccineProductionTermniationSignal = false;
 
-	[&]() -> deferred_token<>
+	// the closure object dies at the end of this statement, so state is passed as parameters (which live in the frame) instead of captured
+	[](uint& healthPeople, std::atomic<uint>& vaccineStock, bool& vaccineProductionTermniationSignal) -> deferred_token<>
 	{
+		periodic ticker( 1s );
 		while( !vaccineProductionTermniationSignal )
 		{
-			std::this_thread::sleep_for( 1s );
+			co_await ticker;
 			printf( "\n\n============== current status ================\n" );
 			printf( "People left: %u\n", healthPeople );
 			printf( "vaccine left: %u\n", vaccineStock.load() );
@@ -120,13 +132,15 @@ task<> ApplyImmunization(uint healthPeople)
 		}
 
 		co_return;
-	}().Launch();
+	}( healthPeople, vaccineStock, vaccineProductionTermniationSignal ).Launch();
 
 	std::vector<deferred_token<>> saveWorldSteps;
 
+	channel<uint> shipments( kFactoryCount );
+
 	std::vector<deferred_token<>> step2;
-	step2.push_back( ProduceVaccine( vaccineStock, vaccineProductionTermniationSignal ) );
-	step2.push_back( ClinicApplyVaccine( healthPeople, vaccineStock, vaccineProductionTermniationSignal ) );
+	step2.push_back( ProduceVaccine( shipments ) );
+	step2.push_back( ClinicApplyVaccine( healthPeople, vaccineStock, shipments, vaccineProductionTermniationSignal ) );
 	
 	saveWorldSteps.push_back(TryMakeVaccine());
 	saveWorldSteps.push_back( parallel_for( std::move( step2 ) ) );
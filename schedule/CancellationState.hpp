@@ -0,0 +1,89 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+
+#include "../utils.hpp"
+
+//
+// The flag behind a `co::cancellation_source`, shared with its tokens and the coroutines they are attached to.
+// Reference counted, whoever drops the last reference deletes it.
+// Waits that a cancellation cuts short (a timer, an fd) register a `Callback` for as long as they wait. Callbacks run once,
+// on the thread that cancels, under the state's lock: unregistering waits for a callback that is running to be done,
+// so a callback can count on whatever it points at being alive. Keep them short, and never (un)register from one.
+//
+class CancellationState
+{
+public:
+   struct Callback
+   {
+      void (*invoke)( void* context ) = nullptr;
+      void* context = nullptr;
+      Callback* prev = nullptr;
+      Callback* next = nullptr;
+      bool linked = false;
+   };
+
+   CancellationState() = default;
+   CancellationState( const CancellationState& ) = delete;
+   CancellationState& operator=( const CancellationState& ) = delete;
+
+   void AddRef() { mRefCount.fetch_add( 1, std::memory_order_relaxed ); }
+   void Release()
+   {
+      if(mRefCount.fetch_sub( 1, std::memory_order_acq_rel ) == 1) delete this;
+   }
+
+   bool IsCanceled() const { return mCanceled.load( std::memory_order_acquire ); }
+
+   // false if it was canceled already
+   bool Cancel()
+   {
+      std::scoped_lock guard( mLock );
+      if(mCanceled.load( std::memory_order_relaxed )) return false;
+      mCanceled.store( true, std::memory_order_release );
+      while(mCallbacks != nullptr) {
+         Callback& callback = *mCallbacks;
+         Unlink( callback );
+         callback.invoke( callback.context );
+      }
+      return true;
+   }
+
+   // false if it's canceled already, nothing is linked then
+   bool Register( Callback& callback )
+   {
+      std::scoped_lock guard( mLock );
+      if(mCanceled.load( std::memory_order_relaxed )) return false;
+      callback.prev = nullptr;
+      callback.next = mCallbacks;
+      if(mCallbacks != nullptr) mCallbacks->prev = &callback;
+      mCallbacks = &callback;
+      callback.linked = true;
+      return true;
+   }
+
+   // once this returns, the callback is not running, and never will
+   void Unregister( Callback& callback )
+   {
+      std::scoped_lock guard( mLock );
+      if(callback.linked) Unlink( callback );
+   }
+
+protected:
+   void Unlink( Callback& callback )
+   {
+      if(callback.prev != nullptr) {
+         callback.prev->next = callback.next;
+      } else {
+         mCallbacks = callback.next;
+      }
+      if(callback.next != nullptr) callback.next->prev = callback.prev;
+      callback.prev = callback.next = nullptr;
+      callback.linked = false;
+   }
+
+   std::atomic<bool> mCanceled = false;
+   std::atomic<int> mRefCount = 1;
+   SpinLock mLock;
+   Callback* mCallbacks = nullptr;
+};
@@ -0,0 +1,371 @@
+#include "FrameAllocator.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "../utils.hpp"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+using namespace co;
+
+namespace {
+
+constexpr size_t kClassSizes[] = { 64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+constexpr uint32_t kClassCount = sizeof(kClassSizes) / sizeof(kClassSizes[0]);
+constexpr uint32_t kLargeClass = kClassCount;
+constexpr size_t kChunkSize = 64 * 1024;
+constexpr size_t kHugeChunkSize = 2 * 1024 * 1024;
+constexpr uint32_t kRemoteBatchSize = 32;
+constexpr uint32_t kRemoteBatchSlots = 4;
+
+struct FramePool;
+
+// sits in front of every frame, keeps the frame 16 bytes aligned
+struct alignas(16) FrameHeader
+{
+   FramePool* owner;
+   uint32_t sizeClass;
+};
+
+struct FreeBlock
+{
+   FreeBlock* next;
+};
+
+uint32_t SizeClassOf( size_t size )
+{
+   for(uint32_t i = 0; i < kClassCount; ++i) {
+      if(size <= kClassSizes[i]) return i;
+   }
+   return kLargeClass;
+}
+
+std::atomic<bool> gUseHugePages = false;
+
+void* ReserveChunk( size_t& inOutSize )
+{
+#if defined(__linux__)
+   if(gUseHugePages.load( std::memory_order_relaxed )) {
+      inOutSize = kHugeChunkSize;
+      void* mem = mmap( nullptr, kHugeChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+      if(mem != MAP_FAILED) return mem;
+
+      // no reserved huge pages, ask for transparent ones on a 2MB aligned range
+      size_t span = kHugeChunkSize * 2;
+      mem = mmap( nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+      if(mem != MAP_FAILED) {
+         uintptr_t begin = uintptr_t( mem );
+         uintptr_t aligned = (begin + kHugeChunkSize - 1) & ~uintptr_t( kHugeChunkSize - 1 );
+         if(aligned > begin) munmap( mem, aligned - begin );
+         uintptr_t end = begin + span, alignedEnd = aligned + kHugeChunkSize;
+         if(end > alignedEnd) munmap( (void*)alignedEnd, end - alignedEnd );
+         madvise( (void*)aligned, kHugeChunkSize, MADV_HUGEPAGE );
+         return (void*)aligned;
+      }
+   }
+#endif
+   inOutSize = kChunkSize;
+   return ::operator new( kChunkSize, std::align_val_t( 64 ) );
+}
+
+/**
+ * One per thread. Only the owner thread touches the free lists and the bump chunk,
+ * other threads return frames through `remoteFrees`, a lock-free stack the owner drains in one go.
+ */
+struct FramePool
+{
+   FreeBlock* freeLists[kClassCount] = {};
+   char* chunkCursor = nullptr;
+   char* chunkEnd = nullptr;
+   std::atomic<FreeBlock*> remoteFrees = nullptr;
+
+   // written by the owner only, read by anyone through the stats query
+   std::atomic<uint64_t> hits = 0;
+   std::atomic<uint64_t> misses = 0;
+   std::atomic<uint64_t> remoteFreeCount = 0;
+   std::atomic<uint64_t> bytesReserved = 0;
+   std::atomic<uint64_t> bytesInUse = 0;
+
+   bool orphaned = false; // guarded by the registry lock
+
+   static void Bump( std::atomic<uint64_t>& counter, int64_t delta )
+   {
+      counter.store( counter.load( std::memory_order_relaxed ) + delta, std::memory_order_relaxed );
+   }
+
+   void* Allocate( uint32_t sizeClass )
+   {
+      FreeBlock* block = freeLists[sizeClass];
+      if(block == nullptr) {
+         DrainRemoteFrees();
+         block = freeLists[sizeClass];
+      }
+
+      FrameHeader* header;
+      if(block != nullptr) {
+         freeLists[sizeClass] = block->next;
+         header = reinterpret_cast<FrameHeader*>(block);
+         Bump( hits, 1 );
+      } else {
+         header = Carve( kClassSizes[sizeClass] + sizeof(FrameHeader) );
+         Bump( misses, 1 );
+      }
+
+      header->owner = this;
+      header->sizeClass = sizeClass;
+      Bump( bytesInUse, int64_t( kClassSizes[sizeClass] ) );
+      return header + 1;
+   }
+
+   void FreeLocal( FrameHeader* header )
+   {
+      uint32_t sizeClass = header->sizeClass;
+      FreeBlock* block = reinterpret_cast<FreeBlock*>(header);
+      block->next = freeLists[sizeClass];
+      freeLists[sizeClass] = block;
+      Bump( bytesInUse, -int64_t( kClassSizes[sizeClass] ) );
+   }
+
+   // any thread, `first..last` is a chain of blocks owned by this pool
+   void PushRemote( FreeBlock* first, FreeBlock* last )
+   {
+      FreeBlock* head = remoteFrees.load( std::memory_order_relaxed );
+      do {
+         last->next = head;
+      } while(!remoteFrees.compare_exchange_weak( head, first, std::memory_order_release, std::memory_order_relaxed ));
+   }
+
+   void DrainRemoteFrees()
+   {
+      if(remoteFrees.load( std::memory_order_relaxed ) == nullptr) return;
+      FreeBlock* block = remoteFrees.exchange( nullptr, std::memory_order_acquire );
+      uint64_t count = 0;
+      while(block != nullptr) {
+         FreeBlock* next = block->next;
+         FreeLocal( reinterpret_cast<FrameHeader*>(block) );
+         block = next;
+         count++;
+      }
+      Bump( remoteFreeCount, int64_t( count ) );
+   }
+
+   FrameHeader* Carve( size_t bytes )
+   {
+      if(size_t( chunkEnd - chunkCursor ) < bytes) {
+         // the tail of the old chunk is too small for this class, it stays reserved but unused
+         size_t chunkSize = 0;
+         chunkCursor = static_cast<char*>(ReserveChunk( chunkSize ));
+         chunkEnd = chunkCursor + chunkSize;
+         Bump( bytesReserved, int64_t( chunkSize ) );
+      }
+      FrameHeader* header = reinterpret_cast<FrameHeader*>(chunkCursor);
+      chunkCursor += bytes;
+      return header;
+   }
+};
+
+/**
+ * Pools live as long as the process, frames can outlive the thread that allocated them.
+ * The pool of an exited thread is handed to the next thread that needs one.
+ */
+struct PoolRegistry
+{
+   std::mutex lock;
+   std::vector<FramePool*> pools;
+
+   FramePool* Acquire()
+   {
+      std::scoped_lock guard( lock );
+      for(FramePool* pool: pools) {
+         if(pool->orphaned) {
+            pool->orphaned = false;
+            return pool;
+         }
+      }
+      pools.push_back( new FramePool() );
+      return pools.back();
+   }
+
+   void Orphan( FramePool* pool )
+   {
+      std::scoped_lock guard( lock );
+      pool->orphaned = true;
+   }
+};
+
+PoolRegistry& Registry()
+{
+   // intentionally leaked, frames can be freed during static destruction
+   static PoolRegistry* registry = new PoolRegistry();
+   return *registry;
+}
+
+// frames this thread freed on behalf of other pools, handed back a batch at a time
+struct RemoteBatch
+{
+   FramePool* owner = nullptr;
+   FreeBlock* first = nullptr;
+   FreeBlock* last = nullptr;
+   uint32_t count = 0;
+
+   void Flush()
+   {
+      if(owner != nullptr && count > 0) {
+         owner->PushRemote( first, last );
+      }
+      *this = {};
+   }
+};
+
+struct ThreadCache
+{
+   FramePool* pool = nullptr;
+   RemoteBatch batches[kRemoteBatchSlots];
+   bool exited = false;
+};
+
+thread_local ThreadCache tCache;
+
+struct ThreadExitGuard
+{
+   bool armed = false;
+   ~ThreadExitGuard()
+   {
+      for(RemoteBatch& batch: tCache.batches) {
+         batch.Flush();
+      }
+      if(tCache.pool != nullptr) {
+         Registry().Orphan( tCache.pool );
+         tCache.pool = nullptr;
+      }
+      tCache.exited = true;
+   }
+};
+
+thread_local ThreadExitGuard tExitGuard;
+
+FramePool* ThreadPool()
+{
+   if(tCache.pool == nullptr && !tCache.exited) {
+      tExitGuard.armed = true;
+      tCache.pool = Registry().Acquire();
+   }
+   return tCache.pool;
+}
+
+void FreeRemote( FrameHeader* header )
+{
+   FramePool* owner = header->owner;
+   FreeBlock* block = reinterpret_cast<FreeBlock*>(header);
+   block->next = nullptr;
+
+   if(tCache.exited) {
+      // this thread is tearing down, no batching anymore
+      owner->PushRemote( block, block );
+      return;
+   }
+
+   RemoteBatch* slot = nullptr;
+   for(RemoteBatch& batch: tCache.batches) {
+      if(batch.owner == owner) {
+         slot = &batch;
+         break;
+      }
+      if(batch.owner == nullptr && slot == nullptr) slot = &batch;
+   }
+   if(slot == nullptr) {
+      // all slots are busy with other owners, make room
+      slot = &tCache.batches[0];
+      slot->Flush();
+   }
+
+   if(slot->owner == nullptr) {
+      slot->owner = owner;
+      slot->first = slot->last = block;
+   } else {
+      slot->last->next = block;
+      slot->last = block;
+   }
+   if(++slot->count >= kRemoteBatchSize) {
+      slot->Flush();
+   }
+}
+
+void Accumulate( FrameAllocator::Stats& total, const FramePool& pool )
+{
+   total.hits += pool.hits.load( std::memory_order_relaxed );
+   total.misses += pool.misses.load( std::memory_order_relaxed );
+   total.remoteFrees += pool.remoteFreeCount.load( std::memory_order_relaxed );
+   total.bytesReserved += pool.bytesReserved.load( std::memory_order_relaxed );
+   total.bytesInUse += pool.bytesInUse.load( std::memory_order_relaxed );
+}
+}
+
+void* FrameAllocator::Allocate( size_t size )
+{
+   uint32_t sizeClass = SizeClassOf( size );
+   FramePool* pool = sizeClass == kLargeClass ? nullptr : ThreadPool();
+
+   if(pool == nullptr) {
+      FrameHeader* header = static_cast<FrameHeader*>(::operator new( size + sizeof(FrameHeader) ));
+      header->owner = nullptr;
+      header->sizeClass = kLargeClass;
+      return header + 1;
+   }
+
+   return pool->Allocate( sizeClass );
+}
+
+void FrameAllocator::Free( void* ptr )
+{
+   if(ptr == nullptr) return;
+   FrameHeader* header = static_cast<FrameHeader*>(ptr) - 1;
+
+   if(header->owner == nullptr) {
+      ::operator delete( header );
+      return;
+   }
+
+   if(header->owner == tCache.pool) {
+      header->owner->FreeLocal( header );
+   } else {
+      FreeRemote( header );
+   }
+}
+
+void FrameAllocator::FlushRemoteFrees()
+{
+   for(RemoteBatch& batch: tCache.batches) {
+      batch.Flush();
+   }
+}
+
+void FrameAllocator::EnableHugePageArena( bool enable )
+{
+   gUseHugePages.store( enable, std::memory_order_relaxed );
+}
+
+FrameAllocator::Stats FrameAllocator::QueryStats()
+{
+   Stats total;
+   PoolRegistry& registry = Registry();
+   std::scoped_lock guard( registry.lock );
+   for(FramePool* pool: registry.pools) {
+      Accumulate( total, *pool );
+   }
+   return total;
+}
+
+FrameAllocator::Stats FrameAllocator::QueryThreadStats()
+{
+   Stats total;
+   if(tCache.pool != nullptr) {
+      Accumulate( total, *tCache.pool );
+   }
+   return total;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace co {
+
+/**
+ * \brief Allocator for coroutine frames, see `promise_base::operator new`.
+ *        Every thread allocates from its own pool of size-classed free lists, so frame churn does not touch the global heap.
+ *        A frame freed on a thread other than the one that allocated it is batched up and handed back to its owner pool.
+ */
+class FrameAllocator
+{
+public:
+   struct Stats
+   {
+      uint64_t hits = 0;          // allocations served from a free list
+      uint64_t misses = 0;        // allocations carved from a fresh chunk, or too large to pool
+      uint64_t remoteFrees = 0;   // frames that came back from other threads
+      uint64_t bytesReserved = 0; // chunk memory owned by the pools
+      uint64_t bytesInUse = 0;    // pooled bytes handed out to live frames
+
+      uint64_t BytesRetained() const { return bytesReserved > bytesInUse ? bytesReserved - bytesInUse : 0; }
+      double HitRate() const { return hits + misses == 0 ? 0.0 : double( hits ) / double( hits + misses ); }
+   };
+
+   static void* Allocate( size_t size );
+   static void  Free( void* ptr );
+
+   // hand the frames freed by this thread on behalf of other pools back to them now, instead of waiting for a full batch.
+   // workers call this before parking
+   static void FlushRemoteFrees();
+
+   // back new chunks with huge pages (2MB, transparent huge pages as fallback). Affects chunks reserved afterward
+   static void EnableHugePageArena( bool enable );
+
+   // sum over every pool in the process
+   static Stats QueryStats();
+   // the calling thread's pool
+   static Stats QueryThreadStats();
+};
+
+}
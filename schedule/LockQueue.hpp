@@ -1,4 +1,5 @@
 #pragma once
+#include <mutex>
 #include <queue>
 #include <shared_mutex>
 #include <span>
@@ -115,3 +116,65 @@ protected:
    bool               mIsClosed = false;
    mutable std::mutex mAccessLock;
 };
+
+//
+// FIFO queue linking the items through a pointer member of the item itself, so queuing never allocates.
+// An item can only be in one such queue at a time.
+//
+template< typename T, T* T::*Next >
+class IntrusiveLockQueue
+{
+public:
+   using size_type = size_t;
+
+   void Enqueue( T* ele )
+   {
+      ele->*Next = nullptr;
+      std::scoped_lock lock( mAccessLock );
+      if(mTail) {
+         mTail->*Next = ele;
+      } else {
+         mHead = ele;
+      }
+      mTail = ele;
+      mCount++;
+   }
+
+   // append `count` items already linked from `first` to `last`, under one lock
+   void Enqueue( T* first, T* last, size_type count )
+   {
+      last->*Next = nullptr;
+      std::scoped_lock lock( mAccessLock );
+      if(mTail) {
+         mTail->*Next = first;
+      } else {
+         mHead = first;
+      }
+      mTail = last;
+      mCount += count;
+   }
+
+   bool Dequeue( T*& outEle )
+   {
+      std::scoped_lock lock( mAccessLock );
+      if( mHead == nullptr ) return false;
+
+      outEle = mHead;
+      mHead = mHead->*Next;
+      if(mHead == nullptr) mTail = nullptr;
+      mCount--;
+      return true;
+   }
+
+   size_type Count() const
+   {
+      std::scoped_lock lock( mAccessLock );
+      return mCount;
+   }
+
+protected:
+   T* mHead = nullptr;
+   T* mTail = nullptr;
+   size_type mCount = 0;
+   mutable std::mutex mAccessLock;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+
+//
+// Intrusive lock-free multi producer single consumer queue, linked through `T::*Next`.
+// Producers push onto a lock-free stack, the consumer takes the whole stack in one exchange and
+// reverses it into arrival order, so producers and the consumer only ever meet on that one exchange.
+//
+template< typename T, T* T::*Next >
+class IntrusiveMpscQueue
+{
+public:
+   // any thread
+   void Push( T* item )
+   {
+      T* head = mIncoming.load( std::memory_order_relaxed );
+      do {
+         item->*Next = head;
+      } while(!mIncoming.compare_exchange_weak( head, item, std::memory_order_release, std::memory_order_relaxed ));
+   }
+
+   // consumer only
+   bool Pop( T*& outItem )
+   {
+      if(mPending == nullptr) {
+         if(mIncoming.load( std::memory_order_relaxed ) == nullptr) return false;
+         T* batch = mIncoming.exchange( nullptr, std::memory_order_acquire );
+         while(batch != nullptr) {
+            T* next = batch->*Next;
+            batch->*Next = mPending;
+            mPending = batch;
+            batch = next;
+         }
+      }
+
+      outItem = mPending;
+      mPending = outItem->*Next;
+      outItem->*Next = nullptr;
+      return true;
+   }
+
+   // consumer only, anyone else gets an estimation
+   bool Empty() const { return mPending == nullptr && mIncoming.load( std::memory_order_relaxed ) == nullptr; }
+
+protected:
+   alignas(64) std::atomic<T*> mIncoming = nullptr;
+   alignas(64) T* mPending = nullptr; // consumer only, in arrival order
+};
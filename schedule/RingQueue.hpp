@@ -0,0 +1,186 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "../utils.hpp"
+
+//
+// Bounded lock-free multi producer multi consumer queue, Dmitry Vyukov's sequence-per-slot ring buffer.
+// Every slot carries a sequence number telling whose turn it is: producers wait for `pos`, consumers for `pos + 1`.
+// Producers and consumers only contend on their own position counter, and each slot sits on its own cache line.
+// The capacity is rounded up to a power of two, `Enqueue` fails when the ring is full.
+//
+template< typename T >
+class RingQueue
+{
+public:
+   using size_type = size_t;
+
+   explicit RingQueue( size_type capacity = 1024 )
+   {
+      size_type cap = 2;
+      while(cap < capacity) cap <<= 1;
+      mMask = cap - 1;
+      mCells = std::make_unique<Cell[]>( cap );
+      for(size_type i = 0; i < cap; ++i) {
+         mCells[i].sequence.store( i, std::memory_order_relaxed );
+      }
+   }
+
+   RingQueue( const RingQueue& ) = delete;
+   RingQueue& operator=( const RingQueue& ) = delete;
+
+   bool Enqueue( const T& ele ) { return Emplace( ele, 0 ); }
+   bool Enqueue( T&& ele ) { return Emplace( std::move( ele ), 0 ); }
+   // all or nothing, fails if there is not enough room for the whole batch right now
+   bool Enqueue( std::span<const T> eles ) { return EnqueueRange( eles, 0 ); }
+
+   bool Dequeue( T& outEle )
+   {
+      size_type pos = mDequeuePos.load( std::memory_order_relaxed );
+      while(true) {
+         Cell& cell = mCells[pos & mMask];
+         size_type seq = cell.sequence.load( std::memory_order_acquire );
+         intptr_t diff = intptr_t( seq ) - intptr_t( pos + 1 );
+         if(diff == 0) {
+            if(mDequeuePos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed )) {
+               outEle = std::move( cell.data );
+               // hand the slot to the producer one lap ahead
+               cell.sequence.store( pos + mMask + 1, std::memory_order_release );
+               return true;
+            }
+         } else if(diff < 0) {
+            // not written yet: empty
+            return false;
+         } else {
+            pos = mDequeuePos.load( std::memory_order_relaxed );
+         }
+      }
+   }
+
+   // estimation only, can be stale by the time it returns
+   size_type Count() const
+   {
+      size_type enqueued = mEnqueuePos.load( std::memory_order_relaxed );
+      size_type dequeued = mDequeuePos.load( std::memory_order_relaxed );
+      return enqueued > dequeued ? enqueued - dequeued : 0;
+   }
+
+   size_type Capacity() const { return mMask + 1; }
+
+protected:
+   struct alignas(64) Cell
+   {
+      std::atomic<size_type> sequence;
+      T data;
+   };
+
+   // claim `n` consecutive slots with one CAS on the enqueue position. Fails when one of them is still taken from the
+   // previous lap (full), or when the position has `closedBit` set
+   bool Claim( size_type n, size_type closedBit, size_type& outPos )
+   {
+      size_type pos = mEnqueuePos.load( std::memory_order_relaxed );
+      while(true) {
+         if(pos & closedBit) return false;
+         bool stale = false;
+         for(size_type i = 0; i < n && !stale; ++i) {
+            size_type seq = mCells[(pos + i) & mMask].sequence.load( std::memory_order_acquire );
+            intptr_t diff = intptr_t( seq ) - intptr_t( pos + i );
+            if(diff < 0) return false;
+            // somebody else claimed it already
+            stale = diff > 0;
+         }
+         if(stale) {
+            pos = mEnqueuePos.load( std::memory_order_relaxed );
+         } else if(mEnqueuePos.compare_exchange_weak( pos, pos + n, std::memory_order_relaxed )) {
+            outPos = pos;
+            return true;
+         }
+      }
+   }
+
+   template<typename U>
+   void Publish( size_type pos, U&& ele )
+   {
+      Cell& cell = mCells[pos & mMask];
+      cell.data = std::forward<U>( ele );
+      cell.sequence.store( pos + 1, std::memory_order_release );
+   }
+
+   template<typename U>
+   bool Emplace( U&& ele, size_type closedBit )
+   {
+      size_type pos;
+      if(!Claim( 1, closedBit, pos )) return false;
+      Publish( pos, std::forward<U>( ele ) );
+      return true;
+   }
+
+   bool EnqueueRange( std::span<const T> eles, size_type closedBit )
+   {
+      size_type n = eles.size();
+      if(n > Capacity()) return false;
+      size_type pos = 0;
+      if(n > 0 && !Claim( n, closedBit, pos )) return false;
+      for(size_type i = 0; i < n; ++i) {
+         Publish( pos + i, eles[i] );
+      }
+      return true;
+   }
+
+   std::unique_ptr<Cell[]> mCells;
+   size_type mMask = 0;
+   alignas(64) std::atomic<size_type> mEnqueuePos = 0;
+   alignas(64) std::atomic<size_type> mDequeuePos = 0;
+};
+
+//
+// `RingQueue` that can be closed, matching `ClosableLockQueue`. The closed flag is the top bit of the enqueue position,
+// so closing and enqueuing are ordered by the same atomic: once `Close` returns, nothing else gets in.
+// `Enqueue` fails when the queue is closed or full, tell them apart with `IsClosed`.
+//
+template< typename T >
+class ClosableRingQueue: public RingQueue<T>
+{
+   using base_t = RingQueue<T>;
+public:
+   using size_type = typename base_t::size_type;
+   using base_t::base_t;
+
+   bool Enqueue( const T& ele ) { return this->Emplace( ele, kClosedBit ); }
+   bool Enqueue( T&& ele ) { return this->Emplace( std::move( ele ), kClosedBit ); }
+   // all or nothing: fails if it's closed, or if there is not enough room for the whole batch right now
+   bool Enqueue( std::span<const T> eles ) { return !IsClosed() && this->EnqueueRange( eles, kClosedBit ); }
+
+   void Close() { this->mEnqueuePos.fetch_or( kClosedBit, std::memory_order_acq_rel ); }
+
+   bool IsClosed() const { return (this->mEnqueuePos.load( std::memory_order_acquire ) & kClosedBit) != 0; }
+
+   // close, then move whatever is left to `container`. Producers that got a slot before the close are waited for
+   void CloseAndFlush( std::vector<T>& container )
+   {
+      Close();
+      size_type end = this->mEnqueuePos.load( std::memory_order_acquire ) & ~kClosedBit;
+      T ele;
+      while(this->mDequeuePos.load( std::memory_order_relaxed ) < end) {
+         if(base_t::Dequeue( ele )) {
+            container.push_back( std::move( ele ) );
+         } else {
+            CpuRelax();
+         }
+      }
+   }
+
+   size_type Count() const
+   {
+      size_type enqueued = this->mEnqueuePos.load( std::memory_order_relaxed ) & ~kClosedBit;
+      size_type dequeued = this->mDequeuePos.load( std::memory_order_relaxed );
+      return enqueued > dequeued ? enqueued - dequeued : 0;
+   }
+
+protected:
+   static constexpr size_type kClosedBit = size_type( 1 ) << (sizeof(size_type) * 8 - 1);
+};
@@ -0,0 +1,208 @@
+#pragma once
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <mutex>
+
+#include "../utils.hpp"
+
+//
+// Hierarchical timer wheel (Varghese & Lauck), `kLevelCount` levels of `kSlotCount` slots over ticks of `kTickNs`.
+// A timer goes to the level matching how far away it is, and moves one level down each time the level below turns over,
+// so insert and cancel are O(1) and a tick only looks at the one slot expiring. Timers further than the wheel can see
+// wait in the top level and are placed again as they come down.
+// Timers are intrusive, derive from `TimerWheel::Node`. Everything but `NextExpiryNs`/`Count` is done under the wheel's lock.
+//
+class TimerWheel
+{
+public:
+   static constexpr uint64_t kTickNs = 100'000; // 0.1ms
+   static constexpr uint kSlotBits = 6;
+   static constexpr uint kSlotCount = 1u << kSlotBits;
+   static constexpr uint kLevelCount = 4;
+   static constexpr uint64_t kNever = UINT64_MAX;
+
+   struct Node
+   {
+      Node* prev = nullptr;
+      Node* next = nullptr;
+      uint64_t expireTick = 0;
+      uint slot = 0; // level * kSlotCount + index
+      bool armed = false;
+   };
+
+   explicit TimerWheel( uint64_t nowNs )
+      : mCurrentTick( nowNs / kTickNs )
+   {
+      for(Node& head: mSlots) {
+         head.prev = head.next = &head;
+      }
+   }
+
+   TimerWheel( const TimerWheel& ) = delete;
+   TimerWheel& operator=( const TimerWheel& ) = delete;
+
+   // arm `node`, returns true if it moved the next expiry earlier
+   bool Insert( Node& node, uint64_t expireNs )
+   {
+      std::scoped_lock guard( mLock );
+      EXPECTS( !node.armed );
+      // round up, never fire early
+      node.expireTick = (expireNs + kTickNs - 1) / kTickNs;
+      node.armed = true;
+      uint64_t tick = Place( node );
+      mCount.fetch_add( 1, std::memory_order_relaxed );
+
+      uint64_t expiry = tick * kTickNs;
+      if(expiry >= mNextExpiryNs.load( std::memory_order_relaxed )) return false;
+      mNextExpiryNs.store( expiry, std::memory_order_seq_cst );
+      return true;
+   }
+
+   // false if it already fired (or was never armed)
+   bool Cancel( Node& node )
+   {
+      std::scoped_lock guard( mLock );
+      if(!node.armed) return false;
+      Unlink( node );
+      node.armed = false;
+      mCount.fetch_sub( 1, std::memory_order_relaxed );
+      return true;
+   }
+
+   // Expire everything due by `nowNs`. Returns the expired nodes chained through `next`, read it before acting on a node:
+   // once its owner hears about it, the node can go away
+   Node* Advance( uint64_t nowNs )
+   {
+      std::scoped_lock guard( mLock );
+      return AdvanceLocked( nowNs );
+   }
+
+   // `Advance`, unless someone else is at it already
+   bool TryAdvance( uint64_t nowNs, Node*& outExpired )
+   {
+      if(!mLock.try_lock()) return false;
+      outExpired = AdvanceLocked( nowNs );
+      mLock.unlock();
+      return true;
+   }
+
+   // when `Advance` should run next, `kNever` if nothing is armed. Can be early (a cascade is due), never late
+   uint64_t NextExpiryNs() const { return mNextExpiryNs.load( std::memory_order_seq_cst ); }
+   size_t Count() const { return mCount.load( std::memory_order_relaxed ); }
+
+protected:
+   Node* AdvanceLocked( uint64_t nowNs )
+   {
+      uint64_t nowTick = nowNs / kTickNs;
+      Node* expired = nullptr;
+
+      while(mCurrentTick <= nowTick) {
+         if(mCount.load( std::memory_order_relaxed ) == 0) {
+            mCurrentTick = nowTick + 1;
+            break;
+         }
+         uint64_t tick = mCurrentTick;
+         if((tick & (kSlotCount - 1)) == 0) {
+            // the level below turned over, bring the next batch of each level down
+            for(uint level = 1; level < kLevelCount; ++level) {
+               uint index = uint( tick >> (level * kSlotBits) ) & (kSlotCount - 1);
+               Cascade( level * kSlotCount + index );
+               if(index != 0) break;
+            }
+         } else if(mOccupied[0] == 0) {
+            // nothing in the bottom level, skip to where the next cascade happens
+            uint64_t next = (tick | (kSlotCount - 1)) + 1;
+            mCurrentTick = next <= nowTick ? next : nowTick + 1;
+            continue;
+         }
+
+         Node& head = mSlots[tick & (kSlotCount - 1)];
+         while(head.next != &head) {
+            Node& node = *head.next;
+            Unlink( node );
+            node.armed = false;
+            node.next = expired;
+            expired = &node;
+            mCount.fetch_sub( 1, std::memory_order_relaxed );
+         }
+         mCurrentTick = tick + 1;
+      }
+
+      uint64_t nextTick = ComputeNextExpiryTick();
+      mNextExpiryNs.store( nextTick == kNever ? kNever : nextTick * kTickNs, std::memory_order_seq_cst );
+      return expired;
+   }
+
+   // link it to its slot, returns the tick the slot is due
+   uint64_t Place( Node& node )
+   {
+      static constexpr uint64_t kRange = uint64_t( 1 ) << (kSlotBits * kLevelCount);
+      uint64_t tick = node.expireTick < mCurrentTick ? mCurrentTick : node.expireTick;
+      uint64_t delta = tick - mCurrentTick;
+      if(delta >= kRange) {
+         // beyond the wheel, park it at the far end and place it again when it gets there
+         delta = kRange - 1;
+         tick = mCurrentTick + delta;
+      }
+
+      uint level = 0;
+      while(delta >= (uint64_t( 1 ) << (kSlotBits * (level + 1)))) level++;
+      uint index = uint( tick >> (level * kSlotBits) ) & (kSlotCount - 1);
+      node.slot = level * kSlotCount + index;
+
+      Node& head = mSlots[node.slot];
+      node.prev = head.prev;
+      node.next = &head;
+      head.prev->next = &node;
+      head.prev = &node;
+      mOccupied[level] |= uint64_t( 1 ) << index;
+
+      // the slot is due when its window starts
+      return level == 0 ? tick : (tick >> (level * kSlotBits)) << (level * kSlotBits);
+   }
+
+   void Unlink( Node& node )
+   {
+      node.prev->next = node.next;
+      node.next->prev = node.prev;
+      Node& head = mSlots[node.slot];
+      if(head.next == &head) {
+         mOccupied[node.slot / kSlotCount] &= ~(uint64_t( 1 ) << (node.slot % kSlotCount));
+      }
+   }
+
+   void Cascade( uint slot )
+   {
+      Node& head = mSlots[slot];
+      while(head.next != &head) {
+         Node& node = *head.next;
+         Unlink( node );
+         Place( node );
+      }
+   }
+
+   uint64_t ComputeNextExpiryTick() const
+   {
+      uint64_t best = kNever;
+      for(uint level = 0; level < kLevelCount; ++level) {
+         if(mOccupied[level] == 0) continue;
+         uint shift = level * kSlotBits;
+         uint64_t window = mCurrentTick >> shift;
+         // the current window of an upper level is already cascaded, unless we sit right at its start
+         bool atStart = level == 0 || (mCurrentTick & ((uint64_t( 1 ) << shift) - 1)) == 0;
+         uint64_t first = atStart ? window : window + 1;
+         uint64_t rotated = std::rotr( mOccupied[level], int( first & (kSlotCount - 1) ) );
+         uint64_t tick = (first + uint64_t( std::countr_zero( rotated ) )) << shift;
+         if(tick < best) best = tick;
+      }
+      return best;
+   }
+
+   Node mSlots[kLevelCount * kSlotCount];
+   uint64_t mOccupied[kLevelCount] = {}; // a bit per non-empty slot
+   uint64_t mCurrentTick;                // next tick to expire
+   SpinLock mLock;
+   std::atomic<size_t> mCount = 0;
+   std::atomic<uint64_t> mNextExpiryNs = kNever;
+};
@@ -0,0 +1,149 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+//
+// Chase-Lev work stealing deque, with the memory orderings from
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013).
+// The owner thread pushes and pops at the bottom (LIFO), any other thread can steal from the top (FIFO).
+// The ring grows when full, retired rings are kept alive until the deque dies because a thief might still be reading them.
+//
+template< typename T >
+class WorkStealingDeque
+{
+   static_assert(std::is_trivially_copyable_v<T>, "items are copied around racily, keep them trivially copyable (pointers)");
+public:
+   using size_type = size_t;
+
+   WorkStealingDeque(): WorkStealingDeque( 256 ) {}
+
+   explicit WorkStealingDeque( size_type capacity )
+   {
+      size_type cap = 1;
+      while(cap < capacity) cap <<= 1;
+      mRetired.push_back( std::make_unique<Ring>( int64_t( cap ) ) );
+      mRing.store( mRetired.back().get(), std::memory_order_relaxed );
+   }
+
+   WorkStealingDeque( const WorkStealingDeque& ) = delete;
+   WorkStealingDeque& operator=( const WorkStealingDeque& ) = delete;
+
+   // owner only
+   void Push( T item )
+   {
+      int64_t b = mBottom.load( std::memory_order_relaxed );
+      int64_t t = mTop.load( std::memory_order_acquire );
+      Ring* ring = mRing.load( std::memory_order_relaxed );
+      if(b - t > ring->capacity - 1) {
+         ring = Grow( ring, b, t );
+      }
+      ring->Put( b, item );
+      std::atomic_thread_fence( std::memory_order_release );
+      mBottom.store( b + 1, std::memory_order_relaxed );
+   }
+
+   // owner only, the whole batch becomes visible to thieves at once
+   void PushBatch( std::span<const T> items )
+   {
+      int64_t b = mBottom.load( std::memory_order_relaxed );
+      int64_t t = mTop.load( std::memory_order_acquire );
+      int64_t n = int64_t( items.size() );
+      Ring* ring = mRing.load( std::memory_order_relaxed );
+      while(b - t + n > ring->capacity) {
+         ring = Grow( ring, b, t );
+      }
+      for(int64_t i = 0; i < n; ++i) {
+         ring->Put( b + i, items[size_t( i )] );
+      }
+      std::atomic_thread_fence( std::memory_order_release );
+      mBottom.store( b + n, std::memory_order_relaxed );
+   }
+
+   // owner only
+   bool Pop( T& outItem )
+   {
+      int64_t b = mBottom.load( std::memory_order_relaxed ) - 1;
+      Ring* ring = mRing.load( std::memory_order_relaxed );
+      mBottom.store( b, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      int64_t t = mTop.load( std::memory_order_relaxed );
+
+      if(t > b) {
+         // empty
+         mBottom.store( b + 1, std::memory_order_relaxed );
+         return false;
+      }
+
+      T item = ring->Get( b );
+      if(t == b) {
+         // last item, race against thieves
+         bool won = mTop.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+         mBottom.store( b + 1, std::memory_order_relaxed );
+         if(!won) return false;
+      }
+      outItem = item;
+      return true;
+   }
+
+   // any thread. Returns false when it's empty or lost the race to another thief/the owner
+   bool Steal( T& outItem )
+   {
+      int64_t t = mTop.load( std::memory_order_acquire );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      int64_t b = mBottom.load( std::memory_order_acquire );
+      if(t >= b) return false;
+
+      Ring* ring = mRing.load( std::memory_order_acquire );
+      T item = ring->Get( t );
+      if(!mTop.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) {
+         return false;
+      }
+      outItem = item;
+      return true;
+   }
+
+   // estimation only, can be stale by the time it returns
+   size_type Count() const
+   {
+      int64_t b = mBottom.load( std::memory_order_relaxed );
+      int64_t t = mTop.load( std::memory_order_relaxed );
+      return b > t ? size_type( b - t ) : 0;
+   }
+
+   bool Empty() const { return Count() == 0; }
+
+protected:
+   struct Ring
+   {
+      int64_t capacity;
+      int64_t mask;
+      std::unique_ptr<std::atomic<T>[]> items;
+
+      explicit Ring( int64_t capacity )
+         : capacity( capacity ), mask( capacity - 1 ), items( new std::atomic<T>[size_t( capacity )] ) {}
+
+      void Put( int64_t index, T item ) { items[index & mask].store( item, std::memory_order_relaxed ); }
+      T Get( int64_t index ) const { return items[index & mask].load( std::memory_order_relaxed ); }
+   };
+
+   Ring* Grow( Ring* ring, int64_t bottom, int64_t top )
+   {
+      auto bigger = std::make_unique<Ring>( ring->capacity * 2 );
+      for(int64_t i = top; i < bottom; ++i) {
+         bigger->Put( i, ring->Get( i ) );
+      }
+      Ring* result = bigger.get();
+      mRetired.push_back( std::move( bigger ) );
+      mRing.store( result, std::memory_order_release );
+      return result;
+   }
+
+   alignas(64) std::atomic<int64_t> mTop = 0;
+   alignas(64) std::atomic<int64_t> mBottom = 0;
+   alignas(64) std::atomic<Ring*>   mRing = nullptr;
+   std::vector<std::unique_ptr<Ring>> mRetired; // owner only
+};
@@ -1,9 +1,18 @@
 ﻿#pragma once
 #include "token.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <concepts>
+#include <functional>
+#include <optional>
+#include <span>
 #include <vector>
 
+#include "cancellation.hpp"
 #include "event.hpp"
 #include "task.hpp"
+#include "when.hpp"
 namespace co
 {
 template<typename Deferred>
@@ -11,19 +20,355 @@ co::deferred_token<> parallel_for( std::vector<Deferred> deferred )
 {
    static_assert(Deferred::IsDeferred, "deferred jobs only");
 
-   single_consumer_counter_event counter(deferred.size());
+   // they all continue into one countdown here, no coroutine per job, and start in `Scheduler::ScheduleBatch` chunks
+   // like `launch_all`, not one `Schedule` each
+   co_await when_all( std::move( deferred ) );
+}
+
+// How `parallel_for` over a range cuts it into jobs. Either way it's O(workers) coroutine frames, not one per iteration
+
+// one job per worker, equal shares. The cheapest, for iterations that all cost about the same
+struct static_partitioner {};
+
+// one job per worker, each takes `grain` iterations at a time off a shared counter until there are none left
+struct dynamic_partitioner
+{
+   size_t grain = 1;
+};
+
+// one job to start with, which gives half of what it has left away whenever a worker is out of work (lazy binary splitting).
+// `grain` is how many iterations it runs between looking for idle workers, 0 picks one from the size of the range
+struct auto_partitioner
+{
+   size_t grain = 0;
+};
+
+namespace detail
+{
+template<typename Index, typename Body>
+void RunIterations( Index begin, size_t from, size_t to, Body& body )
+{
+   for(size_t i = from; i < to; ++i) {
+      body( Index( begin + Index( i ) ) );
+   }
+}
+
+template<typename Index, typename Body>
+co::deferred_token<> ForShare( Index begin, size_t from, size_t to, Body& body )
+{
+   RunIterations( begin, from, to, body );
+   co_return;
+}
+
+template<typename Index, typename Body>
+co::deferred_token<> ForDynamic( Index begin, size_t count, size_t grain, std::atomic<size_t>& next, Body& body )
+{
+   while(true) {
+      // nothing of ours is running, so this is a fine place to stop
+      co_await check_cancel();
+      size_t from = next.fetch_add( grain, std::memory_order_relaxed );
+      if(from >= count) break;
+      RunIterations( begin, from, std::min( from + grain, count ), body );
+   }
+}
+
+struct split_state
+{
+   Scheduler& scheduler;
+   size_t grain;
+   // splits left, so the frames stay O(workers) however long the loop runs
+   std::atomic<int> budget;
 
-   auto makeTask = [&counter]( Deferred job ) -> co::token<>
+   static constexpr int kSplitsPerWorker = 4;
+   static constexpr size_t kChunksPerWorker = 64;
+};
+
+template<typename Index, typename Body>
+co::deferred_token<> ForSplit( Index begin, size_t from, size_t to, Body& body, split_state& state )
+{
+   std::vector<co::deferred_token<>> givenAway;
+   // the halves given away run against this frame, it can only stop once they are done
+   cancellation_token cancellation = co_await current_cancellation();
+   while(from < to && !cancellation.IsCanceled()) {
+      size_t left = to - from;
+      // somebody is idle: the upper half goes to them
+      if(left >= 2 * state.grain && state.scheduler.EstimateFreeWorkerCount() > 0 &&
+         state.budget.fetch_sub( 1, std::memory_order_relaxed ) > 0) {
+         size_t middle = from + left / 2;
+         givenAway.push_back( ForSplit( begin, middle, to, body, state ) );
+         givenAway.back().SetCancellation( cancellation );
+         givenAway.back().Launch( state.scheduler );
+         to = middle;
+      }
+      size_t chunkEnd = from + std::min( state.grain, to - from );
+      RunIterations( begin, from, chunkEnd, body );
+      from = chunkEnd;
+   }
+   co_await when_all( std::move( givenAway ) );
+   co_await check_cancel();
+}
+}
+
+/**
+ * \brief `co_await parallel_for( begin, end, body )`: `body( i )` for every `i` in [begin, end), spread over the workers
+ *        of the current scheduler as `partitioner` says. `body` is shared by all of them, and is called concurrently.
+ *        Canceling the awaiting coroutine stops it between chunks (not with `static_partitioner`), and abandons it.
+ */
+template<std::integral Index, typename Body, typename Partitioner = auto_partitioner>
+   requires std::invocable<Body&, Index>
+co::deferred_token<> parallel_for( Index begin, Index end, Body body, Partitioner partitioner = {} )
+{
+   size_t count = end > begin ? size_t( end - begin ) : 0;
+   if(count == 0) co_return;
+
+   Scheduler& scheduler = Scheduler::CurrentOrDefault();
+   size_t workerCount = std::max<size_t>( scheduler.GetWorkerCount(), 1 );
+
+   if constexpr( std::is_same_v<Partitioner, static_partitioner> ) {
+      size_t jobCount = std::min( workerCount, count );
+      std::vector<co::deferred_token<>> jobs;
+      jobs.reserve( jobCount );
+      for(size_t i = 0; i < jobCount; ++i) {
+         jobs.push_back( detail::ForShare( begin, count * i / jobCount, count * (i + 1) / jobCount, body ) );
+      }
+      co_await when_all( std::move( jobs ) );
+   } else if constexpr( std::is_same_v<Partitioner, dynamic_partitioner> ) {
+      size_t grain = std::max<size_t>( partitioner.grain, 1 );
+      size_t jobCount = std::min( workerCount, (count + grain - 1) / grain );
+      std::atomic<size_t> next = 0;
+      std::vector<co::deferred_token<>> jobs;
+      jobs.reserve( jobCount );
+      for(size_t i = 0; i < jobCount; ++i) {
+         jobs.push_back( detail::ForDynamic( begin, count, grain, next, body ) );
+      }
+      co_await when_all( std::move( jobs ) );
+   } else {
+      static_assert(std::is_same_v<Partitioner, auto_partitioner>, "static_partitioner, dynamic_partitioner or auto_partitioner");
+      size_t grain = partitioner.grain > 0 ? partitioner.grain
+                        : std::max<size_t>( count / (workerCount * detail::split_state::kChunksPerWorker), 1 );
+      detail::split_state state{ scheduler, grain, int( workerCount ) * detail::split_state::kSplitsPerWorker };
+      co_await detail::ForSplit( begin, 0, count, body, state );
+   }
+}
+
+// `body( element )` for every element of `range`, see above
+template<typename T, size_t Extent, typename Body, typename Partitioner = auto_partitioner>
+   requires std::invocable<Body&, T&>
+co::deferred_token<> parallel_for( std::span<T, Extent> range, Body body, Partitioner partitioner = {} )
+{
+   co_await parallel_for( size_t( 0 ), range.size(), [&range, &body]( size_t i ) { body( range[i] ); }, partitioner );
+}
+
+namespace detail
+{
+// Reduce/scan work on fixed chunks, so the result only depends on the input and the grain, not on who ran what
+struct chunking
+{
+   size_t size;
+   size_t count;
+
+   static constexpr size_t kMinChunkSize = 4096;
+   static constexpr size_t kChunksPerWorker = 4;
+
+   // `grain` 0 picks the chunk size from the element count and the worker count
+   static chunking Make( size_t elementCount, size_t grain )
    {
-      co_await job;
-      counter.decrement( 1 );
-   };
+      size_t size = grain;
+      if(size == 0) {
+         size_t workerCount = std::max<size_t>( Scheduler::CurrentOrDefault().GetWorkerCount(), 1 );
+         size = std::max( kMinChunkSize, (elementCount + workerCount * kChunksPerWorker - 1) / (workerCount * kChunksPerWorker) );
+      }
+      return { size, (elementCount + size - 1) / size };
+   }
+};
+
+// `reduce` can take the elements in any order: plain sums of numbers
+template<typename T, typename Reduce>
+constexpr bool kReducesInAnyOrder = std::is_arithmetic_v<T> &&
+   (std::is_same_v<std::remove_cv_t<Reduce>, std::plus<>> || std::is_same_v<std::remove_cv_t<Reduce>, std::plus<T>>);
+
+// Several independent accumulators: the compiler can vectorize the main loop without reassociating anything itself, so
+// floats get the same answer every time too.
+template<typename T, typename In, typename Reduce, typename Transform>
+T ReduceLeaf( const In* in, size_t count, Reduce& reduce, Transform& transform )
+{
+   EXPECTS( count > 0 );
+   constexpr size_t kLanes = 8;
+   if(count < 2 * kLanes) {
+      T sum = T( transform( in[0] ) );
+      for(size_t i = 1; i < count; ++i) sum = reduce( sum, T( transform( in[i] ) ) );
+      return sum;
+   }
 
-   for(auto& d: deferred) {
-      makeTask( std::move(d) );
+   if constexpr( kReducesInAnyOrder<T, Reduce> ) {
+      // lane k takes k, k + 8, ..., combined as a tree
+      auto lanes = [&]<size_t... Lane>( std::index_sequence<Lane...> ) {
+         return std::array<T, kLanes>{ T( transform( in[Lane] ) )... };
+      }( std::make_index_sequence<kLanes>{} );
+      size_t i = kLanes;
+      for(; i + kLanes <= count; i += kLanes) {
+         for(size_t lane = 0; lane < kLanes; ++lane) {
+            lanes[lane] = reduce( lanes[lane], T( transform( in[i + lane] ) ) );
+         }
+      }
+      for(size_t width = kLanes / 2; width > 0; width /= 2) {
+         for(size_t lane = 0; lane < width; ++lane) lanes[lane] = reduce( lanes[lane], lanes[lane + width] );
+      }
+      T sum = lanes[0];
+      for(; i < count; ++i) sum = reduce( sum, T( transform( in[i] ) ) );
+      return sum;
+   } else {
+      // lane k takes the k-th of 8 blocks, combined left to right, then the rest: `reduce` only has to be associative
+      size_t block = count / kLanes;
+      auto lanes = [&]<size_t... Lane>( std::index_sequence<Lane...> ) {
+         return std::array<T, kLanes>{ T( transform( in[Lane * block] ) )... };
+      }( std::make_index_sequence<kLanes>{} );
+      for(size_t i = 1; i < block; ++i) {
+         for(size_t lane = 0; lane < kLanes; ++lane) {
+            lanes[lane] = reduce( lanes[lane], T( transform( in[lane * block + i] ) ) );
+         }
+      }
+      T sum = std::move( lanes[0] );
+      for(size_t lane = 1; lane < kLanes; ++lane) sum = reduce( sum, lanes[lane] );
+      for(size_t i = kLanes * block; i < count; ++i) sum = reduce( sum, T( transform( in[i] ) ) );
+      return sum;
    }
+}
+
+// pairwise, neighbours first, into `partials[0]`
+template<typename T, typename Reduce>
+T CombineTree( std::vector<T>& partials, Reduce& reduce )
+{
+   EXPECTS( !partials.empty() );
+   for(size_t stride = 1; stride < partials.size(); stride *= 2) {
+      for(size_t i = 0; i + stride < partials.size(); i += 2 * stride) {
+         partials[i] = reduce( partials[i], partials[i + stride] );
+      }
+   }
+   return partials[0];
+}
 
-   co_await counter;
+struct identity_transform
+{
+   template<typename In>
+   const In& operator()( const In& value ) const { return value; }
+};
+
+template<typename T, typename In, typename Reduce, typename Transform>
+co::deferred_token<std::vector<T>> ReduceChunks( std::span<const In> range, chunking chunks, Reduce& reduce, Transform& transform )
+{
+   std::vector<std::optional<T>> partials( chunks.count );
+   co_await parallel_for( size_t( 0 ), chunks.count, [&]( size_t chunk ) {
+      size_t from = chunk * chunks.size;
+      size_t count = std::min( chunks.size, range.size() - from );
+      partials[chunk].emplace( ReduceLeaf<T>( range.data() + from, count, reduce, transform ) );
+   }, dynamic_partitioner{ 1 } );
+
+   std::vector<T> results;
+   results.reserve( chunks.count );
+   for(auto& partial: partials) results.push_back( std::move( *partial ) );
+   co_return results;
+}
+
+// one chunk, in order, starting from `carry` (nothing for the first chunk of an inclusive scan)
+template<bool Inclusive, typename T, typename Reduce>
+void ScanLeaf( const T* in, T* out, size_t count, std::optional<T> carry, Reduce& reduce )
+{
+   size_t i = 0;
+   if(!carry) {
+      carry.emplace( in[0] );
+      out[0] = *carry;
+      i = 1;
+   }
+   T sum = std::move( *carry );
+   for(; i < count; ++i) {
+      if constexpr( Inclusive ) {
+         sum = reduce( sum, in[i] );
+         out[i] = sum;
+      } else {
+         // `out` can be `in`
+         T value = in[i];
+         out[i] = sum;
+         sum = reduce( sum, value );
+      }
+   }
+}
+
+template<bool Inclusive, typename T, typename Reduce>
+co::deferred_token<> ScanChunks( std::span<const T> in, std::span<T> out, std::optional<T> init, Reduce& reduce, size_t grain )
+{
+   chunking chunks = chunking::Make( in.size(), grain );
+
+   // the sum of the last chunk is of no use
+   std::vector<T> sums;
+   if(chunks.count > 1) {
+      identity_transform identity;
+      chunking leading = { chunks.size, chunks.count - 1 };
+      sums = co_await ReduceChunks<T>( in.first( leading.count * leading.size ), leading, reduce, identity );
+   }
+
+   // what comes before each chunk
+   std::vector<std::optional<T>> carries( chunks.count );
+   carries[0] = std::move( init );
+   for(size_t chunk = 1; chunk < chunks.count; ++chunk) {
+      if(carries[chunk - 1]) {
+         carries[chunk].emplace( reduce( *carries[chunk - 1], sums[chunk - 1] ) );
+      } else {
+         carries[chunk].emplace( sums[chunk - 1] );
+      }
+   }
+
+   co_await parallel_for( size_t( 0 ), chunks.count, [&]( size_t chunk ) {
+      size_t from = chunk * chunks.size;
+      size_t count = std::min( chunks.size, in.size() - from );
+      ScanLeaf<Inclusive>( in.data() + from, out.data() + from, count, carries[chunk], reduce );
+   }, dynamic_partitioner{ 1 } );
+}
+}
+
+/**
+ * \brief `co_await parallel_transform_reduce( range, init, reduce, transform )`: `transform` of every element folded with
+ *        `reduce` (associative, need not be commutative), `init` in front. Every chunk is summed up on the workers of the
+ *        current scheduler, the chunk sums are combined as a tree. `grain` is the chunk size, the result is the same for
+ *        the same grain.
+ */
+template<typename In, size_t Extent, typename T, typename Reduce, typename Transform>
+co::deferred_token<T> parallel_transform_reduce( std::span<In, Extent> range, T init, Reduce reduce, Transform transform, size_t grain = 0 )
+{
+   if(range.empty()) co_return init;
+   detail::chunking chunks = detail::chunking::Make( range.size(), grain );
+   std::span<const std::remove_const_t<In>> input = range;
+   std::vector<T> partials = co_await detail::ReduceChunks<T>( input, chunks, reduce, transform );
+   co_return reduce( std::move( init ), detail::CombineTree( partials, reduce ) );
+}
+
+// `range` folded with `reduce`, see `parallel_transform_reduce`
+template<typename In, size_t Extent, typename T, typename Reduce = std::plus<>>
+co::deferred_token<T> parallel_reduce( std::span<In, Extent> range, T init, Reduce reduce = {}, size_t grain = 0 )
+{
+   return parallel_transform_reduce( range, std::move( init ), std::move( reduce ), detail::identity_transform{}, grain );
+}
+
+/**
+ * \brief `co_await parallel_inclusive_scan( in, out, reduce )`: `out[i]` is `in[0]` through `in[i]` folded with `reduce`.
+ *        `out` can be `in`. The chunk sums first, then a scan of those, then every chunk scanned from what comes before
+ *        it, the first and last step on the workers. The result is the same for the same `grain`.
+ */
+template<typename T, typename Reduce = std::plus<>>
+co::deferred_token<> parallel_inclusive_scan( std::span<const std::type_identity_t<T>> in, std::span<T> out, Reduce reduce = {}, size_t grain = 0 )
+{
+   EXPECTS( out.size() >= in.size() );
+   if(in.empty()) co_return;
+   co_await detail::ScanChunks<true>( in, out, std::optional<T>(), reduce, grain );
+}
+
+// `out[i]` is `init` and `in[0]` through `in[i - 1]` folded with `reduce`, see `parallel_inclusive_scan`
+template<typename T, typename Reduce = std::plus<>>
+co::deferred_token<> parallel_exclusive_scan( std::span<const std::type_identity_t<T>> in, std::span<T> out, std::type_identity_t<T> init, Reduce reduce = {}, size_t grain = 0 )
+{
+   EXPECTS( out.size() >= in.size() );
+   if(in.empty()) co_return;
+   co_await detail::ScanChunks<false>( in, out, std::optional<T>( std::move( init ) ), reduce, grain );
 }
 
 template<typename Deferred>
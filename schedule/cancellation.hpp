@@ -0,0 +1,217 @@
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "scheduler.hpp"
+
+namespace co
+{
+/**
+ * \brief A handle on the flag of a `cancellation_source`, cheap to copy. Attach it to a coroutine through its token
+ *        (`SetCancellation`), and everything that coroutine awaits inherits it: children, `when_all`/`when_any` children,
+ *        generators. A default constructed one is never canceled.
+ */
+class cancellation_token
+{
+public:
+   cancellation_token() = default;
+   explicit cancellation_token( CancellationState* state ): mState( state )
+   {
+      if(mState) mState->AddRef();
+   }
+   cancellation_token( const cancellation_token& other ): cancellation_token( other.mState ) {}
+   cancellation_token( cancellation_token&& other ) noexcept: mState( std::exchange( other.mState, nullptr ) ) {}
+   cancellation_token& operator=( cancellation_token other ) noexcept
+   {
+      std::swap( mState, other.mState );
+      return *this;
+   }
+   ~cancellation_token()
+   {
+      if(mState) mState->Release();
+   }
+
+   bool IsCanceled() const { return mState != nullptr && mState->IsCanceled(); }
+   bool CanBeCanceled() const { return mState != nullptr; }
+   CancellationState* State() const { return mState; }
+
+protected:
+   CancellationState* mState = nullptr;
+};
+
+/**
+ * \brief Cancels everything its tokens are attached to. Canceling does not stop anything on the spot, it's cooperative:
+ *        - a coroutine is abandoned at its next `co_await check_cancel()`: its frame is torn down, and what awaits it
+ *          is told (see `promise_base::Abandon`). A parent canceled along with it is abandoned too, one that is not
+ *          carries on and tests `co_await token.settled()` (or `IsCanceled` on the token). `when_all` and `when_any`
+ *          have no result without it, their awaiting coroutine is abandoned, `when_all` once the others are done,
+ *          `when_any` if none of them finished. At the top, `task::Wait` and `IsCanceled` on the token say so.
+ *        - a coroutine sleeping, or waiting on a socket, is abandoned right away. One waiting on a file op (`file::read_at`
+ *          and the like, not `io_batch` ops) gets the op cut short, and is abandoned once it's back.
+ *        Work that is not a coroutine polls `IsCanceled` on a token.
+ */
+class cancellation_source
+{
+public:
+   cancellation_source(): mState( new CancellationState() ) {}
+   // canceled along with `parent`, on top of its own `Cancel`
+   explicit cancellation_source( const cancellation_token& parent ): cancellation_source()
+   {
+      if(!parent.CanBeCanceled()) return;
+      mParent = parent;
+      mParentLink.invoke = []( void* state ) { static_cast<CancellationState*>( state )->Cancel(); };
+      mParentLink.context = mState;
+      if(!mParent.State()->Register( mParentLink )) mState->Cancel();
+   }
+   ~cancellation_source()
+   {
+      if(mParent.CanBeCanceled()) mParent.State()->Unregister( mParentLink );
+      mState->Release();
+   }
+
+   cancellation_source( const cancellation_source& ) = delete;
+   cancellation_source& operator=( const cancellation_source& ) = delete;
+
+   // false if it was canceled already
+   bool Cancel() { return mState->Cancel(); }
+   bool IsCanceled() const { return mState->IsCanceled(); }
+   cancellation_token Token() const { return cancellation_token( mState ); }
+
+protected:
+   CancellationState* mState;
+   cancellation_token mParent;
+   CancellationState::Callback mParentLink;
+};
+
+namespace detail
+{
+/**
+ * \brief A wait that the cancellation of the waiting coroutine cuts short: registered on its `CancellationState` for as
+ *        long as it lives, in the awaitable. `onCancel( context )` has to take the wait back and, if it got it before it
+ *        went through, `promise_base::ScheduleAbandon` the waiter.
+ *        The wait is armed outside of the state's lock, a cancellation that comes in meanwhile is left to the arming thread.
+ */
+class cancelable_wait
+{
+public:
+   cancelable_wait() = default;
+   cancelable_wait( const cancelable_wait& ) = delete;
+   cancelable_wait& operator=( const cancelable_wait& ) = delete;
+   ~cancelable_wait()
+   {
+      // the wait can go through, and the awaitable go away, before the arming thread is done with this
+      while(mPhase.load( std::memory_order_acquire ) != kSettled) {
+         CpuRelax();
+      }
+      if(mState == nullptr) return;
+      mState->Unregister( mCallback );
+      mState->Release();
+   }
+
+   // Run `arm` (which starts the wait of the suspended `waiter`), then `onCancel` if a cancellation came in meanwhile.
+   // Canceled already: nothing is armed, the waiter is abandoned by whichever worker picks it up
+   template<typename ArmWait>
+   void Arm( promise_base& waiter, void* context, void (*onCancel)( void* ), ArmWait&& arm )
+   {
+      CancellationState* state = waiter.Cancellation();
+      if(state == nullptr) {
+         arm();
+         return;
+      }
+      mOnCancel = onCancel;
+      mContext = context;
+      mCallback.invoke = &Cancel;
+      mCallback.context = this;
+      mPhase.store( kArming, std::memory_order_relaxed );
+      if(!state->Register( mCallback )) {
+         mPhase.store( kSettled, std::memory_order_relaxed );
+         promise_base::ScheduleAbandon( waiter );
+         return;
+      }
+      state->AddRef();
+      mState = state;
+
+      std::forward<ArmWait>( arm )();
+      uint8_t phase = kArming;
+      if(!mPhase.compare_exchange_strong( phase, kSettled, std::memory_order_acq_rel, std::memory_order_acquire )) {
+         // canceled while arming: `Cancel` left it to us
+         EXPECTS( phase == kCancelPending );
+         mOnCancel( mContext );
+         mPhase.store( kSettled, std::memory_order_release );
+      }
+      // the wait can go through and the awaitable be gone from here on. Do not touch `this` afterward
+   }
+
+protected:
+   // kArming -> kSettled, or kArming -> kCancelPending -> kSettled when a cancellation beats the arming
+   static constexpr uint8_t kSettled = 0;
+   static constexpr uint8_t kArming = 1;
+   static constexpr uint8_t kCancelPending = 2;
+
+   // under the state's lock, see `CancellationState::Cancel`
+   static void Cancel( void* context )
+   {
+      cancelable_wait& self = *static_cast<cancelable_wait*>( context );
+      uint8_t phase = kArming;
+      if(self.mPhase.compare_exchange_strong( phase, kCancelPending, std::memory_order_acq_rel, std::memory_order_acquire )) return;
+      self.mOnCancel( self.mContext );
+   }
+
+   CancellationState* mState = nullptr;
+   CancellationState::Callback mCallback;
+   void (*mOnCancel)( void* ) = nullptr;
+   void* mContext = nullptr;
+   std::atomic<uint8_t> mPhase = kSettled;
+};
+}
+
+/**
+ * \brief `co_await check_cancel()`: carries on, unless the coroutine's cancellation was requested, then it's abandoned
+ *        right here (see `cancellation_source`). Costs a load when it's not.
+ *        Only put it where nothing this coroutine started is still running against its frame.
+ */
+struct check_cancel_awaitable
+{
+   bool await_ready() const noexcept { return false; }
+
+   // not a transfer back into itself, that would nest a frame on every check in builds without tail calls
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      if(!promise.IsCancellationRequested()) return false;
+      promise.BindCoroutine( awaitingCoroutine );
+      // the frame can be gone from here on, whatever it continues into runs right away
+      promise_base::Abandon( promise ).resume();
+      return true;
+   }
+
+   void await_resume() const noexcept {}
+};
+
+inline check_cancel_awaitable check_cancel() { return {}; }
+
+// `co_await current_cancellation()`: the token the coroutine is attached to, to hand to work that polls it
+struct current_cancellation_awaitable
+{
+   cancellation_token token;
+
+   bool await_ready() const noexcept { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      token = cancellation_token( awaitingCoroutine.promise().Cancellation() );
+      return false;
+   }
+
+   cancellation_token await_resume() noexcept { return std::move( token ); }
+};
+
+inline current_cancellation_awaitable current_cancellation() { return {}; }
+}
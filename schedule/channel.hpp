@@ -0,0 +1,312 @@
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+#include "RingQueue.hpp"
+#include "scheduler.hpp"
+#include "../utils.hpp"
+
+namespace co
+{
+/**
+ * \brief Bounded multi producer multi consumer channel between coroutines. `co_await send( value )` suspends while it's
+ *        full, `co_await receive()` while it's empty, and whoever makes room (or brings something) reschedules them.
+ *        Nothing spins, nothing blocks a worker.
+ *        The buffer is a `ClosableRingQueue`: as long as nobody is waiting, sending and receiving do not take the lock.
+ *        The capacity is rounded up to a power of two, `T` has to be default constructible and movable.
+ *        After `Close`, sends fail and receives drain what is left, then fail.
+ */
+template<typename T>
+class channel
+{
+protected:
+   // a suspended `send`/`receive`, it lives in the awaiting coroutine's frame
+   struct waiter
+   {
+      promise_base* promise = nullptr;
+      waiter* next = nullptr;
+   };
+
+   struct sender: waiter
+   {
+      T* value = nullptr;
+      bool sent = false;
+   };
+
+   struct receiver: waiter
+   {
+      std::span<T> out;
+      size_t received = 0;
+   };
+
+   template<typename Node>
+   struct waiter_list
+   {
+      Node* head = nullptr;
+      Node* tail = nullptr;
+
+      void Push( Node& node )
+      {
+         node.next = nullptr;
+         if(tail) {
+            tail->next = &node;
+         } else {
+            head = &node;
+         }
+         tail = &node;
+      }
+
+      Node* Pop()
+      {
+         Node* node = head;
+         head = static_cast<Node*>( node->next );
+         if(head == nullptr) tail = nullptr;
+         return node;
+      }
+   };
+
+public:
+   explicit channel( size_t capacity ): mBuffer( capacity ) {}
+   ~channel()
+   {
+      EXPECTS( mSenders.head == nullptr && mReceivers.head == nullptr );
+   }
+
+   channel( const channel& ) = delete;
+   channel& operator=( const channel& ) = delete;
+
+   struct send_awaitable: sender
+   {
+      channel& ch;
+      T item;
+
+      send_awaitable( channel& ch, T&& item ): ch( ch ), item( std::move( item ) ) {}
+
+      bool await_ready()
+      {
+         if(ch.TrySend( item )) {
+            this->sent = true;
+            return true;
+         }
+         return ch.IsClosed();
+      }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         this->value = &item;
+         return ch.Suspend( awaitingCoroutine, *this, ch.mSenders );
+      }
+
+      // false if the channel was closed, `item` was not sent then
+      bool await_resume() const { return this->sent; }
+   };
+
+   struct receive_awaitable: receiver
+   {
+      channel& ch;
+      T item;
+
+      explicit receive_awaitable( channel& ch ): ch( ch )
+      {
+         this->out = std::span<T>( &item, 1 );
+      }
+
+      bool await_ready()
+      {
+         this->received = ch.TryReceive( this->out );
+         return this->received > 0 || ch.IsDrained();
+      }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         return ch.Suspend( awaitingCoroutine, *this, ch.mReceivers );
+      }
+
+      // nothing once the channel is closed and empty
+      std::optional<T> await_resume()
+      {
+         if(this->received == 0) return std::nullopt;
+         return std::optional<T>( std::move( item ) );
+      }
+   };
+
+   struct receive_batch_awaitable: receiver
+   {
+      channel& ch;
+
+      receive_batch_awaitable( channel& ch, std::span<T> out ): ch( ch )
+      {
+         EXPECTS( !out.empty() );
+         this->out = out;
+      }
+
+      bool await_ready()
+      {
+         this->received = ch.TryReceive( this->out );
+         return this->received > 0 || ch.IsDrained();
+      }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         return ch.Suspend( awaitingCoroutine, *this, ch.mReceivers );
+      }
+
+      // how many were written to the front of `out`, 0 once the channel is closed and empty
+      size_t await_resume() const { return this->received; }
+   };
+
+   send_awaitable send( T item ) { return send_awaitable( *this, std::move( item ) ); }
+   receive_awaitable receive() { return receive_awaitable( *this ); }
+   // whatever is there, up to the size of `out`, at least one. Suspends while there is nothing
+   receive_batch_awaitable receive_batch( std::span<T> out ) { return receive_batch_awaitable( *this, out ); }
+
+   // sends that are waiting fail, receives get what is left
+   void Close()
+   {
+      waiter* ready;
+      {
+         std::scoped_lock guard( mLock );
+         mBuffer.Close();
+         ready = Settle();
+      }
+      Resume( ready, nullptr );
+   }
+
+   bool IsClosed() const { return mBuffer.IsClosed(); }
+   // estimation only
+   size_t Count() const { return mBuffer.Count(); }
+   size_t Capacity() const { return mBuffer.Capacity(); }
+
+protected:
+   // the lock-free fast path, the other side is only looked at if somebody on it waits
+   bool TrySend( T& item )
+   {
+      if(!mBuffer.Enqueue( std::move( item ) )) return false;
+      // pairs with the fence in `Suspend`: either the waiter finds this item, or this finds the waiter
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if(mWaitingReceivers.load( std::memory_order_relaxed )) Wake();
+      return true;
+   }
+
+   size_t TryReceive( std::span<T> out )
+   {
+      size_t count = 0;
+      while(count < out.size() && mBuffer.Dequeue( out[count] )) count++;
+      if(count == 0) return 0;
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if(mWaitingSenders.load( std::memory_order_relaxed )) Wake();
+      return count;
+   }
+
+   // closed, and nothing left, not even from a send that got a slot just before the close
+   bool IsDrained() const { return mBuffer.IsClosed() && mBuffer.Count() == 0; }
+
+   void Wake()
+   {
+      waiter* ready;
+      {
+         std::scoped_lock guard( mLock );
+         ready = Settle();
+      }
+      Resume( ready, nullptr );
+   }
+
+   template<typename Promise, typename Node>
+   bool Suspend( std::coroutine_handle<Promise> awaitingCoroutine, std::type_identity_t<Node>& self, waiter_list<Node>& list )
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      self.promise = &promise;
+
+      waiter* ready;
+      {
+         std::scoped_lock guard( mLock );
+         list.Push( self );
+         UpdateWaitingFlags();
+         std::atomic_thread_fence( std::memory_order_seq_cst );
+         // what got in (or out) in the meantime, this one included
+         ready = Settle();
+      }
+      // settled already, it carries on right here. Once on the list, it can be resumed and gone any moment otherwise
+      bool settled = false;
+      for(waiter* node = ready; node != nullptr; node = node->next) {
+         settled = settled || node == &self;
+      }
+      Resume( ready, &self );
+      if(!settled) return true;
+      promise.SetState( eOpState::Suspended, eOpState::Processing );
+      return false;
+   }
+
+   // move what it can between the waiters and the buffer, under the lock. Returns the waiters it's done with, chained
+   waiter* Settle()
+   {
+      waiter* ready = nullptr;
+      auto settle = [&ready]( waiter& node ) {
+         node.next = ready;
+         ready = &node;
+      };
+
+      bool moved = true;
+      while(moved) {
+         moved = false;
+         while(mSenders.head != nullptr && mBuffer.Enqueue( std::move( *mSenders.head->value ) )) {
+            sender& node = *mSenders.Pop();
+            node.sent = true;
+            settle( node );
+            moved = true;
+         }
+         while(mReceivers.head != nullptr) {
+            receiver& node = *mReceivers.head;
+            while(node.received < node.out.size() && mBuffer.Dequeue( node.out[node.received] )) node.received++;
+            if(node.received == 0) break;
+            settle( *mReceivers.Pop() );
+            moved = true;
+         }
+      }
+
+      if(mBuffer.IsClosed()) {
+         while(mSenders.head != nullptr) settle( *mSenders.Pop() );
+         if(mBuffer.Count() == 0) {
+            while(mReceivers.head != nullptr) settle( *mReceivers.Pop() );
+         }
+      }
+      UpdateWaitingFlags();
+      return ready;
+   }
+
+   void UpdateWaitingFlags()
+   {
+      mWaitingSenders.store( mSenders.head != nullptr, std::memory_order_relaxed );
+      mWaitingReceivers.store( mReceivers.head != nullptr, std::memory_order_relaxed );
+   }
+
+   // outside of the lock. `self` carries on by itself
+   static void Resume( waiter* ready, waiter* self )
+   {
+      while(ready != nullptr) {
+         waiter* node = ready;
+         // the node is gone as soon as its coroutine resumes
+         ready = node->next;
+         if(node != self) Scheduler::ScheduleOnOwner( *node->promise );
+      }
+   }
+
+   ClosableRingQueue<T> mBuffer;
+   SpinLock mLock;
+   waiter_list<sender> mSenders;
+   waiter_list<receiver> mReceivers;
+   // whether anybody is on the lists, for the fast path to skip the lock
+   std::atomic<bool> mWaitingSenders = false;
+   std::atomic<bool> mWaitingReceivers = false;
+};
+}
@@ -3,5 +3,23 @@
 
 void co::single_consumer_counter_event::Wait()
 {
-   co::Scheduler::Get().RegisterAsTempWorker( mEvent );
-}
\ No newline at end of file
+   if( IsReady() ) return;
+
+   blocked_thread self;
+   auto& scheduler = co::Scheduler::CurrentOrDefault();
+   self.helping = &scheduler;
+
+   uintptr_t expected = kEmpty;
+   if( !mWaiter.compare_exchange_strong( expected, uintptr_t( &self ) | kThreadTag, std::memory_order_acq_rel, std::memory_order_acquire ) ) {
+      // single consumer: the only way to lose is to the decrement that fired, which is done with us already
+      EXPECTS( expected == kFired );
+      return;
+   }
+
+   scheduler.RegisterAsTempWorker( self.signal );
+
+   // the decrement that fired might still be touching `self`, do not let it go away under it
+   while( !self.signalDone.load( std::memory_order_acquire ) ) {
+      CpuRelax();
+   }
+}
@@ -18,14 +18,24 @@ public:
 
       awaitable( single_consumer_counter_event& e ): e( e ) {}
       bool await_ready() const noexcept { return e.IsReady(); }
+
+      // no thread blocks here: the awaiting coroutine is parked in the event, and the decrement that hits zero schedules it
       template<typename Promise>
       bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
       {
-         if( !e.IsReady() ) {
-            e.Wait();
+         static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+         promise_base& promise = awaitingCoroutine.promise();
+         promise.BindCoroutine( awaitingCoroutine );
+         promise.SetState( eOpState::Processing, eOpState::Suspended );
+
+         uintptr_t expected = kEmpty;
+         if(e.mWaiter.compare_exchange_strong( expected, uintptr_t( &promise ), std::memory_order_acq_rel, std::memory_order_acquire )) {
+            return true;
          }
-         Scheduler::Get().Schedule( awaitingCoroutine );
-         return true;
+         // the counter already hit zero, and the decrement is done with the event: keep going
+         EXPECTS( expected == kFired );
+         promise.SetState( eOpState::Suspended, eOpState::Processing );
+         return false;
       }
       void await_resume() {}
 
@@ -33,14 +43,32 @@ public:
 
    friend struct awaitable;
 
-   single_consumer_counter_event(int targetVal): mCounter( targetVal ) {}
+   // fired right away if `targetVal` is not above zero
+   single_consumer_counter_event(int targetVal): mCounter( targetVal ), mWaiter( targetVal <= 0 ? kFired : kEmpty ) {}
 
-   bool IsReady() const noexcept { return mCounter.load(std::memory_order_acquire) <= 0; }
+   // the counter hit zero, and the decrement that got it there is done with the event: it can go away
+   bool IsReady() const noexcept { return mWaiter.load( std::memory_order_acquire ) == kFired; }
 
    void decrement(int v = 1) noexcept
    {
-      if(mCounter.fetch_sub( v, std::memory_order_acq_rel ) == 1) {
-         mEvent.Trigger();
+      int before = mCounter.fetch_sub( v, std::memory_order_acq_rel );
+      if(before <= 0 || before - v > 0) return;
+
+      // we are the one bringing it to zero. The waiter can carry on and destroy the event right after, this is the
+      // last time it's touched: whatever the waiter needs afterward lives with the waiter
+      uintptr_t waiter = mWaiter.exchange( kFired, std::memory_order_acq_rel );
+      if(waiter == kEmpty) return;
+
+      if(waiter & kThreadTag) {
+         blocked_thread& thread = *reinterpret_cast<blocked_thread*>(waiter & ~kThreadTag);
+         Scheduler* helping = thread.helping;
+         thread.signal.Trigger();
+         // the blocked thread might be parked as a temp worker, in which case it's not sleeping on `signal`
+         helping->WakeTempWorkers();
+         // the blocked thread can return from `Wait`, and its stack frame go away, from here on
+         thread.signalDone.store( true, std::memory_order_release );
+      } else {
+         Scheduler::ScheduleOnOwner( *reinterpret_cast<promise_base*>(waiter) );
       }
    }
 
@@ -48,8 +76,22 @@ public:
 
    awaitable operator co_await() noexcept { return awaitable{ *this }; };
 protected:
+   // kEmpty: nobody waits yet, kFired: counter hit zero, otherwise the promise of the awaiting coroutine, or the
+   // `blocked_thread` of a blocking `Wait` with the tag bit set (both are at least 8 bytes aligned)
+   static constexpr uintptr_t kEmpty = 0;
+   static constexpr uintptr_t kFired = 1;
+   static constexpr uintptr_t kThreadTag = 2;
+
+   struct blocked_thread
+   {
+      SysEvent signal;
+      // the blocked thread keeps running this scheduler's jobs meanwhile
+      Scheduler* helping = nullptr;
+      std::atomic<bool> signalDone = false;
+   };
+
    std::atomic<int> mCounter;
-   SysEvent mEvent;
+   std::atomic<uintptr_t> mWaiter;
 };
 
 }
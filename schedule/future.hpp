@@ -1,58 +1,220 @@
 #pragma once
 #include <atomic>
 #include <coroutine>
+#include <new>
+#include <type_traits>
 #include "scheduler.hpp"
-#include "event.hpp"
 namespace co
 {
+namespace detail
+{
+/**
+ * \brief The whole state of a future is one word: empty, ready, or the one party waiting on it.
+ *        A waiting coroutine is parked here as its promise and rescheduled on `Signal`.
+ *        A blocked thread gets a wait object on its own stack, so nothing is created unless somebody actually blocks.
+ *        Ready without a value once it's canceled: a blocked thread hears about it from `Wait`, a coroutine is abandoned.
+ */
+class future_state
+{
+public:
+   future_state() = default;
+   future_state( const future_state& ) = delete;
+   future_state& operator=( const future_state& ) = delete;
+
+   bool IsReady() const { return mState.load( std::memory_order_acquire ) == kReady; }
+   bool IsCanceled() const { return IsReady() && mCanceled; }
+
+   // there won't be a value, whoever waits carries on without one
+   void Cancel()
+   {
+      EXPECTS( !IsReady() );
+      mCanceled = true;
+      Signal();
+   }
+
+   // A coroutine waiting on it (or about to) is abandoned when it's signaled, instead of resumed: its cancellation
+   // asked for the result too late to take the wait back. No effect once it's ready
+   void AbandonWaiter() { mAbandonWaiter.store( true, std::memory_order_release ); }
+
+   // Block until it's ready, false if it was canceled. `producer` is the scheduler the result comes from, a thread that
+   // does not work for any scheduler helps that one meanwhile
+   bool Wait( Scheduler* producer = nullptr ) const
+   {
+      if(!IsReady()) Block( producer );
+      return !mCanceled;
+   }
+
+protected:
+   static constexpr uintptr_t kEmpty = 0;
+   static constexpr uintptr_t kReady = 1;
+   // tag on a `blocked_thread` pointer, promises and blocked threads are both at least 8 bytes aligned
+   static constexpr uintptr_t kThreadTag = 2;
+
+   struct blocked_thread
+   {
+      SysEvent signal;
+      // the blocked thread keeps running this scheduler's jobs meanwhile
+      Scheduler* helping = nullptr;
+      std::atomic<bool> signalDone = false;
+   };
+
+   // publish the result, the value has to be in place already
+   void Signal()
+   {
+      uintptr_t waiter = mState.exchange( kReady, std::memory_order_acq_rel );
+      EXPECTS( waiter != kReady );
+      if(waiter == kEmpty) return;
+
+      if(waiter & kThreadTag) {
+         blocked_thread& thread = *reinterpret_cast<blocked_thread*>(waiter & ~kThreadTag);
+         Scheduler* helping = thread.helping;
+         thread.signal.Trigger();
+         // the blocked thread is parked as a temp worker, not on `signal`
+         if(helping) helping->WakeTempWorkers();
+         // the blocked thread can return, and its stack frame go away, from here on
+         thread.signalDone.store( true, std::memory_order_release );
+      } else if(mCanceled || mAbandonWaiter.load( std::memory_order_acquire )) {
+         promise_base::ScheduleAbandon( *reinterpret_cast<promise_base*>(waiter) );
+      } else {
+         Scheduler::ScheduleOnOwner( *reinterpret_cast<promise_base*>(waiter) );
+      }
+   }
+
+   void Block( Scheduler* producer ) const
+   {
+      blocked_thread self;
+      // like the rest of the system, a blocked thread keeps running jobs until the result shows up, and only sleeps
+      // (on the futex in `signal`) when there is nothing to run. A worker blocking outright could also dead lock the pool.
+      // A worker keeps its own pool going, any other thread helps where the result comes from
+      Scheduler* current = Scheduler::Current();
+      Scheduler& scheduler = current ? *current : (producer ? *producer : Scheduler::Get());
+      self.helping = &scheduler;
+
+      uintptr_t expected = kEmpty;
+      if(!mState.compare_exchange_strong( expected, uintptr_t( &self ) | kThreadTag, std::memory_order_acq_rel, std::memory_order_acquire )) {
+         // single consumer: the only way to lose is to the result
+         EXPECTS( expected == kReady );
+         return;
+      }
+
+      scheduler.RegisterAsTempWorker( self.signal );
 
-// simple future type that is implemented based on OS wait object
+      while(!self.signalDone.load( std::memory_order_acquire )) {
+         CpuRelax();
+      }
+   }
+
+   template<typename Promise>
+   bool Suspend( std::coroutine_handle<Promise> awaitingCoroutine ) const
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+
+      uintptr_t expected = kEmpty;
+      if(mState.compare_exchange_strong( expected, uintptr_t( &promise ), std::memory_order_acq_rel, std::memory_order_acquire )) {
+         return true;
+      }
+      EXPECTS( expected == kReady );
+      promise.SetState( eOpState::Suspended, eOpState::Processing );
+      return false;
+   }
+
+   mutable std::atomic<uintptr_t> mState = kEmpty;
+   // set before the state goes ready
+   bool mCanceled = false;
+   std::atomic<bool> mAbandonWaiter = false;
+};
+}
+
+/**
+ * \brief Single producer, single consumer result slot. `Set` once, then `Get` (blocking) or `co_await` it.
+ *        The value is constructed in place and never copied, so move-only results are fine.
+ */
 template<typename T>
-class future
+class future: public detail::future_state
 {
 public:
-   future(): mSetEvent( 1 ) { }
-   void Set( T&& v )
+   future() = default;
+   ~future()
+   {
+      if(IsReady() && !mCanceled) Value().~T();
+   }
+
+   template<typename VALUE>
+   void Set( VALUE&& v )
    {
       EXPECTS( !IsReady() );
-      value = v;
-      mSetEvent.decrement();
+      new (mStorage) T( std::forward<VALUE>( v ) );
+      Signal();
    }
 
-   bool IsReady() { return mSetEvent.IsReady(); }
+   // there has to be a value, see `Wait`
+   T& Get( Scheduler* producer = nullptr ) &
+   {
+      bool set = Wait( producer );
+      EXPECTS( set );
+      return Value();
+   }
+
+   const T& Get( Scheduler* producer = nullptr ) const &
+   {
+      bool set = Wait( producer );
+      EXPECTS( set );
+      return Value();
+   }
 
-   const T& Get() const
+   T&& Get( Scheduler* producer = nullptr ) &&
    {
-      mSetEvent.Wait();
-      return value;
+      bool set = Wait( producer );
+      EXPECTS( set );
+      return std::move( Value() );
    }
 
+   struct awaitable
+   {
+      future& f;
+      bool await_ready() const noexcept { return f.IsReady(); }
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept { return f.Suspend( awaitingCoroutine ); }
+      T& await_resume() noexcept { return f.Value(); }
+   };
+
+   awaitable operator co_await() & noexcept { return awaitable{ *this }; }
 
 protected:
-   T value = {};
-   mutable single_consumer_counter_event mSetEvent;
+   T& Value() { return *std::launder( reinterpret_cast<T*>(mStorage) ); }
+   const T& Value() const { return *std::launder( reinterpret_cast<const T*>(mStorage) ); }
+
+   alignas(T) unsigned char mStorage[sizeof(T)];
 };
 
 template<>
-class future<void>
+class future<void>: public detail::future_state
 {
-   public:
-   future(): mSetEvent( 1 ) { }
+public:
    void Set()
    {
       EXPECTS( !IsReady() );
-      mSetEvent.decrement();
+      Signal();
    }
 
-   bool IsReady() { return mSetEvent.IsReady(); }
-
-   void Get() const
+   void Get( Scheduler* producer = nullptr ) const
    {
-      mSetEvent.Wait();
+      bool set = Wait( producer );
+      EXPECTS( set );
    }
 
+   struct awaitable
+   {
+      const future& f;
+      bool await_ready() const noexcept { return f.IsReady(); }
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept { return f.Suspend( awaitingCoroutine ); }
+      void await_resume() noexcept {}
+   };
 
-protected:
-   mutable single_consumer_counter_event mSetEvent;
+   awaitable operator co_await() const noexcept { return awaitable{ *this }; }
 };
 }
@@ -0,0 +1,212 @@
+#pragma once
+#include <coroutine>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "scheduler.hpp"
+
+namespace co
+{
+/**
+ * \brief A coroutine that `co_yield`s a stream of values, and can `co_await` anything in between.
+ *        The producer only runs when the consumer asks for the next value (`co_await next()`, or the iterator), and
+ *        stops at the next `co_yield`: nothing is produced ahead, nothing is buffered.
+ *        The value is not copied either, the consumer reads it right where the producer yielded it, until it asks for
+ *        the next one. The producer runs on the consumer's thread, until it awaits something that resumes it elsewhere.
+ *        One consumer at a time, one frame for the whole stream. The producer inherits the consumer's cancellation, and
+ *        takes the consumer down with it when it's abandoned.
+ */
+template<typename T>
+class async_generator
+{
+public:
+   struct promise_type: promise_base
+   {
+      // what the producer yielded last, in its own frame
+      std::remove_reference_t<T>* mValue = nullptr;
+      // the coroutine waiting for the next value
+      promise_base* mConsumer = nullptr;
+
+      promise_type() noexcept { SetAbandonHandler( &OnAbandon ); }
+
+      // the frame stays, the generator owns it. The consumer gets no value and no end, it's abandoned as well
+      static std::coroutine_handle<> OnAbandon( promise_base& base ) noexcept
+      {
+         promise_type& promise = static_cast<promise_type&>( base );
+         promise.mValue = nullptr;
+         return promise_base::AbandonWith( *promise.mConsumer );
+      }
+
+      async_generator get_return_object() noexcept
+      {
+         auto handle = std::coroutine_handle<promise_type>::from_promise( *this );
+         BindCoroutine( handle );
+         return async_generator( handle );
+      }
+
+      // nothing runs until somebody asks for a value
+      std::suspend_always initial_suspend() noexcept
+      {
+         SetState( eOpState::Created, eOpState::Suspended );
+         return {};
+      }
+
+      struct yield_awaitable
+      {
+         bool await_ready() const noexcept { return false; }
+
+         // hand the value over: the consumer carries on right here if it can run on this thread
+         std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> producer ) noexcept
+         {
+            promise_type& promise = producer.promise();
+            promise.SetState( eOpState::Processing, eOpState::Suspended );
+            return promise_base::ContinueWith( *promise.mConsumer );
+         }
+
+         void await_resume() const noexcept {}
+      };
+
+      // the value lives until the end of the `co_yield` expression, which is after the consumer asked for the next one
+      yield_awaitable yield_value( std::remove_reference_t<T>& value ) noexcept
+      {
+         mValue = std::addressof( value );
+         return {};
+      }
+
+      yield_awaitable yield_value( std::remove_reference_t<T>&& value ) noexcept
+      {
+         mValue = std::addressof( value );
+         return {};
+      }
+
+      struct final_awaitable
+      {
+         bool await_ready() const noexcept { return false; }
+
+         std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> producer ) noexcept
+         {
+            promise_type& promise = producer.promise();
+            promise.mValue = nullptr;
+            promise.SetState( eOpState::Processing, eOpState::Done );
+            return promise_base::ContinueWith( *promise.mConsumer );
+         }
+
+         void await_resume() const noexcept {}
+      };
+
+      // the frame stays, the generator object owns it
+      final_awaitable final_suspend() noexcept { return {}; }
+
+      void return_void() noexcept {}
+   };
+
+   using coro_handle_t = std::coroutine_handle<promise_type>;
+
+   // one step of the producer, up to its next `co_yield` or its end
+   struct advance_awaitable
+   {
+      coro_handle_t producer;
+
+      bool await_ready() const noexcept { return !producer || producer.promise().Ready(); }
+
+      // symmetric transfer into the producer, it runs on this thread from here
+      template<typename Promise>
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+      {
+         static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+         promise_base& consumer = awaitingCoroutine.promise();
+         consumer.BindCoroutine( awaitingCoroutine );
+         consumer.SetState( eOpState::Processing, eOpState::Suspended );
+
+         promise_type& promise = producer.promise();
+         promise.mConsumer = &consumer;
+         consumer.ShareCancellation( promise );
+         // it belongs to the consumer's scheduler, for whatever it awaits in between
+         Scheduler* executor = consumer.Executor();
+         promise.SetExecutor( executor ? *executor : Scheduler::CurrentOrDefault() );
+         bool resumed = promise.SetState( eOpState::Suspended, eOpState::Processing );
+         ENSURES( resumed );
+         return producer;
+      }
+   };
+
+   struct next_awaitable: advance_awaitable
+   {
+      // the value the producer yielded, nullptr once it's done. Good until the next `next()`
+      std::remove_reference_t<T>* await_resume() const noexcept
+      {
+         if(!this->producer || this->producer.promise().Ready()) return nullptr;
+         return this->producer.promise().mValue;
+      }
+   };
+
+   class iterator
+   {
+   public:
+      using iterator_category = std::input_iterator_tag;
+      using difference_type = std::ptrdiff_t;
+      using value_type = std::remove_cvref_t<T>;
+      using reference = std::remove_reference_t<T>&;
+      using pointer = std::remove_reference_t<T>*;
+
+      iterator() = default;
+      explicit iterator( coro_handle_t producer ): mProducer( producer ) {}
+
+      reference operator*() const { return *mProducer.promise().mValue; }
+      pointer operator->() const { return mProducer.promise().mValue; }
+      bool operator==( std::default_sentinel_t ) const { return !mProducer || mProducer.promise().Ready(); }
+
+      struct increment_awaitable: advance_awaitable
+      {
+         iterator& it;
+         iterator& await_resume() const noexcept { return it; }
+      };
+
+      // `co_await ++it`
+      increment_awaitable operator++() { return { { mProducer }, *this }; }
+
+   protected:
+      coro_handle_t mProducer;
+   };
+
+   struct begin_awaitable: advance_awaitable
+   {
+      iterator await_resume() const noexcept { return iterator( this->producer ); }
+   };
+
+   async_generator() = default;
+   explicit async_generator( coro_handle_t handle ): mHandle( handle ) {}
+   async_generator( async_generator&& other ) noexcept: mHandle( std::exchange( other.mHandle, {} ) ) {}
+   async_generator& operator=( async_generator&& other ) noexcept
+   {
+      if(this != &other) {
+         Reset();
+         mHandle = std::exchange( other.mHandle, {} );
+      }
+      return *this;
+   }
+   ~async_generator() { Reset(); }
+
+   async_generator( const async_generator& ) = delete;
+   async_generator& operator=( const async_generator& ) = delete;
+
+   // `while(auto* value = co_await gen.next())`
+   next_awaitable next() { return { { mHandle } }; }
+
+   // `for(auto it = co_await gen.begin(); it != gen.end(); co_await ++it)`
+   begin_awaitable begin() { return { { mHandle } }; }
+   std::default_sentinel_t end() const { return {}; }
+
+protected:
+   // only while the producer is suspended, at a `co_yield`, at its end, or before it started. Stopping early is fine
+   void Reset()
+   {
+      if(!mHandle) return;
+      mHandle.destroy();
+      mHandle = {};
+   }
+
+   coro_handle_t mHandle;
+};
+}
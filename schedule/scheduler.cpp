@@ -1,13 +1,26 @@
 #include "scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cwchar>
 using namespace co;
 
 static thread_local Worker* gWorkerContext = nullptr;
+// the scheduler this thread works for, set on workers and on threads helping through `RegisterAsTempWorker`
 static thread_local Scheduler* gScheduler = nullptr;
 static thread_local bool gIsWorker = false;
-static Scheduler* theScheduler = nullptr;
+// set while the thread is in `PumpMainThread`
+static thread_local const Scheduler* gPumpingScheduler = nullptr;
+
+static uint64_t NowNs()
+{
+   return uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
 void Scheduler::Shutdown()
 {
    mIsRunning.store( false, std::memory_order_relaxed );
+   WakeWorkers( mWorkerCount );
+   WakeTempWorkers();
 }
 
 bool Scheduler::IsRunning() const
@@ -17,15 +30,19 @@ bool Scheduler::IsRunning() const
 
 Scheduler& Scheduler::Get()
 {
-   if(theScheduler == nullptr) {
-      theScheduler = new Scheduler(QuerySystemCoreCount());
-   }
-
+   // intentionally leaked, jobs can still be around during static destruction
+   static Scheduler* theScheduler = new Scheduler( SchedulerConfig{} );
    return *theScheduler;
 }
 
+Scheduler* Scheduler::Current()
+{
+   return gScheduler;
+}
+
 Scheduler::~Scheduler()
 {
+   Shutdown();
    for(auto& workerThread: mWorkerThreads) {
       workerThread.join();
    }
@@ -44,22 +61,48 @@ uint Scheduler::GetMainThreadIndex() const
 
 bool Scheduler::IsCurrentThreadWorker() const
 {
-   return gIsWorker;
+   return gIsWorker && gScheduler == this;
 }
 
-Scheduler::Scheduler( uint workerCount )
-   : mWorkerCount( workerCount )
+Scheduler::Scheduler( const SchedulerConfig& config )
+   : mWorkerCount( config.workerCount > 0 ? config.workerCount : QuerySystemCoreCount() )
+   , mName( config.name )
+   , mTimers( NowNs() )
 {
+   uint workerCount = mWorkerCount;
    ASSERT_DIE( workerCount > 0 );
 
-   gWorkerContext = new Worker{  Worker::kMainThread };
+   if(gWorkerContext == nullptr) {
+      gWorkerContext = new Worker();
+      gWorkerContext->threadId = Worker::kMainThread;
+   }
    mWorkerThreads.reserve( workerCount );
    mWorkerContexts = std::make_unique<Worker[]>( workerCount );
    mIsRunning = true;
 
+   mParkedWorkerMaskSize = (workerCount + 63) / 64;
+   mParkedWorkerMask = std::make_unique<std::atomic<uint64_t>[]>( mParkedWorkerMaskSize );
+   for(uint i = 0; i < mParkedWorkerMaskSize; ++i) {
+      mParkedWorkerMask[i].store( 0, std::memory_order_relaxed );
+   }
+
+   if(config.injectionRingCapacity > 0) {
+      for(uint lane = 0; lane < kPriorityCount; ++lane) {
+         mInjectedRing[lane] = std::make_unique<RingQueue<Job*>>( config.injectionRingCapacity );
+      }
+   }
+
    mFreeWorkerCount = workerCount;
+   for(uint i = 0; i < workerCount; ++i) {
+      mWorkerContexts[i].threadId = i;
+      // any non-zero seed works for xorshift
+      mWorkerContexts[i].randomState = 0x9E3779B9u * (i + 1);
+   }
    for(uint i = 0; i < workerCount; ++i) {
       mWorkerThreads.emplace_back( [this, i] { WorkerThreadEntry( i ); } );
+      if(!config.affinity.empty()) {
+         SetThreadAffinity( mWorkerThreads.back(), config.affinity[i % config.affinity.size()] );
+      }
    }
 }
 
@@ -67,25 +110,24 @@ Scheduler::Scheduler( uint workerCount )
 void Scheduler::WorkerThreadEntry( uint threadIndex )
 {
    wchar_t name[100];
-   swprintf_s( name, 100, L"co worker thread %u", threadIndex );
-   SetThreadName( mWorkerThreads[threadIndex], name );
+   swprintf( name, 100, L"%ls %u", mName.c_str(), threadIndex );
+   SetCurrentThreadName( name );
 
    auto& context = mWorkerContexts[threadIndex];
-   context.threadId = threadIndex;
    gWorkerContext = &context;
    gScheduler = this;
    gIsWorker = true;
+   uint idleRound = 0;
    while(true) {
       Job* op = FetchNextJob();
       if(op == nullptr) {
-         std::this_thread::yield();
+         Idle( idleRound, &context, nullptr );
       } else {
+         idleRound = 0;
          mFreeWorkerCount--;
 
-         op->Resume();
-
-         // whatever the state the op is, release the op, the ownership of the coroutine is either finished, or transfered to somewhere else.
-         ReleaseOp( op );
+         // whatever the state the coroutine ends up in, it's no longer ours: either finished, or handed to whoever resumes it next.
+         ResumeJob( *op );
 
          mFreeWorkerCount++;
       }
@@ -101,22 +143,25 @@ void Scheduler::WorkerThreadEntry( const SysEvent& exitSignal )
    // so instead, it will try to run something else at the same time.
    // In that sense, we need to first register itself as a free worker
    mFreeWorkerCount++;
+   // a worker thread can end up here from inside of a job, keep its identity when it leaves
+   bool wasWorker = gIsWorker;
+   Scheduler* previousScheduler = gScheduler;
    gIsWorker = true;
+   gScheduler = this;
 
+   uint idleRound = 0;
    while( true ) {
       Job* op = FetchNextJob();
       if( op == nullptr ) {
-         std::this_thread::yield();
+         if( exitSignal.IsTriggered() ) break;
+         Idle( idleRound, nullptr, &exitSignal );
       }
       else {
+         idleRound = 0;
          mFreeWorkerCount--;
 
-         {
-            op->Resume();
-
-            // op could be either suspended or done, if it's done, we will also release the coroutine frame
-            ReleaseOp( op );
-         }
+         // op could be either suspended or done, if it's done, the frame is released by whoever holds the last reference
+         ResumeJob( *op );
 
          mFreeWorkerCount++;
       }
@@ -125,18 +170,650 @@ void Scheduler::WorkerThreadEntry( const SysEvent& exitSignal )
    }
 
    mFreeWorkerCount--;
-   gIsWorker = false;
+   gIsWorker = wasWorker;
+   gScheduler = previousScheduler;
 
 }
 
+void Scheduler::ResumeJob( Job& job )
+{
+   eOpState state = job.State();
+   if( state == eOpState::Canceled ) {
+      // canceled while it was queued or waiting, it is torn down instead
+      promise_base::Abandon( job ).resume();
+      return;
+   }
+   if( state == eOpState::Suspended ) {
+      job.mState.store( eOpState::Processing, std::memory_order_relaxed );
+   }
+
+   // the frame can be destroyed by the time resume returns, do not touch `job` afterward
+   job.mCoroutine.resume();
+}
+
+void Scheduler::Idle( uint& idleRound, Worker* worker, const SysEvent* exitSignal )
+{
+   ServiceTimers();
+   PollIdlePoller();
+
+   if(idleRound < kIdleSpinRounds) {
+      // back off exponentially so spinning threads do not hammer the queues
+      uint relaxCount = 1u << std::min( idleRound, 6u );
+      for(uint i = 0; i < relaxCount; ++i) {
+         CpuRelax();
+      }
+      idleRound++;
+      return;
+   }
+
+   if(idleRound < kIdleSpinRounds + kIdleYieldRounds) {
+      std::this_thread::yield();
+      idleRound++;
+      return;
+   }
+
+   idleRound = 0;
+   // nothing else to do, give back the frames we freed for other threads before going to sleep
+   FrameAllocator::FlushRemoteFrees();
+   if(exitSignal != nullptr) {
+      ParkTempWorker( *exitSignal );
+   } else {
+      ParkWorker( *worker );
+   }
+}
+
+void Scheduler::ParkWorker( Worker& worker )
+{
+   uint index = uint( &worker - mWorkerContexts.get() );
+   std::atomic<uint64_t>& maskWord = mParkedWorkerMask[index / 64];
+   uint64_t bit = uint64_t( 1 ) << (index % 64);
+
+   worker.parkState.store( Worker::Parked, std::memory_order_relaxed );
+   maskWord.fetch_or( bit, std::memory_order_seq_cst );
+   mParkedWorkerCount.fetch_add( 1, std::memory_order_seq_cst );
+
+   // A producer publishes its job and then looks for parked workers; we announced ourselves and now look for jobs.
+   // With both sides fenced, at least one of us sees the other, so no wake up is lost.
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   if(HasPendingJobs() || !IsRunning()) {
+      uint64_t old = maskWord.fetch_and( ~bit, std::memory_order_acq_rel );
+      if(old & bit) {
+         // nobody claimed us yet, cancel the park
+         mParkedWorkerCount.fetch_sub( 1, std::memory_order_relaxed );
+         worker.parkState.store( Worker::Awake, std::memory_order_relaxed );
+         return;
+      }
+      // someone is already waking us, wait for the state flip so the next park starts clean
+   }
+
+   // One parked worker, the keeper, sleeps until the next timer is due, or in the idle poller while it has something in
+   // flight. The others sleep until there is work. What to watch is read after claiming the watch,
+   // `PokeKeeper` publishes it before looking for the keeper
+   IdlePoller* poller = mIdlePoller.load( std::memory_order_acquire );
+   bool keeper = false;
+   if(mTimers.Count() > 0 || (poller != nullptr && poller->HasPending())) {
+      int32_t none = -1;
+      keeper = mIdleKeeper.compare_exchange_strong( none, int32_t( index ), std::memory_order_seq_cst );
+   }
+
+   // take ourselves off the parked mask, false if someone is already waking us
+   auto unparkSelf = [&]
+   {
+      uint64_t old = maskWord.fetch_and( ~bit, std::memory_order_acq_rel );
+      if((old & bit) == 0) return false;
+      mParkedWorkerCount.fetch_sub( 1, std::memory_order_relaxed );
+      worker.parkState.store( Worker::Awake, std::memory_order_relaxed );
+      return true;
+   };
+
+   bool watching = keeper;
+   bool selfWoken = false;
+   while(true) {
+      uint32_t state = worker.parkState.load( std::memory_order_acquire );
+      if(state == Worker::Awake) break;
+      if(state == Worker::Rearm) {
+         // what we watch changed, look again
+         worker.parkState.compare_exchange_strong( state, Worker::Parked, std::memory_order_acq_rel );
+         continue;
+      }
+      if(!watching) {
+         FutexWait( worker.parkState, Worker::Parked );
+         continue;
+      }
+
+      uint64_t wakeAt = mTimers.NextExpiryNs();
+      uint64_t now = wakeAt == TimerWheel::kNever ? 0 : NowNs();
+      if(wakeAt != TimerWheel::kNever && now >= wakeAt) {
+         // a timer is due
+         selfWoken = unparkSelf();
+         watching = false;
+         continue;
+      }
+      std::chrono::nanoseconds timeout( wakeAt == TimerWheel::kNever ? -1 : int64_t( wakeAt - now ) );
+
+      if(poller != nullptr && poller->HasPending()) {
+         // pairs with the check in `WakeWorkers`: either we see the wake up, or it sees us in the poller and interrupts it
+         mKeeperInPoller.store( true, std::memory_order_seq_cst );
+         if(worker.parkState.load( std::memory_order_seq_cst ) == Worker::Parked) {
+            poller->Wait( timeout );
+         }
+         mKeeperInPoller.store( false, std::memory_order_relaxed );
+         // something came in (or not, it's cheap to look), go poll it
+         selfWoken = unparkSelf();
+         watching = false;
+      } else if(timeout.count() < 0) {
+         FutexWait( worker.parkState, Worker::Parked );
+      } else {
+         FutexWaitFor( worker.parkState, Worker::Parked, timeout );
+      }
+   }
+
+   if(keeper) {
+      mIdleKeeper.store( -1, std::memory_order_seq_cst );
+      // woken up for a job while still on watch, hand the watch over to another parked worker
+      bool stillWatched = mTimers.Count() > 0 || (poller != nullptr && poller->HasPending());
+      if(!selfWoken && stillWatched && mParkedWorkerCount.load( std::memory_order_relaxed ) > 0) {
+         WakeWorkers( 1 );
+      }
+   }
+}
+
+void Scheduler::ParkTempWorker( const SysEvent& exitSignal )
+{
+   uint32_t epoch = mTempWorkerWakeEpoch.load( std::memory_order_acquire );
+   mParkedTempWorkerCount.fetch_add( 1, std::memory_order_seq_cst );
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+
+   if(!HasPendingJobs() && !exitSignal.IsTriggered() && IsRunning()) {
+      FutexWait( mTempWorkerWakeEpoch, epoch );
+   }
+
+   mParkedTempWorkerCount.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+bool Scheduler::TryClaimParkedWorker( uint& outWorkerIndex )
+{
+   for(uint i = 0; i < mParkedWorkerMaskSize; ++i) {
+      uint64_t mask = mParkedWorkerMask[i].load( std::memory_order_relaxed );
+      while(mask != 0) {
+         uint64_t bit = mask & (~mask + 1);
+         if(mParkedWorkerMask[i].compare_exchange_weak( mask, mask & ~bit, std::memory_order_acq_rel, std::memory_order_relaxed )) {
+            uint bitIndex = 0;
+            while((uint64_t( 1 ) << bitIndex) != bit) bitIndex++;
+            outWorkerIndex = i * 64 + bitIndex;
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+void Scheduler::WakeWorkers( size_t jobCount )
+{
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+
+   size_t woken = 0;
+   if(mParkedWorkerCount.load( std::memory_order_relaxed ) > 0) {
+      uint index;
+      while(woken < jobCount && TryClaimParkedWorker( index )) {
+         mParkedWorkerCount.fetch_sub( 1, std::memory_order_relaxed );
+         Worker& worker = mWorkerContexts[index];
+         worker.parkState.store( Worker::Awake, std::memory_order_seq_cst );
+         FutexWakeOne( worker.parkState );
+         InterruptKeeperPoll( index );
+         woken++;
+      }
+   }
+
+   // not enough real workers sleeping, let the helping threads pick up the rest
+   if(woken < jobCount) {
+      WakeTempWorkers();
+   }
+}
+
+void Scheduler::WakeTempWorkers()
+{
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   if(mParkedTempWorkerCount.load( std::memory_order_relaxed ) == 0) return;
+
+   mTempWorkerWakeEpoch.fetch_add( 1, std::memory_order_release );
+   FutexWakeAll( mTempWorkerWakeEpoch );
+}
+
+bool Scheduler::HasPendingJobs() const
+{
+   if(mDeadlineJobCount.load( std::memory_order_relaxed ) > 0) return true;
+   for(uint lane = 0; lane < kPriorityCount; ++lane) {
+      if(mInjectedJobCount[lane].load( std::memory_order_relaxed ) > 0) return true;
+      for(uint i = 0; i < mWorkerCount; ++i) {
+         if(!mWorkerContexts[i].jobs[lane].Empty()) return true;
+      }
+   }
+   return false;
+}
+
+Worker* Scheduler::CurrentWorker() const
+{
+   if(gScheduler != this || gWorkerContext == nullptr) return nullptr;
+   bool isOurs = gWorkerContext >= mWorkerContexts.get() && gWorkerContext < mWorkerContexts.get() + mWorkerCount;
+   return isOurs ? gWorkerContext : nullptr;
+}
+
+bool Scheduler::LaterDeadline( const Job* a, const Job* b )
+{
+   return a->mDeadline > b->mDeadline;
+}
+
+static uint32_t NextRandom( uint32_t& state )
+{
+   // xorshift32
+   state ^= state << 13;
+   state ^= state >> 17;
+   state ^= state << 5;
+   return state;
+}
+
 Scheduler::Job* Scheduler::FetchNextJob()
 {
+   if(mDeadlineJobCount.load( std::memory_order_relaxed ) > 0) {
+      if(Job* op = FetchDeadlineJob()) return op;
+   }
+
+   static thread_local uint32_t tFetchTick = 0;
+   Worker* self = CurrentWorker();
+   uint32_t tick = ++(self ? self->fetchTick : tFetchTick);
+
+   // a busy pool never goes idle, so it has to look at the timers and the poller on the way
+   if(tick % kTimerPollPeriod == 0) {
+      ServiceTimers();
+      PollIdlePoller();
+   }
+
+   // every once in a while look at the injected jobs first, so a worker that keeps feeding itself cannot starve them
+   bool injectedFirst = self == nullptr || (tick % 61) == 0;
+
+   // high, normal, then background when nothing else is around. Aging lets the lower lanes cut in line now and then
+   static constexpr uint kLaneOrders[][kPriorityCount] = { { 0, 1, 2 }, { 1, 0, 2 }, { 2, 0, 1 } };
+   uint order = tick % kBackgroundAgingPeriod == 0 ? 2 : (tick % kNormalAgingPeriod == 0 ? 1 : 0);
+
+   // Local lanes first, stealing only when they are empty. Background is a pass of its own after the other lanes, here
+   // and stolen: it only runs when the whole pool has nothing else, except on its aging tick
+   constexpr uint kBackgroundLane = uint( ePriority::Background );
    Job* op = nullptr;
-   mJobs.Dequeue( op );
+   auto fetchLanes = [&]( bool background ) {
+      for(uint lane: kLaneOrders[order]) {
+         if((lane == kBackgroundLane) == background && (op = FetchLocal( self, lane, injectedFirst ))) return;
+      }
+      for(uint lane: kLaneOrders[order]) {
+         if((lane == kBackgroundLane) == background && (op = StealJob( self, lane ))) return;
+      }
+   };
+   bool backgroundFirst = order == 2;
+   fetchLanes( backgroundFirst );
+   if(op == nullptr) fetchLanes( !backgroundFirst );
+
+   if(op != nullptr) RecordDequeue( self, *op );
    return op;
 }
 
+Scheduler::Job* Scheduler::FetchLocal( Worker* self, uint lane, bool injectedFirst )
+{
+   Job* op = nullptr;
+   bool hasOwn = self != nullptr && !self->jobs[lane].Empty();
+   if(!injectedFirst && hasOwn && self->jobs[lane].Pop( op )) return op;
+
+   if(mInjectedJobCount[lane].load( std::memory_order_relaxed ) > 0) {
+      bool found = mInjectedRing[lane] && mInjectedRing[lane]->Dequeue( op );
+      if(!found && mInjectedOverflowCount[lane].load( std::memory_order_relaxed ) > 0 && mInjectedJobs[lane].Dequeue( op )) {
+         mInjectedOverflowCount[lane].fetch_sub( 1, std::memory_order_relaxed );
+         found = true;
+      }
+      if(found) {
+         mInjectedJobCount[lane].fetch_sub( 1, std::memory_order_relaxed );
+         return op;
+      }
+   }
+
+   if(injectedFirst && hasOwn && self->jobs[lane].Pop( op )) return op;
+   return nullptr;
+}
+
+Scheduler::Job* Scheduler::StealJob( Worker* thief, uint lane )
+{
+   static thread_local uint32_t tRandomState = 0x2545F491u ^ uint32_t( std::hash<std::thread::id>{}( std::this_thread::get_id() ) | 1 );
+   uint32_t& randomState = thief ? thief->randomState : tRandomState;
+
+   uint64_t steals = 0, failedSteals = 0;
+   Job* op = nullptr;
+
+   // start from a random victim so thieves do not all gang up on worker 0
+   uint start = NextRandom( randomState ) % mWorkerCount;
+   for(uint i = 0; i < mWorkerCount; ++i) {
+      Worker& victim = mWorkerContexts[(start + i) % mWorkerCount];
+      if(&victim == thief) continue;
+      if(victim.jobs[lane].Steal( op )) {
+         steals++;
+         break;
+      }
+      failedSteals++;
+   }
+
+   if(thief != nullptr) {
+      // single writer, no need for an atomic rmw
+      thief->stealCount.store( thief->stealCount.load( std::memory_order_relaxed ) + steals, std::memory_order_relaxed );
+      thief->failedStealCount.store( thief->failedStealCount.load( std::memory_order_relaxed ) + failedSteals, std::memory_order_relaxed );
+   } else {
+      if(steals > 0) mTempWorkerSteals.fetch_add( steals, std::memory_order_relaxed );
+      if(failedSteals > 0) mTempWorkerFailedSteals.fetch_add( failedSteals, std::memory_order_relaxed );
+   }
+
+   return steals > 0 ? op : nullptr;
+}
+
+
+void Scheduler::RecordDequeue( Worker* self, Job& job )
+{
+   uint lane = uint( job.mPriority );
+   uint64_t wait = 0;
+   bool sampled = job.mEnqueueTime != 0;
+   if(sampled) {
+      uint64_t now = NowNs();
+      wait = now > job.mEnqueueTime ? now - job.mEnqueueTime : 0;
+   }
+
+   if(self != nullptr) {
+      // single writer
+      auto bump = []( std::atomic<uint64_t>& counter, uint64_t delta ) {
+         counter.store( counter.load( std::memory_order_relaxed ) + delta, std::memory_order_relaxed );
+      };
+      bump( self->dequeued[lane], 1 );
+      if(!sampled) return;
+      bump( self->waitSamples[lane], 1 );
+      bump( self->waitNs[lane], wait );
+      if(wait > self->maxWaitNs[lane].load( std::memory_order_relaxed )) {
+         self->maxWaitNs[lane].store( wait, std::memory_order_relaxed );
+      }
+   } else {
+      mTempWorkerDequeued[lane].fetch_add( 1, std::memory_order_relaxed );
+      if(!sampled) return;
+      mTempWorkerWaitSamples[lane].fetch_add( 1, std::memory_order_relaxed );
+      mTempWorkerWaitNs[lane].fetch_add( wait, std::memory_order_relaxed );
+      uint64_t max = mTempWorkerMaxWaitNs[lane].load( std::memory_order_relaxed );
+      while(wait > max && !mTempWorkerMaxWaitNs[lane].compare_exchange_weak( max, wait, std::memory_order_relaxed )) {}
+   }
+}
+
+Scheduler::Job* Scheduler::FetchDeadlineJob()
+{
+   Job* op = nullptr;
+   {
+      std::scoped_lock guard( mDeadlineLock );
+      if(mDeadlineJobs.empty()) return nullptr;
+      std::pop_heap( mDeadlineJobs.begin(), mDeadlineJobs.end(), LaterDeadline );
+      op = mDeadlineJobs.back();
+      mDeadlineJobs.pop_back();
+      mDeadlineJobCount.fetch_sub( 1, std::memory_order_relaxed );
+   }
+   mDeadlineDequeued.fetch_add( 1, std::memory_order_relaxed );
+
+   uint64_t now = NowNs();
+   if(now <= op->mDeadline) return op;
+
+   uint64_t lateness = now - op->mDeadline;
+   mDeadlineMissed.fetch_add( 1, std::memory_order_relaxed );
+   uint64_t max = mDeadlineMaxLatenessNs.load( std::memory_order_relaxed );
+   while(lateness > max && !mDeadlineMaxLatenessNs.compare_exchange_weak( max, lateness, std::memory_order_relaxed )) {}
+
+   if(mDeadlineMissPolicy.load( std::memory_order_relaxed ) == eDeadlineMissPolicy::Drop) {
+      // too late to be of any use: it's not resumed, `ResumeJob` abandons it
+      op->Cancel();
+      mDeadlineDropped.fetch_add( 1, std::memory_order_relaxed );
+   }
+   return op;
+}
+
+bool Scheduler::QueueJob( Job* op, Worker* self )
+{
+   if(op->mMainThreadAffine) {
+      // no worker can take it, the main loop picks it up on its next pump
+      mMainThreadJobs.Push( op );
+      return false;
+   }
+
+   if(op->mDeadline != 0) {
+      std::scoped_lock guard( mDeadlineLock );
+      mDeadlineJobs.push_back( op );
+      std::push_heap( mDeadlineJobs.begin(), mDeadlineJobs.end(), LaterDeadline );
+      mDeadlineJobCount.fetch_add( 1, std::memory_order_relaxed );
+      return true;
+   }
+
+   QueueLaneBatch( self, uint( op->mPriority ), std::span<Job* const>( &op, 1 ) );
+   return true;
+}
+
+void Scheduler::QueueLaneBatch( Worker* self, uint lane, std::span<Job* const> jobs )
+{
+   // reading the clock twice per job is measurable on small jobs, only time a sample of them
+   static thread_local uint32_t tEnqueueTick = 0;
+   uint64_t now = 0;
+   for(Job* op: jobs) {
+      op->mEnqueueTime = 0;
+      if((tEnqueueTick++ % kWaitSamplePeriod) == 0) {
+         if(now == 0) now = NowNs();
+         op->mEnqueueTime = now;
+      }
+   }
+
+   if(self != nullptr) {
+      self->jobs[lane].PushBatch( jobs );
+      return;
+   }
+
+   size_t count = jobs.size();
+   bool queued = mInjectedRing[lane]
+              && mInjectedOverflowCount[lane].load( std::memory_order_relaxed ) == 0
+              && mInjectedRing[lane]->Enqueue( jobs );
+   if(!queued) {
+      for(size_t i = 0; i + 1 < count; ++i) {
+         jobs[i]->mNextJob = jobs[i + 1];
+      }
+      mInjectedOverflowCount[lane].fetch_add( count, std::memory_order_relaxed );
+      mInjectedJobs[lane].Enqueue( jobs.front(), jobs.back(), count );
+   }
+   mInjectedJobCount[lane].fetch_add( count, std::memory_order_relaxed );
+}
+
 void Scheduler::EnqueueJob( Job* op )
 {
-   mJobs.Enqueue( op );
+   if(QueueJob( op, CurrentWorker() )) {
+      WakeWorkers( 1 );
+   }
+}
+
+void Scheduler::ScheduleBatch( std::span<promise_base* const> promises )
+{
+   Worker* self = CurrentWorker();
+   Job* lanes[kPriorityCount][kBatchChunkSize];
+   size_t laneSize[kPriorityCount] = {};
+   size_t wakes = 0;
+
+   for(promise_base* promise: promises) {
+      // already scheduled by someone else
+      if(!promise->SetExecutor( *this )) continue;
+
+      if(promise->mMainThreadAffine || promise->mDeadline != 0) {
+         wakes += QueueJob( promise, self ) ? 1 : 0;
+         continue;
+      }
+
+      uint lane = uint( promise->mPriority );
+      lanes[lane][laneSize[lane]++] = promise;
+      wakes++;
+      if(laneSize[lane] == kBatchChunkSize) {
+         QueueLaneBatch( self, lane, std::span<Job* const>( lanes[lane], laneSize[lane] ) );
+         laneSize[lane] = 0;
+      }
+   }
+
+   for(uint lane = 0; lane < kPriorityCount; ++lane) {
+      if(laneSize[lane] > 0) {
+         QueueLaneBatch( self, lane, std::span<Job* const>( lanes[lane], laneSize[lane] ) );
+      }
+   }
+
+   // never more than the parked workers, see `WakeWorkers`
+   if(wakes > 0) WakeWorkers( wakes );
+}
+
+void Scheduler::AddTimer( timer_node& node, deadline_t deadline )
+{
+   auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>( deadline.time_since_epoch() ).count();
+   if(!mTimers.Insert( node, ns > 0 ? uint64_t( ns ) : 0 )) return;
+
+   // it's the earliest now
+   PokeKeeper();
+}
+
+void Scheduler::PokeKeeper()
+{
+   // have the keeper look again, or get a parked worker to take the watch.
+   // Pairs with the keeper claiming the watch and then looking at what to watch in `ParkWorker`
+   std::atomic_thread_fence( std::memory_order_seq_cst );
+   int32_t keeper = mIdleKeeper.load( std::memory_order_relaxed );
+   if(keeper >= 0) {
+      Worker& worker = mWorkerContexts[keeper];
+      uint32_t expected = Worker::Parked;
+      if(worker.parkState.compare_exchange_strong( expected, Worker::Rearm, std::memory_order_seq_cst )) {
+         FutexWakeOne( worker.parkState );
+         InterruptKeeperPoll( uint( keeper ) );
+      }
+   } else if(mParkedWorkerCount.load( std::memory_order_relaxed ) > 0) {
+      WakeWorkers( 1 );
+   }
+}
+
+void Scheduler::InterruptKeeperPoll( uint workerIndex )
+{
+   if(mIdleKeeper.load( std::memory_order_seq_cst ) != int32_t( workerIndex )) return;
+   if(!mKeeperInPoller.load( std::memory_order_seq_cst )) return;
+   if(IdlePoller* poller = mIdlePoller.load( std::memory_order_acquire )) {
+      poller->Interrupt();
+   }
+}
+
+bool Scheduler::AttachIdlePoller( IdlePoller& poller )
+{
+   IdlePoller* expected = nullptr;
+   if(mIdlePoller.compare_exchange_strong( expected, &poller, std::memory_order_acq_rel )) return true;
+   return expected == &poller;
+}
+
+void Scheduler::NotifyIdlePollerPending()
+{
+   // the keeper is in the poller already, it sees whatever comes in
+   if(mKeeperInPoller.load( std::memory_order_seq_cst )) return;
+   PokeKeeper();
+}
+
+void Scheduler::PollIdlePoller()
+{
+   IdlePoller* poller = mIdlePoller.load( std::memory_order_acquire );
+   if(poller != nullptr && poller->HasPending()) poller->Poll();
+}
+
+void Scheduler::ServiceTimers()
+{
+   if(mTimers.Count() == 0) return;
+   uint64_t now = NowNs();
+   if(now < mTimers.NextExpiryNs()) return;
+
+   TimerWheel::Node* expired = nullptr;
+   if(!mTimers.TryAdvance( now, expired )) return;
+
+   // hand them back in batches, the waiters can be gone as soon as they're scheduled so read the chain first
+   promise_base* chunk[kBatchChunkSize];
+   size_t count = 0;
+   while(expired != nullptr) {
+      timer_node& timer = static_cast<timer_node&>( *expired );
+      expired = expired->next;
+      chunk[count++] = timer.waiter;
+      if(count == kBatchChunkSize) {
+         ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+         count = 0;
+      }
+   }
+   if(count > 0) ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+}
+
+Scheduler::StealStats Scheduler::QueryStealStats( uint workerIndex ) const
+{
+   EXPECTS( workerIndex < mWorkerCount );
+   const Worker& worker = mWorkerContexts[workerIndex];
+   return { worker.stealCount.load( std::memory_order_relaxed ), worker.failedStealCount.load( std::memory_order_relaxed ) };
+}
+
+Scheduler::StealStats Scheduler::QueryStealStats() const
+{
+   StealStats total = { mTempWorkerSteals.load( std::memory_order_relaxed ), mTempWorkerFailedSteals.load( std::memory_order_relaxed ) };
+   for(uint i = 0; i < mWorkerCount; ++i) {
+      StealStats stats = QueryStealStats( i );
+      total.steals += stats.steals;
+      total.failedSteals += stats.failedSteals;
+   }
+   return total;
+}
+
+Scheduler::LaneStats Scheduler::QueryLaneStats( ePriority priority ) const
+{
+   uint lane = uint( priority );
+   LaneStats stats;
+   stats.depth = mInjectedJobCount[lane].load( std::memory_order_relaxed );
+   stats.dequeued = mTempWorkerDequeued[lane].load( std::memory_order_relaxed );
+   stats.waitSamples = mTempWorkerWaitSamples[lane].load( std::memory_order_relaxed );
+   stats.totalWaitNs = mTempWorkerWaitNs[lane].load( std::memory_order_relaxed );
+   stats.maxWaitNs = mTempWorkerMaxWaitNs[lane].load( std::memory_order_relaxed );
+   for(uint i = 0; i < mWorkerCount; ++i) {
+      const Worker& worker = mWorkerContexts[i];
+      stats.depth += worker.jobs[lane].Count();
+      stats.dequeued += worker.dequeued[lane].load( std::memory_order_relaxed );
+      stats.waitSamples += worker.waitSamples[lane].load( std::memory_order_relaxed );
+      stats.totalWaitNs += worker.waitNs[lane].load( std::memory_order_relaxed );
+      stats.maxWaitNs = std::max( stats.maxWaitNs, worker.maxWaitNs[lane].load( std::memory_order_relaxed ) );
+   }
+   return stats;
+}
+
+Scheduler::DeadlineStats Scheduler::QueryDeadlineStats() const
+{
+   DeadlineStats stats;
+   stats.depth = mDeadlineJobCount.load( std::memory_order_relaxed );
+   stats.dequeued = mDeadlineDequeued.load( std::memory_order_relaxed );
+   stats.missed = mDeadlineMissed.load( std::memory_order_relaxed );
+   stats.dropped = mDeadlineDropped.load( std::memory_order_relaxed );
+   stats.maxLatenessNs = mDeadlineMaxLatenessNs.load( std::memory_order_relaxed );
+   return stats;
+}
+
+size_t Scheduler::PumpMainThread( std::chrono::nanoseconds budget )
+{
+   const Scheduler* previous = gPumpingScheduler;
+   gPumpingScheduler = this;
+
+   auto deadline = std::chrono::steady_clock::now() + budget;
+   size_t ranCount = 0;
+   Job* op = nullptr;
+   while(mMainThreadJobs.Pop( op )) {
+      ResumeJob( *op );
+      ranCount++;
+      if(std::chrono::steady_clock::now() >= deadline) break;
+   }
+
+   gPumpingScheduler = previous;
+   return ranCount;
+}
+
+bool Scheduler::IsMainThreadOf( const Scheduler& scheduler )
+{
+   return gPumpingScheduler == &scheduler;
 }
@@ -1,19 +1,25 @@
 #pragma once
 #include <atomic>
+#include <chrono>
+#include <string>
 #include <thread>
 #include <vector>
 #include <coroutine>
+#include <span>
 
+#include "CancellationState.hpp"
+#include "FrameAllocator.hpp"
 #include "LockQueue.hpp"
+#include "MpscQueue.hpp"
+#include "RingQueue.hpp"
+#include "TimerWheel.hpp"
+#include "WorkStealingDeque.hpp"
 #include "../utils.hpp"
 using uint = std::uint32_t;
 
 namespace co {
-struct Worker
-{
-   static constexpr uint kMainThread = 0xff;
-   uint threadId;
-};
+class Scheduler;
+struct Worker;
 
 using job_id_t = int64_t;
 
@@ -28,6 +34,36 @@ enum class eOpState: uint
    Canceled,
 };
 
+// which lane of the scheduler a coroutine is queued in, see `Scheduler::FetchNextJob`
+enum class ePriority: uint8_t
+{
+   High,
+   Normal,
+   Background, // only runs when there is nothing else to do (and once in a while so it can't starve)
+};
+constexpr uint kPriorityCount = 3;
+
+using deadline_t = std::chrono::steady_clock::time_point;
+
+// what happens to a deadline job that is only picked up after its deadline
+enum class eDeadlineMissPolicy: uint8_t
+{
+   Run,  // run it anyway, it's only counted
+   Drop, // abandon it, see `promise_base::Abandon`
+};
+
+
+struct promise_base;
+
+/**
+ * \brief What a finishing coroutine continues into when several of them are awaited at once (`when_all`/`when_any`),
+ *        instead of a parent. It lives in the awaiting coroutine's frame, children only point at it.
+ */
+struct join_node
+{
+   // `child` finished. Returns the coroutine to transfer to from its final suspend point (noop if there is none)
+   virtual std::coroutine_handle<> ChildDone( promise_base& child ) noexcept = 0;
+};
 
 /**
  * \brief All coroutine promise types should derive from this
@@ -57,12 +93,13 @@ struct promise_base
 
    struct final_awaitable
    {
-      bool await_ready() { return false; }
+      bool await_ready() noexcept { return false; }
 
+      // symmetric transfer: the parent, if any, resumes right here on this thread instead of going through the queue
       template<typename Promise>
-      void await_suspend( std::coroutine_handle<Promise> handle );
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> handle ) noexcept;
 
-      void await_resume() {}
+      void await_resume() noexcept {}
    };
 
    ~promise_base()
@@ -70,21 +107,50 @@ struct promise_base
       // in case it is resumed in final_suspend as continuation, it's remain suspended
       // if it's never scheduled, it's in created state
       // sAllocated--;
+      if(CancellationState* cancellation = mCancellation.load( std::memory_order_relaxed )) cancellation->Release();
    }
    void unhandled_exception() { ERROR_DIE( "unhandled exception in promise_base" ); }
 
+   // coroutine frames come from the per-thread frame pools instead of the global heap
+   static void* operator new( size_t size ) { return FrameAllocator::Allocate( size ); }
+   static void operator delete( void* ptr ) { FrameAllocator::Free( ptr ); }
+
    /////////////////////////////////////////////////////
    /////// scheduler related api start from here ///////
    /////////////////////////////////////////////////////
 
-   bool Ready() const { return mState.load( std::memory_order_relaxed ) == eOpState::Done; }
+   // once this is true, the coroutine is suspended at its final point and the result can be read
+   bool Ready() const { return mState.load( std::memory_order_acquire ) == eOpState::Done; }
 
+   // only for a coroutine that is queued or suspended: it's abandoned instead of resumed, see `Abandon`
    bool Cancel()
    {
       mState.store( eOpState::Canceled );
       return true;
    }
 
+   // The cancellation the coroutine is attached to (see `cancellation.hpp`), what it awaits inherits it.
+   // Set once, false if it has one already
+   bool SetCancellation( CancellationState& cancellation )
+   {
+      cancellation.AddRef();
+      CancellationState* none = nullptr;
+      if(mCancellation.compare_exchange_strong( none, &cancellation, std::memory_order_acq_rel )) return true;
+      cancellation.Release();
+      return false;
+   }
+   CancellationState* Cancellation() const { return mCancellation.load( std::memory_order_acquire ); }
+   bool IsCancellationRequested() const
+   {
+      CancellationState* cancellation = Cancellation();
+      return cancellation != nullptr && cancellation->IsCanceled();
+   }
+   // `child` inherits ours, unless it has its own
+   void ShareCancellation( promise_base& child ) const
+   {
+      if(CancellationState* cancellation = Cancellation()) child.SetCancellation( *cancellation );
+   }
+
    bool SetExecutor( Scheduler& scheduler )
    {
       if(mOwner == nullptr) {
@@ -94,14 +160,48 @@ struct promise_base
       return mOwner == &scheduler;
    }
 
+   // the lane the coroutine is queued in every time it's scheduled, including when it's resumed after a suspension
+   void SetPriority( ePriority priority ) { mPriority = priority; }
+   ePriority Priority() const { return mPriority; }
+
+   // a coroutine with a deadline is queued in the deadline lane every time it's scheduled, ahead of all the others
+   void SetDeadline( deadline_t deadline )
+   {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>( deadline.time_since_epoch() ).count();
+      mDeadline = ns > 0 ? uint64_t( ns ) : 1;
+   }
+   void ClearDeadline() { mDeadline = 0; }
+   bool HasDeadline() const { return mDeadline != 0; }
+
+   // move the coroutine to another scheduler, it's queued there from its next scheduling on. See `schedule_on`
+   void ChangeExecutor( Scheduler& scheduler ) { mOwner = &scheduler; }
+
+   // a main thread affine coroutine is only ever resumed by `Scheduler::PumpMainThread`, see `resume_on_main`
+   void SetMainThreadAffine( bool affine ) { mMainThreadAffine = affine; }
+   bool IsMainThreadAffine() const { return mMainThreadAffine; }
+
    bool IsScheduled() const { return mOwner != nullptr;  }
-   void MarkWaited() { mAwaiter.fetch_add(1, std::memory_order_release); }
-   void UnMarkWaited() { mAwaiter.fetch_sub(1, std::memory_order_release); }
+   Scheduler* Executor() const { return mOwner; }
+
+   // `mAwaiter` is a reference count: one for the coroutine itself until it reaches final_suspend,
+   // plus one for every token/awaitable/waiter holding on to it. Whoever drops the last one destroys the frame.
+   void MarkWaited() { mAwaiter.fetch_add(1, std::memory_order_relaxed); }
+   void Release()
+   {
+      if(mAwaiter.fetch_sub( 1, std::memory_order_acq_rel ) == 1) {
+         mCoroutine.destroy();
+      }
+   }
    bool AnyWaited() const { return mAwaiter.load(std::memory_order_acquire) > 0;  }
    int  WaiterCount() const { return mAwaiter.load( std::memory_order_acquire ); }
 
+   // the type erased handle of the coroutine owning this promise, this is what the scheduler resumes
+   void BindCoroutine( std::coroutine_handle<> coroutine ) { mCoroutine = coroutine; }
+   std::coroutine_handle<> Coroutine() const { return mCoroutine; }
+
+   // `takesResult`: the parent wants our result, see `TakesDown`
    template<typename Promise>
-   bool SetContinuation(const std::coroutine_handle<Promise>& parent)
+   bool SetContinuation(const std::coroutine_handle<Promise>& parent, bool takesResult = false)
    {
       promise_base& parentPromise = parent.promise();
 
@@ -109,10 +209,10 @@ struct promise_base
       bool updated = parentPromise.SetState( expectedState, eOpState::Suspended );
       ENSURES( updated || expectedState == eOpState::Suspended);
 
-      mParent = parent;
-      mScheduleParent = &ScheduleParentTyped<Promise>;
+      parentPromise.BindCoroutine( parent );
+      mContinuation = uintptr_t( &parentPromise ) | (takesResult ? kTakesResultTag : 0);
       // Expect the status is `open`. This means it is safe to resume the parent coroutine as a continuation.
-      // If it's not, that means it has already gone through `ScheduleParent`, which is triggered in final_suspend, so if we set parent here, it won't be resumed properly.
+      // If it's not, that means it has already gone through `TakeContinuation`, which is triggered in final_suspend, so if we set parent here, it won't be resumed properly.
       ParentScheduleStatus oldStatus = ParentScheduleStatus::Open;
       bool expected = mHasParent.compare_exchange_strong(oldStatus, ParentScheduleStatus::Assigned);
       ENSURES(expected || (!expected && oldStatus == ParentScheduleStatus::Closed));
@@ -129,122 +229,149 @@ struct promise_base
       return mState.compare_exchange_strong( expectState, newState, std::memory_order_release);
    }
 
+   // continue into `join` when done instead of a parent. False if it's done already
+   bool SetJoin( join_node& join )
+   {
+      mContinuation = uintptr_t( &join ) | kJoinTag;
+      ParentScheduleStatus oldStatus = ParentScheduleStatus::Open;
+      bool expected = mHasParent.compare_exchange_strong( oldStatus, ParentScheduleStatus::Assigned, std::memory_order_acq_rel );
+      ENSURES( expected || oldStatus == ParentScheduleStatus::Closed );
+      return expected;
+   }
+
+   // take the join back before it goes away. False if it's too late: the coroutine finished, and is (or was) in `ChildDone`
+   bool DetachJoin()
+   {
+      ParentScheduleStatus oldStatus = ParentScheduleStatus::Assigned;
+      return mHasParent.compare_exchange_strong( oldStatus, ParentScheduleStatus::Open, std::memory_order_acq_rel );
+   }
+
    eOpState State() const { return mState.load( std::memory_order_acquire ); }
-   void ScheduleParent()
+   // close the continuation slot, returns what is waiting on us: 0, the parent promise (tagged with `kTakesResultTag` if
+   // it wants the result), or a join node tagged with `kJoinTag`
+   uintptr_t TakeContinuation()
    {
       auto status = mHasParent.exchange(ParentScheduleStatus::Closed, std::memory_order_acq_rel);
       ENSURES(status == ParentScheduleStatus::Assigned || status == ParentScheduleStatus::Open);
-      if(status == ParentScheduleStatus::Assigned) {
-         mScheduleParent( *this );
-      }
+      return status == ParentScheduleStatus::Assigned ? mContinuation : 0;
+   }
+
+   // resume `waiter` from a final suspend point: right here if this thread may run it, through its scheduler otherwise
+   static std::coroutine_handle<> ContinueWith( promise_base& waiter );
+
+   // The end of a coroutine, after its state is set: continue into whatever waits on it, and drop the reference it holds
+   // on itself. Returns the coroutine to transfer to
+   static std::coroutine_handle<> Finish( promise_base& promise ) noexcept;
+
+   // End a suspended (or not yet started) coroutine without running the rest of it: it ends up `Canceled`, its frame goes
+   // as if it returned, and whoever waits on it is told (see `TakesDown`). Returns the coroutine to transfer to
+   static std::coroutine_handle<> Abandon( promise_base& promise ) noexcept;
+   // Whether `parent` goes down with `child`, which just ended: a canceled child takes along a parent that is being
+   // canceled itself, or that `takesResult` it does not have. Any other parent carries on, and finds out from the token
+   // (see `base_token::settled`)
+   static bool TakesDown( const promise_base& child, const promise_base& parent, bool takesResult )
+   {
+      if(parent.State() == eOpState::Canceled) return true;
+      return child.State() == eOpState::Canceled && (takesResult || parent.IsCancellationRequested());
    }
+   // `ContinueWith`, for a waiter to abandon instead
+   static std::coroutine_handle<> AbandonWith( promise_base& waiter ) noexcept;
+   // a wait of `waiter` was cut short by its cancellation: it's abandoned by whichever worker picks it up
+   static void ScheduleAbandon( promise_base& waiter );
+
+   // for promise types that do not end the way `Finish` does, `Abandon` hands over to this after setting the state
+   using abandon_handler_t = std::coroutine_handle<> (*)( promise_base& promise ) noexcept;
+   void SetAbandonHandler( abandon_handler_t handler ) { mAbandonHandler = handler; }
 
 protected:
+   // whether this is a thread the coroutine is allowed to run on
+   bool MayResumeHere() const;
+
    Scheduler*            mOwner = nullptr;
-   std::atomic<int> mAwaiter = 0;
+   std::atomic<int> mAwaiter = 1;
    std::atomic<eOpState> mState;
    job_id_t mJobId{};
-   std::coroutine_handle<> mParent;
+   // the parent promise, or a `join_node` with the tag bit set (both are at least pointer aligned)
+   static constexpr uintptr_t kJoinTag = 1;
+   static constexpr uintptr_t kTakesResultTag = 2;
+   uintptr_t mContinuation = 0;
    std::atomic<ParentScheduleStatus> mHasParent;
-   void(*mScheduleParent)(promise_base&);
    inline static std::atomic<job_id_t> sJobID;
-
-   template<typename Promise>
-   static void ScheduleParentTyped( promise_base& self );
+   std::atomic<CancellationState*> mCancellation = nullptr;
+   abandon_handler_t mAbandonHandler = nullptr;
+
+   // intrusive job node: a scheduled coroutine is queued by its promise, so scheduling does not allocate
+   std::coroutine_handle<> mCoroutine;
+   promise_base* mNextJob = nullptr;
+   uint64_t mEnqueueTime = 0; // for the lane wait time stats, 0 when this round is not sampled
+   uint64_t mDeadline = 0;    // steady clock ns, 0 when there is none
+   ePriority mPriority = ePriority::Normal;
+   bool mMainThreadAffine = false;
 };
 
 
 
 /**
- * \brief Scheduler, manage workers, enqueue/dispatch jobs
+ * \brief Something idle workers poll for completions (io), see `Scheduler::AttachIdlePoller`.
+ *        While it has something in flight, the parked worker watching the timers blocks in `Wait` instead of sleeping.
  */
-class Scheduler
+class IdlePoller
 {
 public:
+   virtual ~IdlePoller() = default;
+   // reschedule whoever is done waiting, never blocks. Called from any worker, possibly several at once
+   virtual void Poll() = 0;
+   // anything in flight, worth a parked worker waiting on
+   virtual bool HasPending() const = 0;
+   // block until there might be something to poll (or handle it right away), `Interrupt` is called, or `timeout` passed (negative: none)
+   virtual void Wait( std::chrono::nanoseconds timeout ) = 0;
+   // get the thread in `Wait` out of it
+   virtual void Interrupt() = 0;
+};
 
+// a coroutine waiting on the scheduler's timer wheel, see `Scheduler::AddTimer`
+struct timer_node: TimerWheel::Node
+{
+   promise_base* waiter = nullptr;
+};
 
-   /**
-    * \brief Base type to describe a job
-    */
-   struct Job
-   {
-      virtual promise_base* Promise() = 0;
-
-      virtual ~Job()
-      {
-         if(mShouldRelease) {
-            mCoroutine.destroy();
-         }
-
-      }
-      Job(const std::coroutine_handle<>& handle): mCoroutine( handle ) {}
-      // bool RescheduleOp(Scheduler& newScheduler)
-      // {
-      //    promise_base* promise = Promise();
-      //    EXPECTS( promise->mState == eOpState::Suspended );
-      //
-      //    eOpState expectedState = eOpState::Suspended;
-      //    bool updated = promise->mState.compare_exchange_strong( expectedState, eOpState::Scheduled );
-      //
-      //    // TODO: this might be a time bomb
-      //    // this can be potentially troublesome because after setting the state, it's possible we fail to enqueue the job.
-      //    // but let's assume it will successful for now
-      //    newScheduler.EnqueueJob( this );
-      // }
-
-      bool ScheduleOp(Scheduler& newScheduler)
-      {
-         // TODO: this might be a time bomb
-         // this can be potentially troublesome because after setting the state, it's possible we fail to enqueue the job.
-         // but let's assume it will successful for now
-         newScheduler.EnqueueJob( this );
-         return true;
-      }
-
-      void Resume()
-      {
-         promise_base& promise = *Promise();
-
-         if( promise.mState == eOpState::Canceled ) return;
-         mCoroutine.resume();
-      }
+struct SchedulerConfig
+{
+   uint workerCount = 0;           // 0: one per core available to the process
+   std::wstring name = L"co worker"; // workers are named "<name> <index>"
+   std::vector<uint> affinity;     // cpus to pin the workers to, worker i goes to affinity[i % size]. Empty: no pinning
+   // slots of the lock-free ring in front of each lane's injection queue, what does not fit goes to a locked list.
+   // 0: locked list only
+   uint injectionRingCapacity = 256;
+};
 
-      bool Done() { return mCoroutine.done(); }
+/**
+ * \brief Scheduler, manage workers, enqueue/dispatch jobs
+ *        There can be several of them, e.g. to keep cpu heavy work away from latency sensitive work.
+ *        A coroutine sticks to the scheduler in `promise_base::mOwner`, use `schedule_on`/`resume_on` to move it.
+ */
+class Scheduler
+{
+public:
 
-      std::coroutine_handle<> mCoroutine;
-      bool mShouldRelease = false;
-	};
 
-   
    /**
-    * \brief templated job type that can access promise
-    * \tparam P Promise Type
+    * \brief A job is the promise of the scheduled coroutine itself, see the intrusive node in `promise_base`
     */
-   template<typename P>
-   struct JobT: public Job
-   {
-      JobT(const std::coroutine_handle<P>& coro)
-         : Job( coro )
-      {
-         coro.promise().MarkWaited();
-      }
-
-      promise_base* Promise() override
-      {
-         return &std::coroutine_handle<P>::from_address( mCoroutine.address() ).promise();
-      };
-
-      ~JobT()
-      {
-         bool shouldRelease = Promise()->WaiterCount() == 1 && mCoroutine.done();
-         mShouldRelease = shouldRelease;
-         if(!shouldRelease) {
-            Promise()->UnMarkWaited();
-         }
-      }
-   };
+   using Job = promise_base;
 
+   explicit Scheduler( const SchedulerConfig& config );
+   // the default scheduler, created on first use
    static Scheduler& Get();
+   // the scheduler the calling thread works for (as a worker or a temp worker), nullptr on any other thread
+   static Scheduler* Current();
+   // `Current()`, or the default scheduler on threads that do not work for any
+   static Scheduler& CurrentOrDefault()
+   {
+      Scheduler* current = Current();
+      return current ? *current : Get();
+   }
+   // stops and joins the workers, jobs still queued are not run
    ~Scheduler();
 
    void Shutdown();
@@ -258,60 +385,382 @@ public:
 
    size_t EstimateFreeWorkerCount() const { return mFreeWorkerCount.load(std::memory_order_relaxed); }
 
-   template<typename Promise>
-   Job* AllocateOp(const std::coroutine_handle<Promise>& handle)
+   struct StealStats
+   {
+      uint64_t steals = 0;       // jobs taken from another worker's deque
+      uint64_t failedSteals = 0; // steal attempts that came back empty handed (victim empty or lost the race)
+   };
+
+   uint GetWorkerCount() const { return mWorkerCount; }
+   // stats of one worker thread
+   StealStats QueryStealStats( uint workerIndex ) const;
+   // sum over all workers, including threads temporarily helping through `RegisterAsTempWorker`
+   StealStats QueryStealStats() const;
+
+   struct LaneStats
+   {
+      uint64_t depth = 0;       // jobs queued right now (estimation)
+      uint64_t dequeued = 0;    // jobs taken out of the lane so far
+      // time between enqueue and dequeue, measured on one job out of every `kWaitSamplePeriod`
+      uint64_t waitSamples = 0;
+      uint64_t totalWaitNs = 0;
+      uint64_t maxWaitNs = 0;
+
+      double AverageWaitNs() const { return waitSamples == 0 ? 0.0 : double( totalWaitNs ) / double( waitSamples ); }
+   };
+   LaneStats QueryLaneStats( ePriority priority ) const;
+   static constexpr uint kWaitSamplePeriod = 8;
+
+   void Schedule( promise_base& promise )
    {
-      return new JobT<Promise>( handle );
+      bool assigned = promise.SetExecutor( *this );
+      if(assigned) {
+         EnqueueJob( &promise );
+      }
    }
 
-   void ReleaseOp(Job* op)
+   void Schedule( promise_base& promise, ePriority priority )
    {
-      delete op;
+      promise.SetPriority( priority );
+      Schedule( promise );
    }
 
    template<typename Promise>
    void Schedule( const std::coroutine_handle<Promise>& handle )
    {
-      bool assigned = handle.promise().SetExecutor( *this );
-      if(assigned) {
-         Job* op = AllocateOp( handle );
-         op->ScheduleOp( *this );
+      promise_base& promise = handle.promise();
+      promise.BindCoroutine( handle );
+      Schedule( promise );
+   }
+
+   template<typename Promise>
+   void Schedule( const std::coroutine_handle<Promise>& handle, ePriority priority )
+   {
+      handle.promise().SetPriority( priority );
+      Schedule( handle );
+   }
+
+   // earliest deadline first, served before any other lane
+   void Schedule( promise_base& promise, deadline_t deadline )
+   {
+      promise.SetDeadline( deadline );
+      Schedule( promise );
+   }
+
+   template<typename Promise>
+   void Schedule( const std::coroutine_handle<Promise>& handle, deadline_t deadline )
+   {
+      handle.promise().SetDeadline( deadline );
+      Schedule( handle );
+   }
+
+   // Schedule them all with one queue operation per lane (per `kBatchChunkSize` of them) and one round of wake ups.
+   // Each keeps the lane/deadline/main thread affinity set on its promise
+   void ScheduleBatch( std::span<promise_base* const> promises );
+
+   template<typename Promise>
+   void ScheduleBatch( std::span<const std::coroutine_handle<Promise>> handles )
+   {
+      promise_base* chunk[kBatchChunkSize];
+      size_t count = 0;
+      for(const auto& handle: handles) {
+         handle.promise().BindCoroutine( handle );
+         chunk[count++] = &handle.promise();
+         if(count == kBatchChunkSize) {
+            ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+            count = 0;
+         }
       }
+      if(count > 0) ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+   }
+   static constexpr size_t kBatchChunkSize = 64;
+
+   void SetDeadlineMissPolicy( eDeadlineMissPolicy policy ) { mDeadlineMissPolicy.store( policy, std::memory_order_relaxed ); }
+
+   struct DeadlineStats
+   {
+      uint64_t depth = 0;         // deadline jobs queued right now
+      uint64_t dequeued = 0;      // deadline jobs taken out of the lane, in time or not
+      uint64_t missed = 0;        // picked up after their deadline
+      uint64_t dropped = 0;       // missed and canceled, see `eDeadlineMissPolicy::Drop`
+      uint64_t maxLatenessNs = 0; // how late the latest one was
+   };
+   DeadlineStats QueryDeadlineStats() const;
+
+   // put a suspended coroutine back on the scheduler it runs on (the calling thread's, or the default one, if it never ran on any)
+   static void ScheduleOnOwner( promise_base& promise )
+   {
+      Scheduler* executor = promise.Executor();
+      (executor ? *executor : CurrentOrDefault()).Schedule( promise );
    }
 
    void RegisterAsTempWorker( const SysEvent& exitSignal ) { WorkerThreadEntry( exitSignal ); }
 
-protected:
+   // Run main thread affine coroutines until the queue is empty or `budget` is spent, whatever is left waits for the next pump.
+   // At least one is run per call if there is any. Returns how many were run. Only call it from the one main thread
+   size_t PumpMainThread( std::chrono::nanoseconds budget );
+   // whether the calling thread is inside `scheduler.PumpMainThread`
+   static bool IsMainThreadOf( const Scheduler& scheduler );
 
-   explicit Scheduler(uint workerCount);
+   // wake up threads parked in `RegisterAsTempWorker`, so they can re-check their exit signal
+   void WakeTempWorkers();
+
+   // Reschedule `node.waiter` (on its owner) once `deadline` passed. Timers are fired by idle workers, one of the parked
+   // workers sleeps until the next one is due, busy ones look at them every `kTimerPollPeriod` fetches.
+   void AddTimer( timer_node& node, deadline_t deadline );
+   // false if it fired already
+   bool CancelTimer( timer_node& node ) { return mTimers.Cancel( node ); }
+   static constexpr uint kTimerPollPeriod = 64;
+
+   // One poller per scheduler, it has to outlive the scheduler. False if another one is attached already.
+   // It's polled along with the timers
+   bool AttachIdlePoller( IdlePoller& poller );
+   // the attached poller has something in flight now, makes sure somebody is watching it
+   void NotifyIdlePollerPending();
+
+protected:
 
    void WorkerThreadEntry(uint threadIndex);
    void WorkerThreadEntry( const SysEvent& exitSignal );
+   // lower lanes get to go first once every so many fetches, so a busy pool cannot starve them
+   static constexpr uint kNormalAgingPeriod = 8;
+   static constexpr uint kBackgroundAgingPeriod = 256;
    Job* FetchNextJob();
+   Job* FetchDeadlineJob();
+   // heap order of the deadline lane, earliest on top
+   static bool LaterDeadline( const Job* a, const Job* b );
+   // own deque and injected jobs of one lane
+   Job* FetchLocal( Worker* self, uint lane, bool injectedFirst );
+   Job* StealJob( Worker* thief, uint lane );
+   void RecordDequeue( Worker* self, Job& job );
+   // fire due timers, unless another thread is at it
+   void ServiceTimers();
+   void PollIdlePoller();
+   // get the keeper to look at what it watches again, see `ParkWorker`
+   void PokeKeeper();
+   void InterruptKeeperPoll( uint workerIndex );
+   // queue one job without waking anybody, returns whether a worker should be woken for it
+   bool QueueJob( Job* op, Worker* self );
+   // queue jobs of the same lane in one go, without waking anybody
+   void QueueLaneBatch( Worker* self, uint lane, std::span<Job* const> jobs );
+   static void ResumeJob( Job& job );
+
+   // idle strategy: spin for a short while, then yield, then park
+   static constexpr uint kIdleSpinRounds = 32;
+   static constexpr uint kIdleYieldRounds = 8;
+   void Idle( uint& idleRound, Worker* worker, const SysEvent* exitSignal );
+   void ParkWorker( Worker& worker );
+   void ParkTempWorker( const SysEvent& exitSignal );
+   // wake up to `jobCount` parked workers, one per new job
+   void WakeWorkers( size_t jobCount );
+   bool TryClaimParkedWorker( uint& outWorkerIndex );
+   bool HasPendingJobs() const;
+   // the worker context if the calling thread is one of our worker threads, otherwise nullptr
+   Worker* CurrentWorker() const;
 
    ////////// data ///////////
 
    uint mWorkerCount = 0;
+   std::wstring mName;
    std::vector<std::thread> mWorkerThreads;
    std::unique_ptr<Worker[]> mWorkerContexts;
    std::atomic<bool> mIsRunning;
-   LockQueue<Job*> mJobs;
+   // main thread affine jobs, consumed by `PumpMainThread`
+   IntrusiveMpscQueue<Job, &Job::mNextJob> mMainThreadJobs;
+
+   // jobs scheduled from non-worker threads, one queue per lane. Workers' own jobs go to their deques.
+   // A bounded lock-free ring takes them first, the locked list only takes the overflow, and keeps taking it until
+   // it's drained so the order holds
+   std::unique_ptr<RingQueue<Job*>> mInjectedRing[kPriorityCount];
+   IntrusiveLockQueue<Job, &Job::mNextJob> mInjectedJobs[kPriorityCount];
+   std::atomic_size_t mInjectedJobCount[kPriorityCount] = {};
+   std::atomic_size_t mInjectedOverflowCount[kPriorityCount] = {};
    std::atomic_size_t mFreeWorkerCount;
+   std::atomic<uint64_t> mTempWorkerSteals = 0;
+   std::atomic<uint64_t> mTempWorkerFailedSteals = 0;
+   std::atomic<uint64_t> mTempWorkerDequeued[kPriorityCount] = {};
+   std::atomic<uint64_t> mTempWorkerWaitSamples[kPriorityCount] = {};
+   std::atomic<uint64_t> mTempWorkerWaitNs[kPriorityCount] = {};
+   std::atomic<uint64_t> mTempWorkerMaxWaitNs[kPriorityCount] = {};
+
+   // deadline lane, a binary min-heap on `promise_base::mDeadline`. Shared by everyone, deadline jobs are expected to be few
+   // every fetch reads the count, keep it away from the lines written per job
+   alignas(64) std::atomic_size_t mDeadlineJobCount = 0;
+   alignas(64) SpinLock mDeadlineLock;
+   std::vector<Job*> mDeadlineJobs;
+   std::atomic<eDeadlineMissPolicy> mDeadlineMissPolicy = eDeadlineMissPolicy::Run;
+   std::atomic<uint64_t> mDeadlineDequeued = 0;
+   std::atomic<uint64_t> mDeadlineMissed = 0;
+   std::atomic<uint64_t> mDeadlineDropped = 0;
+   std::atomic<uint64_t> mDeadlineMaxLatenessNs = 0;
+
+   // one bit per parked worker, so a producer can pick exactly whom to wake
+   std::unique_ptr<std::atomic<uint64_t>[]> mParkedWorkerMask;
+   uint mParkedWorkerMaskSize = 0;
+   std::atomic<uint> mParkedWorkerCount = 0;
+   // temp workers park on a shared epoch, every bump wakes all of them
+   std::atomic<uint32_t> mTempWorkerWakeEpoch = 0;
+   std::atomic<uint> mParkedTempWorkerCount = 0;
+
+   TimerWheel mTimers;
+   std::atomic<IdlePoller*> mIdlePoller = nullptr;
+   // the parked worker watching the timers and the poller, -1 if none
+   std::atomic<int32_t> mIdleKeeper = -1;
+   std::atomic<bool> mKeeperInPoller = false;
 };
 
-template< typename Promise > void promise_base::ScheduleParentTyped( promise_base& self )
+struct Worker
 {
-   auto parent = std::coroutine_handle<Promise>::from_address( self.mParent.address() );
-   self.mOwner->Schedule( parent );
-}
+   static constexpr uint kMainThread = 0xff;
+   uint threadId;
+   WorkStealingDeque<Scheduler::Job*> jobs[kPriorityCount]; // one per lane
+   uint32_t randomState = 0;
+   uint32_t fetchTick = 0;
+
+   // `Rearm`: still parked, but what the keeper watches changed, see `Scheduler::PokeKeeper`
+   enum eParkState: uint32_t { Awake = 0, Parked = 1, Rearm = 2 };
+   // futex word the worker sleeps on when there is nothing to do
+   std::atomic<uint32_t> parkState = Awake;
+
+   // only written by the owner thread
+   std::atomic<uint64_t> stealCount = 0;
+   std::atomic<uint64_t> failedStealCount = 0;
+   std::atomic<uint64_t> dequeued[kPriorityCount] = {};
+   std::atomic<uint64_t> waitSamples[kPriorityCount] = {};
+   std::atomic<uint64_t> waitNs[kPriorityCount] = {};
+   std::atomic<uint64_t> maxWaitNs[kPriorityCount] = {};
+};
 
-template< typename Promise > void promise_base::final_awaitable::await_suspend(
-   std::coroutine_handle<Promise> handle )
+template< typename Promise > std::coroutine_handle<> promise_base::final_awaitable::await_suspend(
+   std::coroutine_handle<Promise> handle ) noexcept
 {
    // we expect that should be derived from promise_base
    static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
    promise_base& promise = handle.promise();
-   promise.ScheduleParent();
-   promise.SetState( eOpState::Processing, eOpState::Done );
+   // it got here, so it has its result, whatever was asked of it meanwhile
+   promise.mState.store( eOpState::Done, std::memory_order_release );
+   // nothing in the frame (including this awaitable) can be touched afterward
+   return Finish( promise );
+}
+
+inline std::coroutine_handle<> promise_base::Finish( promise_base& promise ) noexcept
+{
+   std::coroutine_handle<> next = std::noop_coroutine();
+   uintptr_t continuation = promise.TakeContinuation();
+   if(continuation & kJoinTag) {
+      next = reinterpret_cast<join_node*>( continuation & ~kJoinTag )->ChildDone( promise );
+   } else if(continuation != 0) {
+      promise_base& parent = *reinterpret_cast<promise_base*>( continuation & ~kTakesResultTag );
+      next = TakesDown( promise, parent, continuation & kTakesResultTag ) ? AbandonWith( parent ) : ContinueWith( parent );
+   }
+
+   // drop the reference the coroutine holds on itself, the frame is gone if nobody else is holding it
+   promise.Release();
+   return next;
+}
+
+inline std::coroutine_handle<> promise_base::Abandon( promise_base& promise ) noexcept
+{
+   promise.mState.store( eOpState::Canceled, std::memory_order_release );
+   if(promise.mAbandonHandler) return promise.mAbandonHandler( promise );
+   return Finish( promise );
 }
+
+inline bool promise_base::MayResumeHere() const
+{
+   return mOwner == nullptr || (mMainThreadAffine ? Scheduler::IsMainThreadOf( *mOwner ) : mOwner == Scheduler::Current());
+}
+
+inline std::coroutine_handle<> promise_base::ContinueWith( promise_base& waiter )
+{
+   if(waiter.MayResumeHere()) {
+      waiter.mState.store( eOpState::Processing, std::memory_order_relaxed );
+      return waiter.mCoroutine;
+   }
+   // it lives on another scheduler (or on the main thread), it has to go back there
+   waiter.Executor()->Schedule( waiter );
+   return std::noop_coroutine();
+}
+
+inline std::coroutine_handle<> promise_base::AbandonWith( promise_base& waiter ) noexcept
+{
+   // its frame is torn down where it would have been resumed
+   if(waiter.MayResumeHere()) return Abandon( waiter );
+   ScheduleAbandon( waiter );
+   return std::noop_coroutine();
+}
+
+inline void promise_base::ScheduleAbandon( promise_base& waiter )
+{
+   waiter.mState.store( eOpState::Canceled, std::memory_order_release );
+   Scheduler::ScheduleOnOwner( waiter );
+}
+
+/**
+ * \brief `co_await schedule_on( pool )`: the coroutine continues on one of `pool`'s workers, and stays with `pool` afterward.
+ *        It always goes through the queue of `pool`, even when it's already there (a yield, in that case).
+ *        `co_await resume_on( pool )` is the same, except it carries on in place when the thread already works for `pool`.
+ */
+struct executor_switch_awaitable
+{
+   Scheduler& target;
+   bool alwaysQueue;
+
+   bool await_ready() const noexcept { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.ChangeExecutor( target );
+      promise.SetMainThreadAffine( false );
+      if(!alwaysQueue && Scheduler::Current() == &target) return false;
+
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      target.Schedule( promise );
+      return true;
+   }
+
+   void await_resume() noexcept {}
+};
+
+inline executor_switch_awaitable schedule_on( Scheduler& scheduler ) { return { scheduler, true }; }
+inline executor_switch_awaitable resume_on( Scheduler& scheduler ) { return { scheduler, false }; }
+
+/**
+ * \brief `co_await resume_on_main()`: the coroutine continues in the next `Scheduler::PumpMainThread` of the main loop.
+ *        It stays on the main thread until it hops away with `schedule_on`/`resume_on`,
+ *        every later resumption (after awaiting something, say) goes through the main thread queue as well.
+ *        Without a scheduler it's the main thread of the coroutine's own executor, or of the default one if it has none.
+ */
+struct main_thread_awaitable
+{
+   Scheduler* scheduler;
+
+   bool await_ready() const noexcept { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      Scheduler* executor = scheduler ? scheduler : promise.Executor();
+      Scheduler& target = executor ? *executor : Scheduler::Get();
+      promise.ChangeExecutor( target );
+      promise.SetMainThreadAffine( true );
+      if(Scheduler::IsMainThreadOf( target )) return false;
+
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      target.Schedule( promise );
+      return true;
+   }
+
+   void await_resume() noexcept {}
+};
+
+inline main_thread_awaitable resume_on_main() { return { nullptr }; }
+inline main_thread_awaitable resume_on_main( Scheduler& scheduler ) { return { &scheduler }; }
 }
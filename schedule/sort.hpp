@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "algorithms.hpp"
+
+namespace co
+{
+namespace detail
+{
+struct sort_config
+{
+   // below this, `std::sort`/`std::merge` on the spot beats another level of jobs
+   size_t sortCutoff;
+   size_t mergeCutoff;
+
+   static constexpr size_t kMinSortCutoff = 2048;
+   static constexpr size_t kMinMergeCutoff = 8192;
+   // leaves per worker, so an unlucky worker does not hold up the others for long
+   static constexpr size_t kLeavesPerWorker = 8;
+
+   static sort_config Make( size_t count )
+   {
+      size_t workerCount = std::max<size_t>( Scheduler::CurrentOrDefault().GetWorkerCount(), 1 );
+      size_t leafSize = count / (workerCount * kLeavesPerWorker);
+      return { std::max( kMinSortCutoff, leafSize ), std::max( kMinMergeCutoff, leafSize ) };
+   }
+};
+
+// `a` and `b` into `out`, halves of the bigger one matched up with the smaller one by a binary search, in parallel
+template<typename T, typename Compare>
+co::deferred_token<> MergeInto( std::span<T> a, std::span<T> b, std::span<T> out, Compare& comp, const sort_config& config )
+{
+   if(a.size() + b.size() <= config.mergeCutoff) {
+      std::merge( std::make_move_iterator( a.begin() ), std::make_move_iterator( a.end() ),
+                  std::make_move_iterator( b.begin() ), std::make_move_iterator( b.end() ), out.begin(), comp );
+      co_return;
+   }
+   if(a.size() < b.size()) std::swap( a, b );
+
+   size_t middle = a.size() / 2;
+   size_t split = size_t( std::lower_bound( b.begin(), b.end(), a[middle], comp ) - b.begin() );
+   co_await when_all( MergeInto( a.first( middle ), b.first( split ), out.first( middle + split ), comp, config ),
+                      MergeInto( a.subspan( middle ), b.subspan( split ), out.subspan( middle + split ), comp, config ) );
+}
+
+// sorts `data`, the result ends up in `scratch` if `intoScratch`, in `data` otherwise. Both get clobbered
+template<typename T, typename Compare>
+co::deferred_token<> MergeSort( std::span<T> data, std::span<T> scratch, bool intoScratch, Compare& comp, const sort_config& config )
+{
+   if(data.size() <= config.sortCutoff) {
+      std::sort( data.begin(), data.end(), comp );
+      if(intoScratch) std::move( data.begin(), data.end(), scratch.begin() );
+      co_return;
+   }
+
+   // the halves go where this level merges from
+   size_t middle = data.size() / 2;
+   co_await when_all( MergeSort( data.first( middle ), scratch.first( middle ), !intoScratch, comp, config ),
+                      MergeSort( data.subspan( middle ), scratch.subspan( middle ), !intoScratch, comp, config ) );
+
+   std::span<T> from = intoScratch ? data : scratch;
+   std::span<T> to = intoScratch ? scratch : data;
+   co_await MergeInto( from.first( middle ), from.subspan( middle ), to, comp, config );
+}
+
+// keys as unsigned integers that sort the same way: the sign bit flipped for signed ones, all of it for negative floats
+template<typename T>
+auto RadixKey( T value )
+{
+   if constexpr( std::is_floating_point_v<T> ) {
+      using bits_t = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+      bits_t bits = std::bit_cast<bits_t>( value );
+      constexpr bits_t kSign = bits_t( 1 ) << (sizeof(T) * 8 - 1);
+      return (bits & kSign) ? bits_t( ~bits ) : bits_t( bits | kSign );
+   } else if constexpr( std::is_signed_v<T> ) {
+      using bits_t = std::make_unsigned_t<T>;
+      constexpr bits_t kSign = bits_t( 1 ) << (sizeof(T) * 8 - 1);
+      return bits_t( bits_t( value ) ^ kSign );
+   } else {
+      return value;
+   }
+}
+
+template<typename T>
+concept radix_sortable = std::is_arithmetic_v<T> && !std::is_same_v<T, bool> && (!std::is_floating_point_v<T> || sizeof(T) == 4 || sizeof(T) == 8);
+}
+
+/**
+ * \brief `co_await parallel_sort( range, comp )`: merge sort, both halves sorted by jobs of their own and merged in
+ *        parallel too, `std::sort` at the leaves. Takes a scratch buffer the size of `range`. Not stable.
+ */
+template<typename T, size_t Extent, typename Compare = std::less<>>
+co::deferred_token<> parallel_sort( std::span<T, Extent> range, Compare comp = {} )
+{
+   if(range.size() < 2) co_return;
+   detail::sort_config config = detail::sort_config::Make( range.size() );
+   std::vector<T> scratch( range.size() );
+   co_await detail::MergeSort( std::span<T>( range ), std::span<T>( scratch ), false, comp, config );
+}
+
+/**
+ * \brief `co_await parallel_radix_sort( keys )`: least significant byte first, ascending, for integer and float keys
+ *        (negative zero before zero, NaNs at the ends by their sign). Every pass counts the digits of each worker's chunk,
+ *        turns the counts into where each chunk writes each digit, then every chunk scatters its keys. Passes whose byte is
+ *        the same for all keys are skipped. Takes a scratch buffer the size of `keys`.
+ */
+template<detail::radix_sortable T, size_t Extent>
+co::deferred_token<> parallel_radix_sort( std::span<T, Extent> keys )
+{
+   if(keys.size() < 2) co_return;
+   using key_t = decltype(detail::RadixKey( T() ));
+   constexpr size_t kRadix = 256;
+   constexpr size_t kPassCount = sizeof(key_t);
+
+   size_t count = keys.size();
+   size_t workerCount = std::max<size_t>( Scheduler::CurrentOrDefault().GetWorkerCount(), 1 );
+   size_t chunkCount = std::min( workerCount, (count + detail::sort_config::kMinSortCutoff - 1) / detail::sort_config::kMinSortCutoff );
+   size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+   chunkCount = (count + chunkSize - 1) / chunkSize;
+
+   std::vector<T> scratch( count );
+   std::span<T> from = keys;
+   std::span<T> to = scratch;
+   // per chunk per digit: the count, then where the chunk writes the digit
+   std::vector<size_t> offsets( chunkCount * kRadix );
+
+   for(size_t pass = 0; pass < kPassCount; ++pass) {
+      size_t shift = pass * 8;
+      std::fill( offsets.begin(), offsets.end(), 0 );
+      co_await parallel_for( size_t( 0 ), chunkCount, [&]( size_t chunk ) {
+         size_t* histogram = offsets.data() + chunk * kRadix;
+         size_t end = std::min( (chunk + 1) * chunkSize, count );
+         for(size_t i = chunk * chunkSize; i < end; ++i) {
+            histogram[(detail::RadixKey( from[i] ) >> shift) & 0xff]++;
+         }
+      }, static_partitioner{} );
+
+      // digit major, chunk minor, so every chunk's keys keep their order within a digit
+      size_t total = 0;
+      bool allSame = false;
+      for(size_t digit = 0; digit < kRadix; ++digit) {
+         size_t digitCount = 0;
+         for(size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            size_t& slot = offsets[chunk * kRadix + digit];
+            size_t chunkDigitCount = slot;
+            slot = total + digitCount;
+            digitCount += chunkDigitCount;
+         }
+         allSame = allSame || digitCount == count;
+         total += digitCount;
+      }
+      if(allSame) continue;
+
+      co_await parallel_for( size_t( 0 ), chunkCount, [&]( size_t chunk ) {
+         size_t* next = offsets.data() + chunk * kRadix;
+         size_t end = std::min( (chunk + 1) * chunkSize, count );
+         for(size_t i = chunk * chunkSize; i < end; ++i) {
+            to[next[(detail::RadixKey( from[i] ) >> shift) & 0xff]++] = from[i];
+         }
+      }, static_partitioner{} );
+      std::swap( from, to );
+   }
+
+   if(from.data() != keys.data()) {
+      co_await parallel_for( size_t( 0 ), chunkCount, [&]( size_t chunk ) {
+         size_t end = std::min( (chunk + 1) * chunkSize, count );
+         std::copy( from.begin() + chunk * chunkSize, from.begin() + end, keys.begin() + chunk * chunkSize );
+      }, static_partitioner{} );
+   }
+}
+}
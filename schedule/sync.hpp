@@ -0,0 +1,574 @@
+#pragma once
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+#include <span>
+
+#include "scheduler.hpp"
+#include "../utils.hpp"
+
+//
+// Synchronization primitives for coroutines. Waiting never blocks a thread: the awaiting coroutine is
+// queued in the primitive, and whoever releases it hands it back to its scheduler.
+// Waiters are granted in FIFO order, a release that can satisfy several of them resumes them in one batch.
+// The awaiting coroutine's promise has to derive from `promise_base`.
+//
+namespace co
+{
+namespace detail
+{
+// a suspended coroutine waiting on a primitive. It lives in the awaitable, so in the frame of the waiting coroutine
+struct async_waiter
+{
+   promise_base* promise = nullptr;
+   async_waiter* next = nullptr;
+
+   template<typename Promise>
+   void Attach( std::coroutine_handle<Promise> coroutine )
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise = &coroutine.promise();
+      promise->BindCoroutine( coroutine );
+      promise->SetState( eOpState::Processing, eOpState::Suspended );
+   }
+
+   // it got what it was waiting for before it had to suspend
+   void Detach() { promise->SetState( eOpState::Suspended, eOpState::Processing ); }
+};
+
+struct waiter_chain
+{
+   async_waiter* head = nullptr;
+   async_waiter* tail = nullptr;
+
+   bool Empty() const { return head == nullptr; }
+
+   void Append( async_waiter& waiter )
+   {
+      waiter.next = nullptr;
+      if(tail) tail->next = &waiter;
+      else head = &waiter;
+      tail = &waiter;
+   }
+
+   async_waiter* Pop()
+   {
+      async_waiter* waiter = head;
+      if(waiter) {
+         head = waiter->next;
+         if(head == nullptr) tail = nullptr;
+      }
+      return waiter;
+   }
+
+   // Reschedule everyone in order, a chunk at a time (see `Scheduler::ScheduleBatch`) per run of waiters on the same
+   // scheduler. `self` is left out, it's still running the `await_suspend` that granted it.
+   // returns whether `self` was in the chain
+   bool ResumeAll( const async_waiter* self = nullptr )
+   {
+      bool foundSelf = false;
+      promise_base* chunk[Scheduler::kBatchChunkSize];
+      size_t count = 0;
+      Scheduler* owner = nullptr;
+      while(async_waiter* waiter = Pop()) {
+         if(waiter == self) {
+            foundSelf = true;
+            continue;
+         }
+         // read before scheduling, the waiter (in its coroutine frame) can be gone as soon as it's resumed
+         promise_base* promise = waiter->promise;
+         Scheduler* executor = promise->Executor();
+         Scheduler& scheduler = executor ? *executor : Scheduler::CurrentOrDefault();
+         if(count == Scheduler::kBatchChunkSize || (count > 0 && &scheduler != owner)) {
+            owner->ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+            count = 0;
+         }
+         owner = &scheduler;
+         chunk[count++] = promise;
+      }
+      if(count > 0) owner->ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+      return foundSelf;
+   }
+};
+
+// FIFO of waiters. Only touched under `lock`, except `Count`, which the lock-free fast paths check to stay fair to the queue
+struct waiter_list
+{
+   SpinLock lock;
+   waiter_chain waiters;
+   std::atomic<size_t> count = 0;
+
+   size_t Count() const { return count.load( std::memory_order_seq_cst ); }
+   async_waiter* Front() const { return waiters.head; }
+
+   void Push( async_waiter& waiter )
+   {
+      waiters.Append( waiter );
+      count.fetch_add( 1, std::memory_order_seq_cst );
+   }
+
+   async_waiter* Pop()
+   {
+      async_waiter* waiter = waiters.Pop();
+      if(waiter) count.fetch_sub( 1, std::memory_order_relaxed );
+      return waiter;
+   }
+
+   waiter_chain TakeAll()
+   {
+      waiter_chain all = waiters;
+      waiters = {};
+      count.store( 0, std::memory_order_relaxed );
+      return all;
+   }
+};
+
+/**
+ * \brief Shared waiting logic of the primitives: `Derived::Grant( waiter_chain& )` is called under the waiter lock
+ *        and moves every waiter that can proceed now from the front of `mWaiters` to the chain.
+ *        A fast path that bypasses the queue has to check `mWaiters.Count()` after changing the state, see `Dispatch`.
+ */
+template<typename Derived>
+class async_waitable
+{
+protected:
+   // queue `waiter` behind the others. Returns false if it got granted right away, the caller carries on without suspending
+   bool Enqueue( async_waiter& waiter )
+   {
+      waiter_chain granted;
+      {
+         std::scoped_lock guard( mWaiters.lock );
+         mWaiters.Push( waiter );
+         static_cast<Derived*>(this)->Grant( granted );
+      }
+      return !granted.ResumeAll( &waiter );
+   }
+
+   // state changed in a way that can let waiters through
+   void Dispatch()
+   {
+      if(mWaiters.Count() == 0) return;
+      waiter_chain granted;
+      {
+         std::scoped_lock guard( mWaiters.lock );
+         static_cast<Derived*>(this)->Grant( granted );
+      }
+      granted.ResumeAll();
+   }
+
+   // the awaitable for the common case: try the fast path, otherwise queue up
+   template<typename Primitive>
+   struct waiter_awaitable: async_waiter
+   {
+      Primitive& primitive;
+
+      explicit waiter_awaitable( Primitive& primitive ): primitive( primitive ) {}
+      bool await_ready() { return primitive.TryAcquireFast(); }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         Attach( awaitingCoroutine );
+         bool suspended = primitive.Enqueue( *this );
+         if(!suspended) Detach();
+         return suspended;
+      }
+      void await_resume() {}
+   };
+
+   waiter_list mWaiters;
+};
+}
+
+class async_mutex;
+
+// owns a locked `async_mutex`, unlocks it on destruction. See `async_mutex::ScopedLock`
+class async_mutex_lock
+{
+public:
+   explicit async_mutex_lock( async_mutex& mutex ): mMutex( &mutex ) {}
+   async_mutex_lock( async_mutex_lock&& from ) noexcept: mMutex( from.mMutex ) { from.mMutex = nullptr; }
+   async_mutex_lock( const async_mutex_lock& ) = delete;
+   async_mutex_lock& operator=( const async_mutex_lock& ) = delete;
+   ~async_mutex_lock();
+
+protected:
+   async_mutex* mMutex;
+};
+
+/**
+ * \brief `co_await mutex.Lock()` ... `mutex.Unlock()`, or `auto lock = co_await mutex.ScopedLock()`.
+ *        Unlock hands the mutex straight to the longest waiting coroutine.
+ */
+class async_mutex: public detail::async_waitable<async_mutex>
+{
+   friend class detail::async_waitable<async_mutex>;
+public:
+   using lock_awaitable = waiter_awaitable<async_mutex>;
+
+   struct scoped_lock_awaitable: lock_awaitable
+   {
+      using lock_awaitable::lock_awaitable;
+      [[nodiscard]] async_mutex_lock await_resume() { return async_mutex_lock( this->primitive ); }
+   };
+
+   bool TryLock() { return TryAcquireFast(); }
+   lock_awaitable Lock() { return lock_awaitable{ *this }; }
+   scoped_lock_awaitable ScopedLock() { return scoped_lock_awaitable{ *this }; }
+
+   void Unlock()
+   {
+      mLocked.store( false, std::memory_order_seq_cst );
+      Dispatch();
+   }
+
+protected:
+   friend struct waiter_awaitable<async_mutex>;
+   friend class async_condition_variable;
+
+   // waiters in the queue go first
+   bool TryAcquireFast() { return mWaiters.Count() == 0 && TryAcquire(); }
+
+   bool TryAcquire()
+   {
+      bool expected = false;
+      return mLocked.compare_exchange_strong( expected, true, std::memory_order_seq_cst, std::memory_order_relaxed );
+   }
+
+   void Grant( detail::waiter_chain& granted )
+   {
+      if(mWaiters.Front() != nullptr && TryAcquire()) {
+         granted.Append( *mWaiters.Pop() );
+      }
+   }
+
+   // queue an already suspended coroutine, it's rescheduled once it owns the mutex. If it does right away, it's
+   // added to `granted` for the caller to reschedule along with the others
+   void Requeue( detail::async_waiter& waiter, detail::waiter_chain& granted )
+   {
+      if(!Enqueue( waiter )) granted.Append( waiter );
+   }
+
+   std::atomic<bool> mLocked = false;
+};
+
+inline async_mutex_lock::~async_mutex_lock()
+{
+   if(mMutex) mMutex->Unlock();
+}
+
+/**
+ * \brief Readers-writer lock. Waiters are served in arrival order: a queued writer holds back the readers behind it,
+ *        and a release that lets a reader in lets in every reader queued right after it as well.
+ */
+class async_shared_mutex: public detail::async_waitable<async_shared_mutex>
+{
+   friend class detail::async_waitable<async_shared_mutex>;
+
+   struct shared_waiter: detail::async_waiter
+   {
+      async_shared_mutex& mutex;
+      bool exclusive;
+
+      shared_waiter( async_shared_mutex& mutex, bool exclusive ): mutex( mutex ), exclusive( exclusive ) {}
+      bool await_ready() { return exclusive ? mutex.TryLock() : mutex.TryLockShared(); }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         Attach( awaitingCoroutine );
+         bool suspended = mutex.Enqueue( *this );
+         if(!suspended) Detach();
+         return suspended;
+      }
+      void await_resume() {}
+   };
+
+public:
+   bool TryLock() { return mWaiters.Count() == 0 && TryAcquire( true ); }
+   bool TryLockShared() { return mWaiters.Count() == 0 && TryAcquire( false ); }
+
+   shared_waiter Lock() { return { *this, true }; }
+   shared_waiter LockShared() { return { *this, false }; }
+
+   void Unlock()
+   {
+      mState.store( 0, std::memory_order_seq_cst );
+      Dispatch();
+   }
+
+   void UnlockShared()
+   {
+      int before = mState.fetch_sub( 1, std::memory_order_seq_cst );
+      EXPECTS( before > 0 );
+      if(before == 1) Dispatch();
+   }
+
+protected:
+   static constexpr int kWriter = -1;
+
+   bool TryAcquire( bool exclusive )
+   {
+      if(exclusive) {
+         int unlocked = 0;
+         return mState.compare_exchange_strong( unlocked, kWriter, std::memory_order_seq_cst, std::memory_order_relaxed );
+      }
+      int state = mState.load( std::memory_order_relaxed );
+      while(state != kWriter) {
+         if(mState.compare_exchange_weak( state, state + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) return true;
+      }
+      return false;
+   }
+
+   void Grant( detail::waiter_chain& granted )
+   {
+      while(auto* front = static_cast<shared_waiter*>(mWaiters.Front())) {
+         if(!TryAcquire( front->exclusive )) break;
+         granted.Append( *mWaiters.Pop() );
+         if(front->exclusive) break;
+      }
+   }
+
+   // >0: reader count, kWriter: held exclusively
+   std::atomic<int> mState = 0;
+};
+
+/**
+ * \brief Counting semaphore, `co_await sem.Acquire()` ... `sem.Release()`
+ */
+class async_semaphore: public detail::async_waitable<async_semaphore>
+{
+   friend class detail::async_waitable<async_semaphore>;
+public:
+   using acquire_awaitable = waiter_awaitable<async_semaphore>;
+
+   explicit async_semaphore( int64_t initialCount ): mCount( initialCount ) {}
+
+   bool TryAcquire() { return TryAcquireFast(); }
+   acquire_awaitable Acquire() { return acquire_awaitable{ *this }; }
+
+   void Release( int64_t count = 1 )
+   {
+      mCount.fetch_add( count, std::memory_order_seq_cst );
+      Dispatch();
+   }
+
+   int64_t Count() const { return mCount.load( std::memory_order_relaxed ); }
+
+protected:
+   friend struct waiter_awaitable<async_semaphore>;
+
+   bool TryAcquireFast() { return mWaiters.Count() == 0 && TryTake(); }
+
+   bool TryTake()
+   {
+      int64_t count = mCount.load( std::memory_order_relaxed );
+      while(count > 0) {
+         if(mCount.compare_exchange_weak( count, count - 1, std::memory_order_seq_cst, std::memory_order_relaxed )) return true;
+      }
+      return false;
+   }
+
+   void Grant( detail::waiter_chain& granted )
+   {
+      while(mWaiters.Front() != nullptr && TryTake()) {
+         granted.Append( *mWaiters.Pop() );
+      }
+   }
+
+   std::atomic<int64_t> mCount;
+};
+
+/**
+ * \brief Event any number of coroutines can wait on. Once set, it stays set until `Reset`
+ */
+class async_manual_reset_event: public detail::async_waitable<async_manual_reset_event>
+{
+   friend class detail::async_waitable<async_manual_reset_event>;
+public:
+   using awaitable = waiter_awaitable<async_manual_reset_event>;
+
+   explicit async_manual_reset_event( bool initiallySet = false ): mIsSet( initiallySet ) {}
+
+   bool IsSet() const { return mIsSet.load( std::memory_order_acquire ); }
+
+   void Set()
+   {
+      mIsSet.store( true, std::memory_order_seq_cst );
+      Dispatch();
+   }
+
+   void Reset() { mIsSet.store( false, std::memory_order_relaxed ); }
+
+   awaitable operator co_await() { return awaitable{ *this }; }
+
+protected:
+   friend struct waiter_awaitable<async_manual_reset_event>;
+
+   bool TryAcquireFast() const { return IsSet(); }
+
+   void Grant( detail::waiter_chain& granted )
+   {
+      if(mIsSet.load( std::memory_order_relaxed )) {
+         granted = mWaiters.TakeAll();
+      }
+   }
+
+   std::atomic<bool> mIsSet;
+};
+
+/**
+ * \brief Single use countdown, `co_await latch` resumes once it's counted down to zero
+ */
+class async_latch
+{
+public:
+   explicit async_latch( int64_t count ): mCount( count ), mReached( count <= 0 ) {}
+
+   void CountDown( int64_t n = 1 )
+   {
+      int64_t before = mCount.fetch_sub( n, std::memory_order_acq_rel );
+      if(before > 0 && before - n <= 0) {
+         mReached.Set();
+      }
+   }
+
+   bool TryWait() const { return mReached.IsSet(); }
+
+   auto operator co_await() { return mReached.operator co_await(); }
+
+protected:
+   std::atomic<int64_t> mCount;
+   async_manual_reset_event mReached;
+};
+
+/**
+ * \brief Reusable rendezvous point for a fixed number of coroutines. `co_await barrier.ArriveAndWait()`,
+ *        the last one to arrive starts the next phase and releases the others in one batch.
+ */
+class async_barrier
+{
+public:
+   explicit async_barrier( uint32_t count ): mExpected( count ), mRemaining( count )
+   {
+      EXPECTS( count > 0 );
+   }
+
+   struct arrive_awaitable: detail::async_waiter
+   {
+      async_barrier& barrier;
+
+      explicit arrive_awaitable( async_barrier& barrier ): barrier( barrier ) {}
+      bool await_ready() const noexcept { return false; }
+
+      template<typename Promise>
+      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         Attach( awaitingCoroutine );
+         bool suspended = barrier.Arrive( *this );
+         if(!suspended) Detach();
+         return suspended;
+      }
+      void await_resume() {}
+   };
+
+   arrive_awaitable ArriveAndWait() { return arrive_awaitable{ *this }; }
+
+   uint64_t Phase() const { return mPhase.load( std::memory_order_relaxed ); }
+
+protected:
+   // false if `waiter` is the last one in, it carries on without suspending
+   bool Arrive( detail::async_waiter& waiter )
+   {
+      detail::waiter_chain released;
+      {
+         std::scoped_lock guard( mWaiters.lock );
+         if(--mRemaining > 0) {
+            mWaiters.Push( waiter );
+            return true;
+         }
+         mRemaining = mExpected;
+         mPhase.fetch_add( 1, std::memory_order_relaxed );
+         released = mWaiters.TakeAll();
+      }
+      released.ResumeAll();
+      return false;
+   }
+
+   const uint32_t mExpected;
+   uint32_t mRemaining; // guarded by the waiter lock
+   std::atomic<uint64_t> mPhase = 0;
+   detail::waiter_list mWaiters;
+};
+
+/**
+ * \brief Condition variable paired with `async_mutex`. `co_await cv.Wait( mutex )` has to be called with the mutex held,
+ *        it's held again when the coroutine resumes. Notified waiters are moved to the mutex's queue rather than woken,
+ *        so a `NotifyAll` does not stampede on the mutex. Wake ups are not spurious, but re-check the condition anyway.
+ */
+class async_condition_variable
+{
+   struct cv_waiter: detail::async_waiter
+   {
+      async_condition_variable& cv;
+      async_mutex& mutex;
+
+      cv_waiter( async_condition_variable& cv, async_mutex& mutex ): cv( cv ), mutex( mutex ) {}
+      bool await_ready() const noexcept { return false; }
+
+      template<typename Promise>
+      void await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+      {
+         Attach( awaitingCoroutine );
+         async_mutex& heldMutex = mutex;
+         {
+            std::scoped_lock guard( cv.mWaiters.lock );
+            cv.mWaiters.Push( *this );
+         }
+         // we can be notified and even resumed from here on, do not touch `this`
+         heldMutex.Unlock();
+      }
+      void await_resume() {}
+   };
+
+public:
+   cv_waiter Wait( async_mutex& mutex ) { return { *this, mutex }; }
+
+   void NotifyOne()
+   {
+      if(mWaiters.Count() == 0) return;
+      detail::async_waiter* waiter;
+      {
+         std::scoped_lock guard( mWaiters.lock );
+         waiter = mWaiters.Pop();
+      }
+      if(waiter == nullptr) return;
+      detail::waiter_chain granted;
+      Transfer( *waiter, granted );
+      granted.ResumeAll();
+   }
+
+   void NotifyAll()
+   {
+      if(mWaiters.Count() == 0) return;
+      detail::waiter_chain all;
+      {
+         std::scoped_lock guard( mWaiters.lock );
+         all = mWaiters.TakeAll();
+      }
+      detail::waiter_chain granted;
+      while(detail::async_waiter* waiter = all.Pop()) {
+         Transfer( *waiter, granted );
+      }
+      granted.ResumeAll();
+   }
+
+protected:
+   static void Transfer( detail::async_waiter& waiter, detail::waiter_chain& granted )
+   {
+      static_cast<cv_waiter&>(waiter).mutex.Requeue( waiter, granted );
+   }
+
+   detail::waiter_list mWaiters;
+};
+}
@@ -6,7 +6,7 @@ namespace co
 {
 //
 // `token` is designed as tasks that the user does not care about the result.
-// It does not have the overhead to deal with future object
+// Its result can only be read by awaiting it, there is no blocking `Result()`
 // 
 template<bool Deferred, typename T>
 class meta_token: public base_token<Deferred, meta_token, T>
@@ -17,12 +17,13 @@ public:
 
    meta_token() = default;
    meta_token( const meta_token& from ) = delete;
-   meta_token(coro_handle_t handle): base_t(handle, nullptr) {}
+   meta_token(coro_handle_t handle): base_t(handle) {}
    meta_token(meta_token&& from) noexcept: base_t(std::move(from)) {}
 
    meta_token& operator=(meta_token&& from)
    {
       std::swap(base_t::mHandle, from.mHandle);
+      std::swap(base_t::mScheduled, from.mScheduled);
       return *this;
    }
 };
@@ -44,26 +45,24 @@ class meta_task: public base_token<Deferred, meta_task, T>
 public:
    meta_task() = default;
    meta_task( const meta_task& from ) = delete;
-   meta_task(coro_handle_t handle): base_t(handle, &mFuture) {}
+   meta_task(coro_handle_t handle): base_t(handle) {}
+   meta_task(meta_task&& from) noexcept: base_t(std::move(from)) {}
 
-   meta_task(meta_task&& from) noexcept: base_t(from)
+   // block until it's done, false if it was canceled instead: there is no result then
+   bool Wait()
    {
+      EXPECTS( base_t::mHandle );
       auto& promise = base_t::mHandle.promise();
-      promise.futuerPtr = &mFuture;
+      return promise.Future().Wait( promise.Executor() );
    }
 
+   // the result stays in the coroutine frame, which the task keeps alive. There has to be one, see `Wait`
    decltype(auto) Result()
    {
-      return mFuture.Get();
-   }
-
-   ~meta_task()
-   {
+      EXPECTS( base_t::mHandle );
       auto& promise = base_t::mHandle.promise();
-      promise.futuerPtr = nullptr;
+      return promise.Future().Get( promise.Executor() );
    }
-protected:
-   future<T> mFuture;
 };
 
 template<typename T = void>
@@ -0,0 +1,98 @@
+#pragma once
+#include <chrono>
+#include <coroutine>
+#include "cancellation.hpp"
+#include "scheduler.hpp"
+
+namespace co
+{
+/**
+ * \brief Suspend the awaiting coroutine until `deadline`, on the timer wheel of the scheduler it runs on.
+ *        Nothing is blocked meanwhile, a sleeping coroutine is just the timer node inside this awaitable.
+ *        Canceling the coroutine takes the timer back and abandons it, it does not sleep it out.
+ */
+struct sleep_awaitable
+{
+   deadline_t deadline;
+   timer_node node;
+   Scheduler* timers = nullptr;
+   detail::cancelable_wait cancel;
+
+   explicit sleep_awaitable( deadline_t deadline ): deadline( deadline ) {}
+
+   bool await_ready() const noexcept { return deadline <= std::chrono::steady_clock::now(); }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+   {
+      static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      node.waiter = &promise;
+
+      Scheduler* executor = promise.Executor();
+      timers = executor ? executor : &Scheduler::CurrentOrDefault();
+      // the timer can fire, and the coroutine resume elsewhere, before this returns. Do not touch `this` afterward
+      cancel.Arm( promise, this, &OnCancel, [this] { timers->AddTimer( node, deadline ); } );
+      return true;
+   }
+
+   void await_resume() noexcept {}
+
+   static void OnCancel( void* context )
+   {
+      sleep_awaitable& self = *static_cast<sleep_awaitable*>( context );
+      // false if it fired already, the coroutine is on its way back then
+      if(self.timers->CancelTimer( self.node )) promise_base::ScheduleAbandon( *self.node.waiter );
+   }
+};
+
+inline sleep_awaitable sleep_until( deadline_t deadline )
+{
+   return sleep_awaitable( deadline );
+}
+
+inline sleep_awaitable sleep_for( std::chrono::nanoseconds duration )
+{
+   return sleep_awaitable( std::chrono::steady_clock::now() + duration );
+}
+
+/**
+ * \brief A tick every `interval`, `co_await` it for the next one. Ticks are on a fixed grid from the start, so the
+ *        time the loop body takes does not add up. Falling behind does not make it burst, the missed ticks are skipped
+ *        and reported by the `co_await` instead (1 when on time).
+ */
+class periodic
+{
+public:
+   explicit periodic( std::chrono::nanoseconds interval, deadline_t start = std::chrono::steady_clock::now() )
+      : mInterval( interval ), mNext( start + interval )
+   {
+      EXPECTS( interval.count() > 0 );
+   }
+
+   struct awaitable: sleep_awaitable
+   {
+      periodic& ticker;
+
+      explicit awaitable( periodic& ticker ): sleep_awaitable( ticker.mNext ), ticker( ticker ) {}
+
+      uint64_t await_resume() noexcept
+      {
+         auto late = std::chrono::steady_clock::now() - ticker.mNext;
+         uint64_t ticks = 1 + uint64_t( late / ticker.mInterval );
+         ticker.mNext += ticker.mInterval * ticks;
+         return ticks;
+      }
+   };
+
+   awaitable operator co_await() & noexcept { return awaitable( *this ); }
+
+   deadline_t NextTick() const { return mNext; }
+
+protected:
+   std::chrono::nanoseconds mInterval;
+   deadline_t mNext;
+};
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <atomic>
 #include <coroutine>
+#include "cancellation.hpp"
 #include "scheduler.hpp"
 #include "future.hpp"
 namespace co
@@ -12,6 +13,18 @@ class base_token;
 template<bool Deferred, template<bool, typename> typename R, typename T>
 struct token_promise;
 
+// launch every deferred token of `tokens` that was not launched yet, see `Scheduler::ScheduleBatch`
+template<typename Range>
+void launch_all( Range&& tokens, Scheduler& scheduler, ePriority priority = ePriority::Normal );
+template<typename Range>
+void launch_all( Range&& tokens, ePriority priority = ePriority::Normal );
+
+namespace detail
+{
+// how `when_all`/`when_any` get at the coroutines behind the tokens
+struct join_access;
+}
+
 
 /**
  * \brief This is used in `initial_suspend` to conditionally dispatch a job
@@ -24,7 +37,9 @@ struct token_dispatcher
 {
    using promise_t = token_promise<Deferred, R, T>;
 
-   token_dispatcher(bool shouldSuspend):shouldSuspend( shouldSuspend ) {}
+   // `current` is the scheduler of the thread creating the coroutine, eager coroutines run right away on its workers
+   token_dispatcher(Scheduler* current):current( current ), shouldSuspend( current == nullptr ) {}
+   Scheduler* current;
    bool shouldSuspend;
    bool await_ready() noexcept {
       // it will always suspend and make the decision on whether to suspend in `await_suspend`
@@ -45,7 +60,7 @@ struct token_dispatcher
          coroutine_handle<promise_t>::from_address( handle.address() );
       mSuspendedPromise = &realHandle.promise();
       ENSURES( mSuspendedPromise != nullptr );
-      // eOpState expectResumeFromState = (shouldSuspend || Instant) ? eOpState::Scheduled : eOpState::Suspended;
+      mExpectResumeFromState = eOpState::Scheduled;
       
       realHandle.promise().SetState( eOpState::Created, mExpectResumeFromState );
       if constexpr( Deferred ) {
@@ -54,6 +69,9 @@ struct token_dispatcher
          if( shouldSuspend ) {
             Scheduler::Get().Schedule( realHandle );
             // printf( "\n schedule on the job system\n" );   
+         } else {
+            // it runs inline, but it belongs to this thread's scheduler when it's resumed later
+            realHandle.promise().SetExecutor( *current );
          }
          scheduled = shouldSuspend;
       }
@@ -80,20 +98,23 @@ struct token_promise: promise_base
 {
    friend struct token_dispatcher<Deferred, R, T>;
 
-   // When move ctor is invoked in token, we will update this pointer, this might cause race condition.
-   // consider someone is trying to store value to the old future object after de-ref the pointer,
-   // and at the same time, the move happens.
-   future<T>* futuerPtr = nullptr;
-   T value;
+   // the result lives in the frame, tokens holding on to the frame read it from here
+   future<T> mResult;
+
+   token_promise() noexcept { SetAbandonHandler( &OnAbandon ); }
+
+   // no result is coming, a blocked `Result` has to hear about it
+   static std::coroutine_handle<> OnAbandon( promise_base& promise ) noexcept
+   {
+      static_cast<token_promise&>( promise ).mResult.Cancel();
+      return Finish( promise );
+   }
 
    auto initial_suspend() noexcept
    {
 
       // MSVC seems have a bug here that the promise object is initialized after the initial_suspend
-      auto& scheduler = Scheduler::Get();
-      bool isWorkerThread = scheduler.IsCurrentThreadWorker();
-
-      return token_dispatcher<Deferred, R, T>{ !isWorkerThread };
+      return token_dispatcher<Deferred, R, T>{ Scheduler::Current() };
    }
 
    template<
@@ -101,20 +122,19 @@ struct token_promise: promise_base
 		typename = std::enable_if_t<std::is_convertible_v<VALUE&&, T>>>
    void return_value( VALUE&& v )
    {
-      value = v;
-      if(futuerPtr) {
-         futuerPtr->Set( std::forward<T>(v) );
-      }
+      mResult.Set( std::forward<VALUE>( v ) );
    }
 
-   final_awaitable final_suspend()
+   final_awaitable final_suspend() noexcept
    {
       return {};
    }
 
    R<Deferred, T> get_return_object() noexcept;
 
-   const T& result() { return value; }
+   future<T>& Future() { return mResult; }
+   T& result() & { return mResult.Get(); }
+   T&& result() && { return std::move( mResult ).Get(); }
 };
 
 template<bool Deferred, template<bool, typename> typename R>
@@ -122,31 +142,35 @@ struct token_promise<Deferred, R, void>: promise_base
 {
 public:
    friend struct token_dispatcher<Deferred, R, void>;
-   future<void>* futuerPtr = nullptr;
+   future<void> mResult;
+
+   token_promise() noexcept { SetAbandonHandler( &OnAbandon ); }
+
+   static std::coroutine_handle<> OnAbandon( promise_base& promise ) noexcept
+   {
+      static_cast<token_promise&>( promise ).mResult.Cancel();
+      return Finish( promise );
+   }
 
    auto initial_suspend() noexcept
    {
       // MSVC seems have a bug here that the promise object is initialized after the  initial_suspend
-      auto& scheduler = Scheduler::Get();
-      bool isWorkerThread = scheduler.IsCurrentThreadWorker();
-
-      return token_dispatcher<Deferred, R, void>( !isWorkerThread );
+      return token_dispatcher<Deferred, R, void>( Scheduler::Current() );
    }
 
-   final_awaitable final_suspend() { return {}; }
+   final_awaitable final_suspend() noexcept { return {}; }
 
 
    R<Deferred, void> get_return_object() noexcept;
 
    void return_void() noexcept
    {
-      if(futuerPtr) {
-         futuerPtr->Set();
-      }
+      mResult.Set();
    }
 
    void unhandled_exception() noexcept { ERROR_DIE( "unhandled exception in token promsie" ); }
 
+   future<void>& Future() { return mResult; }
    void result() {}
 };
 
@@ -162,18 +186,17 @@ class base_token
 {
 public:
    static constexpr bool IsDeferred = Deferred;
+   using value_type = T;
    using promise_type = token_promise<Deferred, R, T>;
    using coro_handle_t = std::coroutine_handle<promise_type>;
 
-   base_token(coro_handle_t handle, future<T>* future = nullptr) noexcept: mHandle( handle )
+   base_token(coro_handle_t handle) noexcept: mHandle( handle )
    {
-      auto& promise = handle.promise();
-      promise.futuerPtr = future;
-      promise.MarkWaited();
+      handle.promise().MarkWaited();
    }
 
    base_token() = default;
-   base_token(base_token&& from) noexcept: mHandle( from.mHandle )
+   base_token(base_token&& from) noexcept: mHandle( from.mHandle ), mScheduled( from.mScheduled )
    {
       from.mHandle = {};
    };
@@ -184,24 +207,25 @@ public:
    {
       if( !mHandle ) return;
 
-      auto& promise = mHandle.promise();
-      eOpState state = promise.State();
-
-      // here, we intentionally do not release wait so that we can destory the handle if we know we are the only one waiting
-      int waiterCount = promise.WaiterCount();
-      if(state == eOpState::Done && waiterCount == 1) {
-         mHandle.destroy();
-         return;
+      if constexpr( Deferred ) {
+         // never launched, nobody else can reach the coroutine, it's ours to clean up
+         if( !mScheduled ) {
+            mHandle.destroy();
+            return;
+         }
       }
-     
-      promise.UnMarkWaited();
+
+      mHandle.promise().Release();
    }
+   // `TakesResult`: the awaiting coroutine gets the result, a canceled child (which has none) takes it down
+   template<bool TakesResult>
    struct awaitable_base
    {
       coro_handle_t coroutine;
-      bool requestDestroyCoroutine = false;
-      awaitable_base( coro_handle_t coroutine ) noexcept
-         : coroutine( coroutine )
+      // a lazy token nobody launched yet, it's started by the awaiting coroutine itself
+      bool startChild = false;
+      awaitable_base( coro_handle_t coroutine, bool startChild = false ) noexcept
+         : coroutine( coroutine ), startChild( startChild )
       {
          if(coroutine) {
             coroutine.promise().MarkWaited();
@@ -210,113 +234,206 @@ public:
 
       bool await_ready() const noexcept
       {
-         return !coroutine || coroutine.done();
+         return !coroutine || coroutine.promise().Ready();
       }
 
       template<typename Promise>
-      bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
+      std::coroutine_handle<> await_suspend( std::coroutine_handle<Promise> awaitingCoroutine ) noexcept
       {
-         return coroutine.promise().SetContinuation( awaitingCoroutine );
+         promise_type& child = coroutine.promise();
+         awaitingCoroutine.promise().ShareCancellation( child );
+         bool suspended = child.SetContinuation( awaitingCoroutine, TakesResult );
+
+         if(startChild) {
+            // symmetric transfer into the child: it runs right away on this thread, no trip through the queue
+            ENSURES( suspended );
+            Scheduler* executor = awaitingCoroutine.promise().Executor();
+            child.SetExecutor( executor ? *executor : Scheduler::CurrentOrDefault() );
+            return coroutine;
+         }
+
+         if(suspended) return std::noop_coroutine();
+         // the child already finished, carry on. Unless it was canceled, see `TakesDown`
+         if(promise_base::TakesDown( child, awaitingCoroutine.promise(), TakesResult )) return promise_base::Abandon( awaitingCoroutine.promise() );
+         return awaitingCoroutine;
       }
 
       ~awaitable_base()
       {
          if( !coroutine ) return;
-         promise_base& promise = coroutine.promise();
-         eOpState state = promise.State();
-         
-         bool shouldRelease = promise.WaiterCount() == 1;
-         if(state == eOpState::Done && shouldRelease) {
-            coroutine.destroy();
-            return;
-         }
-         promise.UnMarkWaited();
+         coroutine.promise().Release();
       }
    };
 
    auto operator co_await() const & noexcept
    {
-      struct awaitable: awaitable_base
+      struct awaitable: awaitable_base<!std::is_void_v<T>>
       {
-         using awaitable_base::awaitable_base;
+         using awaitable_base<!std::is_void_v<T>>::awaitable_base;
 
          decltype(auto) await_resume()
          {
-            using ret_t = decltype(this->coroutine.promise().result());
-            if constexpr (std::is_void_v<ret_t>) {
+            if constexpr (std::is_void_v<T>) {
                return;
             } else {
-               return this->coroutine ? this->coroutine.promise().result() : T{};
+               // the token keeps the frame, and so the result, alive. A canceled one has none, see `settled`
+               EXPECTS( this->coroutine );
+               return this->coroutine.promise().result();
             }
-
          }
 
       };
 
-      if constexpr (Deferred) {
-         Dispatch();
-      }
-
-      promise_base& promise = mHandle.promise();
-
-      return awaitable{ mHandle };
+      return awaitable{ mHandle, TakeStartOnAwait() };
    }
 
    auto operator co_await() const && noexcept
    {
-      struct awaitable: awaitable_base
+      struct awaitable: awaitable_base<!std::is_void_v<T>>
       {
-         using awaitable_base::awaitable_base;
+         using awaitable_base<!std::is_void_v<T>>::awaitable_base;
 
-         decltype(auto) await_resume()
+         auto await_resume()
          {
-            auto& coro = this->coroutine;
-            using ret_t = decltype(coro.promise().result());
-            if constexpr (std::is_void_v<ret_t>) {
+            if constexpr (std::is_void_v<T>) {
                return;
             } else {
-               return coro ? std::move(coro.promise()).result() : T{};
+               // the token is going away, move the result out
+               EXPECTS( this->coroutine );
+               return T( std::move( this->coroutine.promise() ).result() );
             }
-
          }
       };
 
-      if constexpr (Deferred) {
-         Dispatch();
-      }
-      promise_base& promise = mHandle.promise();
+      return awaitable{ mHandle, TakeStartOnAwait() };
+   }
+
+   // on the scheduler of the calling thread, or the default one
+   template<bool D = Deferred, typename = std::enable_if_t<D>>
+   void Launch( ePriority priority = ePriority::Normal ) const
+   {
+      Dispatch( Scheduler::CurrentOrDefault(), priority );
+   }
 
-      return awaitable{ mHandle };
+   template<bool D = Deferred, typename = std::enable_if_t<D>>
+   void Launch( Scheduler& scheduler, ePriority priority = ePriority::Normal ) const
+   {
+      Dispatch( scheduler, priority );
    }
 
-   template<typename=std::enable_if_t<Deferred>>
-   void Launch() const
+   // the coroutine, and what it awaits, is canceled along with `cancellation`. Before it's launched or awaited, as
+   // whatever it awaits meanwhile inherits the one it has then. Once only
+   void SetCancellation( const cancellation_token& cancellation ) const
    {
-      Dispatch();
+      if( mHandle && cancellation.CanBeCanceled() ) mHandle.promise().SetCancellation( *cancellation.State() );
+   }
+
+   // it ended without a result: it was abandoned, see `cancellation_source`
+   bool IsCanceled() const { return mHandle && mHandle.promise().State() == eOpState::Canceled; }
+
+   // `co_await token.settled()`: waits for it like `co_await token`, without taking the result. False if it was canceled:
+   // `co_await token` has no result to give then, and takes the awaiting coroutine down with it instead (unless `T` is
+   // void). Only needed for a child with a cancellation of its own, one canceled along with the awaiting coroutine
+   // takes that one down with it anyway
+   auto settled() const noexcept
+   {
+      struct awaitable: awaitable_base<false>
+      {
+         using awaitable_base<false>::awaitable_base;
+
+         bool await_resume() const noexcept
+         {
+            return !this->coroutine || this->coroutine.promise().State() != eOpState::Canceled;
+         }
+      };
+
+      return awaitable{ mHandle, TakeStartOnAwait() };
+   }
+
+   // queue it in the deadline lane, see `Scheduler::Schedule( promise_base&, deadline_t )`
+   template<bool D = Deferred, typename = std::enable_if_t<D>>
+   void Launch( deadline_t deadline ) const
+   {
+      if( !mScheduled ) mHandle.promise().SetDeadline( deadline );
+      Dispatch( Scheduler::CurrentOrDefault(), mHandle.promise().Priority() );
    }
 protected:
+   template<typename Range>
+   friend void launch_all( Range&& tokens, Scheduler& scheduler, ePriority priority );
+   friend struct detail::join_access;
 
    coro_handle_t mHandle;
    mutable bool mScheduled = false;
-   void Dispatch() const
+
+   // for lazy tokens nobody launched yet, the awaiting coroutine starts them itself (see `awaitable_base::await_suspend`)
+   bool TakeStartOnAwait() const
+   {
+      if constexpr( !Deferred ) {
+         return false;
+      } else {
+         if( !mHandle || mScheduled ) return false;
+         mScheduled = true;
+         return true;
+      }
+   }
+
+   void Dispatch( Scheduler& scheduler, ePriority priority ) const
    {
       if( mHandle.done() ) return;
       if( mScheduled ) return;
-      Scheduler::Get().Schedule( mHandle );
+      scheduler.Schedule( mHandle, priority );
+      mScheduled = true;
+   }
+
+   // `Dispatch` without the scheduling, for `launch_all` to hand it over along with the others
+   promise_base* TakeForBatch( ePriority priority ) const
+   {
+      if( !mHandle || mHandle.done() || mScheduled ) return nullptr;
       mScheduled = true;
+      mHandle.promise().SetPriority( priority );
+      return &mHandle.promise();
    }
 };
 
+template<typename Range>
+void launch_all( Range&& tokens, Scheduler& scheduler, ePriority priority )
+{
+   // handed over a chunk at a time, so there is nothing to allocate however many there are
+   promise_base* chunk[Scheduler::kBatchChunkSize];
+   size_t count = 0;
+   for(auto& token: tokens) {
+      static_assert(std::remove_reference_t<decltype(token)>::IsDeferred, "eager tokens are running already");
+      promise_base* promise = token.TakeForBatch( priority );
+      if(promise == nullptr) continue;
+      chunk[count++] = promise;
+      if(count == Scheduler::kBatchChunkSize) {
+         scheduler.ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+         count = 0;
+      }
+   }
+   if(count > 0) scheduler.ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+}
+
+template<typename Range>
+void launch_all( Range&& tokens, ePriority priority )
+{
+   launch_all( std::forward<Range>( tokens ), Scheduler::CurrentOrDefault(), priority );
+}
+
 template<bool Deferred, template<bool, typename> typename R, typename T>
 R<Deferred, T> token_promise<Deferred, R, T>::get_return_object() noexcept
 {
-   return R<Deferred, T>{ std::coroutine_handle<token_promise>::from_promise( *this ) };
+   auto handle = std::coroutine_handle<token_promise>::from_promise( *this );
+   BindCoroutine( handle );
+   return R<Deferred, T>{ handle };
 }
 
 template<bool Deferred, template<bool, typename> typename R>
 R<Deferred, void> token_promise<Deferred, R, void>::get_return_object() noexcept
 {
-   return R<Deferred, void>{ std::coroutine_handle<token_promise>::from_promise( *this ) };
+   auto handle = std::coroutine_handle<token_promise>::from_promise( *this );
+   BindCoroutine( handle );
+   return R<Deferred, void>{ handle };
 }
 
 }
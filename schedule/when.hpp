@@ -0,0 +1,432 @@
+#pragma once
+#include <atomic>
+#include <concepts>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "token.hpp"
+
+namespace co
+{
+// `co_await when_any(...)`: which one finished first, and its result
+template<typename T>
+struct when_any_result
+{
+   size_t index;
+   T value;
+};
+
+namespace detail
+{
+struct join_access
+{
+   template<typename Token>
+   static promise_base& Promise( const Token& token ) { return token.mHandle.promise(); }
+
+   template<typename Token>
+   static bool IsReady( const Token& token ) { return !token.mHandle || token.mHandle.promise().Ready(); }
+
+   // a lazy token nobody launched yet: mark it launched and hand it over for a batch
+   template<typename Token>
+   static promise_base* TakeForBatch( const Token& token, ePriority priority )
+   {
+      if constexpr( Token::IsDeferred ) {
+         return token.TakeForBatch( priority );
+      } else {
+         return nullptr;
+      }
+   }
+
+   // `void` results are `std::monostate`, so they fit in tuples and variants
+   template<typename Token>
+   static auto TakeResult( Token& token )
+   {
+      if constexpr( std::is_void_v<typename Token::value_type> ) {
+         return std::monostate{};
+      } else {
+         using value_t = typename Token::value_type;
+         return value_t( std::move( token.mHandle.promise() ).result() );
+      }
+   }
+};
+
+template<typename Token>
+using join_result_t = std::conditional_t<std::is_void_v<typename Token::value_type>, std::monostate, typename Token::value_type>;
+
+template<typename T>
+concept joinable_token = requires { T::IsDeferred; typename T::value_type; typename T::promise_type; };
+
+/**
+ * \brief `when_all`: one countdown over the children, the last one to finish resumes the awaiting coroutine.
+ *        The awaiting coroutine counts as one more child until it's done attaching the others, so nobody can resume it
+ *        while it's still attaching. If any of them was canceled, the awaiting coroutine is abandoned instead, still
+ *        only once they are all done.
+ */
+class all_join final: public join_node
+{
+public:
+   explicit all_join( size_t childCount ): mRemaining( childCount + 1 ) {}
+
+   std::coroutine_handle<> ChildDone( promise_base& child ) noexcept override
+   {
+      if(child.State() == eOpState::Canceled) mCanceled.store( true, std::memory_order_relaxed );
+      if(mRemaining.fetch_sub( 1, std::memory_order_acq_rel ) != 1) return std::noop_coroutine();
+      if(mCanceled.load( std::memory_order_relaxed )) return promise_base::AbandonWith( *mWaiter );
+      return promise_base::ContinueWith( *mWaiter );
+   }
+
+   template<typename Promise>
+   void Begin( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      mWaiter = &promise;
+   }
+
+   void Attach( promise_base& child )
+   {
+      if(child.SetJoin( *this )) return;
+      // done already, count it right away
+      if(child.State() == eOpState::Canceled) mCanceled.store( true, std::memory_order_relaxed );
+      mRemaining.fetch_sub( 1, std::memory_order_acq_rel );
+   }
+
+   // false if the children are all done already, the awaiting coroutine just carries on
+   bool End()
+   {
+      if(mRemaining.fetch_sub( 1, std::memory_order_acq_rel ) != 1) return true;
+      if(mCanceled.load( std::memory_order_relaxed )) {
+         promise_base::Abandon( *mWaiter ).resume();
+         return true;
+      }
+      mWaiter->SetState( eOpState::Suspended, eOpState::Processing );
+      return false;
+   }
+
+protected:
+   std::atomic<size_t> mRemaining;
+   // set before the countdown, read by whoever takes it to 0
+   std::atomic<bool> mCanceled = false;
+   promise_base* mWaiter = nullptr;
+};
+
+/**
+ * \brief `when_any`: the first child to finish wins. It resumes the awaiting coroutine, unless the awaiting coroutine is
+ *        still attaching, then that one carries on instead (whoever of the two comes second).
+ *        The losers keep running, the join waits for the ones in `ChildDone` and detaches the others when it goes away.
+ *        Canceled children do not win. If they all are, the last of them abandons the awaiting coroutine the same way.
+ */
+class any_join final: public join_node
+{
+public:
+   explicit any_join( size_t childCount ): mRemaining( childCount ) {}
+   ~any_join()
+   {
+      // children not attached anymore are accounted for by `DetachAll`, this only waits out a `ChildDone` in progress
+      while(mInFlight.load( std::memory_order_acquire ) > 0) CpuRelax();
+   }
+
+   std::coroutine_handle<> ChildDone( promise_base& child ) noexcept override
+   {
+      bool resume = Settle( child );
+      promise_base& waiter = *mWaiter;
+      bool won = Winner() != nullptr;
+      // the last touch, the join can be gone right after
+      mInFlight.fetch_sub( 1, std::memory_order_acq_rel );
+      if(!resume) return std::noop_coroutine();
+      return won ? promise_base::ContinueWith( waiter ) : promise_base::AbandonWith( waiter );
+   }
+
+   template<typename Promise>
+   void Begin( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      promise_base& promise = awaitingCoroutine.promise();
+      promise.BindCoroutine( awaitingCoroutine );
+      promise.SetState( eOpState::Processing, eOpState::Suspended );
+      mWaiter = &promise;
+   }
+
+   void Attach( promise_base& child )
+   {
+      mInFlight.fetch_add( 1, std::memory_order_relaxed );
+      if(child.SetJoin( *this )) return;
+      // done already
+      mInFlight.fetch_sub( 1, std::memory_order_relaxed );
+      Settle( child );
+   }
+
+   // false if there is a winner already, the awaiting coroutine just carries on
+   bool End()
+   {
+      if(mGate.fetch_sub( 1, std::memory_order_acq_rel ) != 1) return true;
+      if(Winner() == nullptr) {
+         promise_base::Abandon( *mWaiter ).resume();
+         return true;
+      }
+      mWaiter->SetState( eOpState::Suspended, eOpState::Processing );
+      return false;
+   }
+
+   promise_base* Winner() const { return mWinner.load( std::memory_order_acquire ); }
+
+   // the losers still running do not continue into the join anymore
+   void Detach( promise_base& child )
+   {
+      if(child.DetachJoin()) mInFlight.fetch_sub( 1, std::memory_order_acq_rel );
+   }
+
+protected:
+   // Whether `child` settles the join: it's the winner, or the last one canceled (a winner never counts down, so that
+   // means all of them were). True when it comes second, after the attaching pass
+   bool Settle( promise_base& child )
+   {
+      if(child.State() == eOpState::Canceled) {
+         if(mRemaining.fetch_sub( 1, std::memory_order_acq_rel ) != 1) return false;
+      } else {
+         promise_base* none = nullptr;
+         if(!mWinner.compare_exchange_strong( none, &child, std::memory_order_acq_rel )) return false;
+      }
+      return mGate.fetch_sub( 1, std::memory_order_acq_rel ) == 1;
+   }
+
+   std::atomic<promise_base*> mWinner = nullptr;
+   // children that are not known to be canceled yet
+   std::atomic<size_t> mRemaining;
+   std::atomic<int> mGate = 2;
+   // children attached that did not get through `ChildDone` yet
+   std::atomic<size_t> mInFlight = 0;
+   promise_base* mWaiter = nullptr;
+};
+
+template<typename Join, typename Promise, typename ForEachChild>
+bool SuspendOnJoin( Join& join, std::coroutine_handle<Promise> awaitingCoroutine, ForEachChild&& forEachChild )
+{
+   static_assert(std::is_base_of<promise_base, Promise>::value, "Promise should be derived from promise_base");
+   promise_base& promise = awaitingCoroutine.promise();
+   join.Begin( awaitingCoroutine );
+
+   // the lazy ones are started along with the others, in one batch, in the awaiting coroutine's lane
+   Scheduler* executor = promise.Executor();
+   Scheduler& scheduler = executor ? *executor : Scheduler::CurrentOrDefault();
+   ePriority priority = promise.Priority();
+   promise_base* chunk[Scheduler::kBatchChunkSize];
+   size_t count = 0;
+   forEachChild( [&]( const auto& token ) {
+      promise_base& child = join_access::Promise( token );
+      promise.ShareCancellation( child );
+      join.Attach( child );
+      if(promise_base* start = join_access::TakeForBatch( token, priority )) {
+         chunk[count++] = start;
+         if(count == Scheduler::kBatchChunkSize) {
+            scheduler.ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+            count = 0;
+         }
+      }
+   } );
+   if(count > 0) scheduler.ScheduleBatch( std::span<promise_base* const>( chunk, count ) );
+
+   return join.End();
+}
+}
+
+/**
+ * \brief `co_await when_all( a, b, c )`: all of them at once, resumes with a tuple of their results once all finished.
+ *        No coroutine per child, they continue into one countdown in the awaiting frame. `void` results are `std::monostate`.
+ *        The children inherit the awaiting coroutine's cancellation. If one of them is canceled, there is no tuple: the
+ *        awaiting coroutine is abandoned, once all of them are done.
+ */
+template<typename... Tokens>
+class when_all_awaitable
+{
+public:
+   explicit when_all_awaitable( Tokens&&... tokens ): mTokens( std::move( tokens )... ), mJoin( sizeof...(Tokens) ) {}
+
+   bool await_ready() const
+   {
+      return std::apply( []( const auto&... token ) { return (detail::join_access::IsReady( token ) && ...); }, mTokens );
+   }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      return detail::SuspendOnJoin( mJoin, awaitingCoroutine, [this]( auto&& visit ) {
+         std::apply( [&]( const auto&... token ) { (visit( token ), ...); }, mTokens );
+      } );
+   }
+
+   std::tuple<detail::join_result_t<Tokens>...> await_resume()
+   {
+      return std::apply( []( auto&... token ) {
+         return std::tuple<detail::join_result_t<Tokens>...>( detail::join_access::TakeResult( token )... );
+      }, mTokens );
+   }
+
+protected:
+   std::tuple<Tokens...> mTokens;
+   detail::all_join mJoin;
+};
+
+// `when_all` over any number of tokens of one type, resumes with their results in order (nothing for `void` ones)
+template<typename Token>
+class when_all_range_awaitable
+{
+public:
+   explicit when_all_range_awaitable( std::vector<Token> tokens ): mTokens( std::move( tokens ) ), mJoin( mTokens.size() ) {}
+
+   bool await_ready() const
+   {
+      for(const Token& token: mTokens) {
+         if(!detail::join_access::IsReady( token )) return false;
+      }
+      return true;
+   }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      return detail::SuspendOnJoin( mJoin, awaitingCoroutine, [this]( auto&& visit ) {
+         for(const Token& token: mTokens) visit( token );
+      } );
+   }
+
+   auto await_resume()
+   {
+      if constexpr( std::is_void_v<typename Token::value_type> ) {
+         return;
+      } else {
+         std::vector<typename Token::value_type> results;
+         results.reserve( mTokens.size() );
+         for(Token& token: mTokens) {
+            results.push_back( detail::join_access::TakeResult( token ) );
+         }
+         return results;
+      }
+   }
+
+protected:
+   std::vector<Token> mTokens;
+   detail::all_join mJoin;
+};
+
+/**
+ * \brief `co_await when_any( a, b, c )`: all of them at once, resumes as soon as the first one finished, with its index and
+ *        result (a variant, by index). The others keep running, unattended. Canceled ones do not count, and if they all are,
+ *        the awaiting coroutine is abandoned.
+ */
+template<typename... Tokens>
+class when_any_awaitable
+{
+public:
+   using value_t = std::variant<detail::join_result_t<Tokens>...>;
+
+   explicit when_any_awaitable( Tokens&&... tokens ): mTokens( std::move( tokens )... ), mJoin( sizeof...(Tokens) ) {}
+   ~when_any_awaitable()
+   {
+      std::apply( [this]( const auto&... token ) { (mJoin.Detach( detail::join_access::Promise( token ) ), ...); }, mTokens );
+   }
+
+   bool await_ready() const { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      return detail::SuspendOnJoin( mJoin, awaitingCoroutine, [this]( auto&& visit ) {
+         std::apply( [&]( const auto&... token ) { (visit( token ), ...); }, mTokens );
+      } );
+   }
+
+   when_any_result<value_t> await_resume()
+   {
+      return TakeWinner( std::index_sequence_for<Tokens...>{} );
+   }
+
+protected:
+   template<size_t... Index>
+   when_any_result<value_t> TakeWinner( std::index_sequence<Index...> )
+   {
+      promise_base* winner = mJoin.Winner();
+      std::optional<when_any_result<value_t>> result;
+      ((!result && &detail::join_access::Promise( std::get<Index>( mTokens ) ) == winner
+         ? (void)result.emplace( when_any_result<value_t>{ Index, value_t( std::in_place_index<Index>, detail::join_access::TakeResult( std::get<Index>( mTokens ) ) ) } )
+         : (void)0), ...);
+      ENSURES( result.has_value() );
+      return std::move( *result );
+   }
+
+   std::tuple<Tokens...> mTokens;
+   detail::any_join mJoin;
+};
+
+template<typename Token>
+class when_any_range_awaitable
+{
+public:
+   using value_t = detail::join_result_t<Token>;
+
+   explicit when_any_range_awaitable( std::vector<Token> tokens ): mTokens( std::move( tokens ) ), mJoin( mTokens.size() )
+   {
+      EXPECTS( !mTokens.empty() );
+   }
+   ~when_any_range_awaitable()
+   {
+      for(const Token& token: mTokens) mJoin.Detach( detail::join_access::Promise( token ) );
+   }
+
+   bool await_ready() const { return false; }
+
+   template<typename Promise>
+   bool await_suspend( std::coroutine_handle<Promise> awaitingCoroutine )
+   {
+      return detail::SuspendOnJoin( mJoin, awaitingCoroutine, [this]( auto&& visit ) {
+         for(const Token& token: mTokens) visit( token );
+      } );
+   }
+
+   when_any_result<value_t> await_resume()
+   {
+      promise_base* winner = mJoin.Winner();
+      for(size_t i = 0; i < mTokens.size(); ++i) {
+         if(&detail::join_access::Promise( mTokens[i] ) == winner) {
+            return { i, detail::join_access::TakeResult( mTokens[i] ) };
+         }
+      }
+      ERROR_DIE( "the winner is one of ours" );
+      return { mTokens.size(), value_t() };
+   }
+
+protected:
+   std::vector<Token> mTokens;
+   detail::any_join mJoin;
+};
+
+// The tokens are moved in. Lazy ones not launched yet are launched along with the others
+template<typename... Tokens>
+   requires (detail::joinable_token<Tokens> && ...)
+when_all_awaitable<Tokens...> when_all( Tokens&&... tokens )
+{
+   return when_all_awaitable<Tokens...>( std::move( tokens )... );
+}
+
+template<typename Token>
+when_all_range_awaitable<Token> when_all( std::vector<Token> tokens )
+{
+   return when_all_range_awaitable<Token>( std::move( tokens ) );
+}
+
+template<typename... Tokens>
+   requires (sizeof...(Tokens) > 0 && (detail::joinable_token<Tokens> && ...))
+when_any_awaitable<Tokens...> when_any( Tokens&&... tokens )
+{
+   return when_any_awaitable<Tokens...>( std::move( tokens )... );
+}
+
+template<typename Token>
+when_any_range_awaitable<Token> when_any( std::vector<Token> tokens )
+{
+   return when_any_range_awaitable<Token>( std::move( tokens ) );
+}
+}
@@ -1,16 +1,42 @@
 #pragma once
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include "Windows.h"
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <thread>
 #include <random>
 //////////////////////////////////
 ///////////// MACROS /////////////
 //////////////////////////////////
 
-#define ASSERT_DIE(condition) {if(!(condition)) DebugBreak();}
-#define ERROR_DIE(msg) DebugBreak();
+#if defined(_WIN32)
+#define DEBUG_BREAK() DebugBreak()
+#else
+#define DEBUG_BREAK() __builtin_trap()
+#endif
+
+#define ASSERT_DIE(condition) {if(!(condition)) DEBUG_BREAK();}
+#define ERROR_DIE(msg) DEBUG_BREAK();
 #define ENSURES(condition) ASSERT_DIE(condition)
 #define EXPECTS(condition) ASSERT_DIE(condition)
 
@@ -26,6 +52,8 @@ using uint = std::uint32_t;
 /////////// functions ////////////
 //////////////////////////////////
 
+#if defined(_WIN32)
+
 inline uint QuerySystemCoreCount()
 {
    SYSTEM_INFO info;
@@ -38,7 +66,118 @@ inline void SetThreadName( std::thread& thread, const wchar_t* name )
    SetThreadDescription( thread.native_handle(), name );
 }
 
-namespace random {
+inline void SetCurrentThreadName( const wchar_t* name )
+{
+   SetThreadDescription( GetCurrentThread(), name );
+}
+
+inline void SetThreadAffinity( std::thread& thread, uint cpu )
+{
+   SetThreadAffinityMask( thread.native_handle(), DWORD_PTR( 1 ) << cpu );
+}
+
+#else
+
+namespace platform {
+// cgroup cpu quota in cores (rounded up), 0 if there is no quota
+inline uint QueryCgroupCpuLimit()
+{
+   long long quota = -1, period = 0;
+
+   // cgroup v2
+   if(FILE* f = fopen( "/sys/fs/cgroup/cpu.max", "r" )) {
+      char max[32] = {};
+      if(fscanf( f, "%31s %lld", max, &period ) == 2 && max[0] != 'm') {
+         quota = atoll( max );
+      }
+      fclose( f );
+   } else if(FILE* fq = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r" )) {
+      // cgroup v1
+      if(fscanf( fq, "%lld", &quota ) != 1) quota = -1;
+      fclose( fq );
+      if(FILE* fp = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r" )) {
+         if(fscanf( fp, "%lld", &period ) != 1) period = 0;
+         fclose( fp );
+      }
+   }
+
+   if(quota <= 0 || period <= 0) return 0;
+   return uint( (quota + period - 1) / period );
+}
+
+// narrow the name and clamp it to what pthread accepts (15 chars + null)
+inline void NarrowThreadName( const wchar_t* name, char (&out)[16] )
+{
+   size_t i = 0;
+   for(; i < sizeof(out) - 1 && name[i] != L'\0'; ++i) {
+      out[i] = name[i] < 0x80 ? char( name[i] ) : '?';
+   }
+   out[i] = '\0';
+}
+}
+
+inline uint QuerySystemCoreCount()
+{
+   uint count = 0;
+#if defined(__linux__)
+   cpu_set_t set;
+   CPU_ZERO( &set );
+   if(sched_getaffinity( 0, sizeof(set), &set ) == 0) {
+      count = uint( CPU_COUNT( &set ) );
+   }
+#endif
+   if(count == 0) {
+      long online = sysconf( _SC_NPROCESSORS_ONLN );
+      count = online > 0 ? uint( online ) : 1;
+   }
+
+   uint limit = platform::QueryCgroupCpuLimit();
+   if(limit > 0) {
+      count = std::min( count, limit );
+   }
+   return std::max( count, 1u );
+}
+
+inline void SetThreadName( std::thread& thread, const wchar_t* name )
+{
+   char narrow[16];
+   platform::NarrowThreadName( name, narrow );
+#if defined(__APPLE__)
+   // darwin can only name the calling thread
+   (void)thread;
+#else
+   pthread_setname_np( thread.native_handle(), narrow );
+#endif
+}
+
+inline void SetCurrentThreadName( const wchar_t* name )
+{
+   char narrow[16];
+   platform::NarrowThreadName( name, narrow );
+#if defined(__APPLE__)
+   pthread_setname_np( narrow );
+#else
+   pthread_setname_np( pthread_self(), narrow );
+#endif
+}
+
+inline void SetThreadAffinity( std::thread& thread, uint cpu )
+{
+#if defined(__linux__)
+   cpu_set_t set;
+   CPU_ZERO( &set );
+   CPU_SET( cpu, &set );
+   pthread_setaffinity_np( thread.native_handle(), sizeof(set), &set );
+#else
+   // no thread affinity on darwin
+   (void)thread;
+   (void)cpu;
+#endif
+}
+
+#endif
+
+namespace rng {
 inline float Between(float fromInclusive, float toInclusive)
 {
    static thread_local std::mt19937 generator;
@@ -52,6 +191,96 @@ inline float Between01()
 };
 
 
+// hint the cpu we are in a spin wait loop
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+   _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+   __asm__ __volatile__( "yield" );
+#else
+   std::this_thread::yield();
+#endif
+}
+
+// for a handful of instructions worth of critical section only, it never sleeps.
+// lower case methods so it plugs into std::scoped_lock
+class SpinLock
+{
+public:
+   void lock()
+   {
+      while(mLocked.exchange( true, std::memory_order_acquire )) {
+         while(mLocked.load( std::memory_order_relaxed )) CpuRelax();
+      }
+   }
+   bool try_lock() { return !mLocked.load( std::memory_order_relaxed ) && !mLocked.exchange( true, std::memory_order_acquire ); }
+   void unlock() { mLocked.store( false, std::memory_order_release ); }
+protected:
+   std::atomic<bool> mLocked = false;
+};
+
+
+//////////////////////////////////
+///////////// Futex //////////////
+//////////////////////////////////
+
+// Block while `word == expected`. Spurious wake ups are possible, callers should re-check their condition.
+inline void FutexWait( std::atomic<uint32_t>& word, uint32_t expected )
+{
+#if defined(_WIN32)
+   WaitOnAddress( &word, &expected, sizeof(expected), INFINITE );
+#elif defined(__linux__)
+   syscall( SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0 );
+#else
+   word.wait( expected, std::memory_order_acquire );
+#endif
+}
+
+// `FutexWait` that gives up after `timeout`
+inline void FutexWaitFor( std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout )
+{
+#if defined(_WIN32)
+   // round up, a short wait should not turn into a spin
+   DWORD ms = DWORD( (timeout.count() + 999'999) / 1'000'000 );
+   WaitOnAddress( &word, &expected, sizeof(expected), ms );
+#elif defined(__linux__)
+   timespec relative;
+   relative.tv_sec = time_t( timeout.count() / 1'000'000'000 );
+   relative.tv_nsec = long( timeout.count() % 1'000'000'000 );
+   syscall( SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, expected, &relative, nullptr, 0 );
+#else
+   // no timed wait on std::atomic, poll
+   auto until = std::chrono::steady_clock::now() + timeout;
+   while(word.load( std::memory_order_acquire ) == expected && std::chrono::steady_clock::now() < until) {
+      std::this_thread::yield();
+   }
+#endif
+}
+
+inline void FutexWakeOne( std::atomic<uint32_t>& word )
+{
+#if defined(_WIN32)
+   WakeByAddressSingle( &word );
+#elif defined(__linux__)
+   syscall( SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0 );
+#else
+   word.notify_one();
+#endif
+}
+
+inline void FutexWakeAll( std::atomic<uint32_t>& word )
+{
+#if defined(_WIN32)
+   WakeByAddressAll( &word );
+#elif defined(__linux__)
+   syscall( SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0 );
+#else
+   word.notify_all();
+#endif
+}
+
+
 //////////////////////////////////
 //////////// SysEvent ////////////
 //////////////////////////////////
@@ -66,12 +295,20 @@ public:
    void Reset();
    bool IsTriggered() const;
 protected:
+#if defined(_WIN32)
    void* mHandle;
    bool mManualReset;
    std::atomic<bool> mIsTriggered;
+#else
+   // futex word, 1 when triggered. The kernel is only involved when there is someone sleeping on it
+   std::atomic<uint32_t> mIsTriggered = 0;
+   std::atomic<uint32_t> mWaiterCount = 0;
+   bool mManualReset;
+#endif
 };
 
 
+#if defined(_WIN32)
 
 inline SysEvent::SysEvent( bool manualReset )
 {
@@ -101,7 +338,7 @@ inline void SysEvent::Trigger()
    ASSERT_DIE( mHandle != nullptr );
    BOOL ret = SetEvent( mHandle );
    ASSERT_DIE( ret != 0 );
-   mIsTriggered = ret != 0; 
+   mIsTriggered = ret != 0;
 }
 inline void SysEvent::Reset()
 {
@@ -110,9 +347,51 @@ inline void SysEvent::Reset()
    mIsTriggered = false;
 }
 
-inline bool SysEvent::IsTriggered() const
+#else
+
+inline SysEvent::SysEvent( bool manualReset )
+   : mManualReset( manualReset ) {}
+
+inline SysEvent::~SysEvent() {}
+
+inline bool SysEvent::Wait()
+{
+   while(true) {
+      if(mManualReset) {
+         if(mIsTriggered.load( std::memory_order_acquire ) != 0) return true;
+      } else {
+         uint32_t expected = 1;
+         if(mIsTriggered.compare_exchange_strong( expected, 0, std::memory_order_acquire )) return true;
+      }
+
+      // announce ourselves before sleeping so `Trigger` knows it has to go to the kernel
+      mWaiterCount.fetch_add( 1, std::memory_order_seq_cst );
+      FutexWait( mIsTriggered, 0 );
+      mWaiterCount.fetch_sub( 1, std::memory_order_relaxed );
+   }
+}
+
+inline void SysEvent::Trigger()
 {
-   return mIsTriggered.load();
+   mIsTriggered.store( 1, std::memory_order_seq_cst );
+   if(mWaiterCount.load( std::memory_order_seq_cst ) == 0) return;
+
+   if(mManualReset) {
+      FutexWakeAll( mIsTriggered );
+   } else {
+      FutexWakeOne( mIsTriggered );
+   }
 }
 
+inline void SysEvent::Reset()
+{
+   mIsTriggered.store( 0, std::memory_order_release );
+}
+
+#endif
+
+inline bool SysEvent::IsTriggered() const
+{
+   return mIsTriggered.load() != 0;
+}
 